@@ -2,142 +2,74 @@
 
 #include <openvdb/openvdb.h>
 #include <iostream>
-#include <fstream>
+#include <string>
 #include <vector>
-#include <tuple>
-#include <cmath>  // for fabs()
 
-using namespace std;
-
-// Function to read a matrix from a .mtx file and return it as a vector of triplets (row, col, value)
-vector<tuple<int, int, double>> readMatrixFromFile(const string& filename, int& rows, int& cols)
-{
-    vector<tuple<int, int, double>> matrixData;
-
-    ifstream file(filename);
-    if (!file.is_open()) {
-        cerr << "Error: Unable to open file " << filename << endl;
-        exit(1);
-    }
-
-    string line;
-    bool isHeader = true;
-
-    while (getline(file, line)) {
-        if (line[0] == '%' || line.empty()) {
-            // Skip comment lines or empty lines
-            continue;
-        }
-
-        if (isHeader) {
-            // Read the matrix size from the header (rows, cols, non-zeros)
-            isHeader = false;
-            stringstream ss(line);
-            int nonZeroElements;
-            ss >> rows >> cols >> nonZeroElements;  // Read the dimensions and the number of non-zero elements
-        } else {
-            // Read the matrix data (row, col, value)
-            stringstream ss(line);
-            int row, col;
-            double value;
-            ss >> row >> col >> value;
-
-            // MatrixMarket is 1-based, convert to 0-based
-            row--;
-            col--;
-
-            // Store the triplet (row, col, value)
-            matrixData.emplace_back(row, col, value);
-        }
-    }
-
-    file.close();
-    return matrixData;
-}
-
-// Function to multiply two sparse matrices and return the result
-vector<tuple<int, int, double>> multiplyMatrices(const vector<tuple<int, int, double>>& A, int rowsA, int colsA,
-                                                const vector<tuple<int, int, double>>& B, int rowsB, int colsB)
-{
-    vector<tuple<int, int, double>> result;
-
-    // Create a sparse matrix for the result, assuming it's initialized to zero
-    // Here, you can use a more efficient method with hash maps if the data is large
-
-    for (const auto& [rowA, colA, valueA] : A) {
-        for (const auto& [rowB, colB, valueB] : B) {
-            if (colA == rowB) {  // Check for matching indices for matrix multiplication
-                result.emplace_back(rowA, colB, valueA * valueB);
-            }
-        }
-    }
-
-    return result;
-}
-
-// Function to multiply a matrix by a scalar and return the result
-vector<tuple<int, int, double>> scalarMultiplyMatrix(const vector<tuple<int, int, double>>& A, double scalar)
-{
-    vector<tuple<int, int, double>> result;
+#include "csr_matrix.h"
+#include "matrix_chain.h"
+#include "matrix_compare.h"
+#include "matrix_market.h"
+#include "matrix_trace.h"
 
-    for (const auto& [row, col, value] : A) {
-        result.emplace_back(row, col, value * scalar);
-    }
-
-    return result;
-}
-
-// Function to compare two matrices to check if they are equal (within a tolerance for doubleing-point comparisons)
-bool compareMatrices(const vector<tuple<int, int, double>>& A, const vector<tuple<int, int, double>>& B, double tolerance = 1e-6)
-{
-    if (A.size() != B.size()) {
-        return false;  // Matrices must have the same number of non-zero elements
-    }
-
-    for (size_t i = 0; i < A.size(); ++i) {
-        int rowA, colA, rowB, colB;
-        double valueA, valueB;
-        tie(rowA, colA, valueA) = A[i];
-        tie(rowB, colB, valueB) = B[i];
-
-        if (rowA != rowB || colA != colB || fabs(valueA - valueB) > tolerance) {
-            return false;  // Matrices differ either in index or value
-        }
-    }
-
-    return true;
-}
+using namespace std;
 
-int main()
+int main(int argc, char* argv[])
 {
     // Initialize OpenVDB library
     openvdb::initialize();
 
+    // The 20x20 extracts by default, or full-size P and S given on the command line, optionally followed by a .mtx
+    // file to write PSP to. P and S come as a pair, so a lone argument is rejected rather than half-used.
+    if (argc == 2) {
+        cerr << "Usage: " << argv[0] << " [P.mtx S.mtx [PSP.mtx]]" << endl;
+        return 1;
+    }
+    string fileP = argc > 2 ? argv[1] : "/home/hp/GitHub/open_vdb_programs/submatrix_P_20x20.mtx";
+    string fileS = argc > 2 ? argv[2] : "/home/hp/GitHub/open_vdb_programs/submatrix_S_20x20.mtx";
+    string filePSP = argc > 3 ? argv[3] : "";
+    const double tolerance = 1e-6;
+
     // Matrix dimensions
     int rowsP = 0, colsP = 0;
     int rowsS = 0, colsS = 0;
 
-    // Read matrices P and S from files
-    vector<tuple<int, int, double>> matrixP = readMatrixFromFile("/home/hp/GitHub/open_vdb_programs/submatrix_P_20x20.mtx", rowsP, colsP);
-    vector<tuple<int, int, double>> matrixS = readMatrixFromFile("/home/hp/GitHub/open_vdb_programs/submatrix_S_20x20.mtx", rowsS, colsS);
-
-    // Step 1: Multiply P * S
-    vector<tuple<int, int, double>> PS = multiplyMatrices(matrixP, rowsP, colsP, matrixS, rowsS, colsS);
-
-    // Step 2: Multiply (P * S) * P
-    vector<tuple<int, int, double>> PSP = multiplyMatrices(PS, rowsP, colsS, matrixP, rowsP, colsP);
-
-    // Step 3: Compute 2 * P
-    vector<tuple<int, int, double>> doubleP = scalarMultiplyMatrix(matrixP, 2.0f);
-
-    // Step 4: Compare PSP with 2 * P
-    bool areEqual = compareMatrices(PSP, doubleP);
+    // Read matrices P and S from files into grids, and the chain P * S * P into compressed rows, P only once
+    vector<openvdb::FloatGrid::ConstPtr> grids = {readMatrixGrid(fileP, rowsP, colsP), readMatrixGrid(fileS, rowsS, colsS)};
+    grids.push_back(grids[0]);
+    GridChainT<float> factors = readGridChain(grids, {{rowsP, colsP}, {rowsS, colsS}, {rowsP, colsP}});
+    const vector<const CsrMatrix *> &chain = factors.chain;
+    const CsrMatrix &P = *chain[0];
+
+    // Step 1: Pick the cheaper of (P * S) * P and P * (S * P) from the sparsity of P and S
+    ChainPlan plan = planMatrixChain(chain);
+    cout << "Evaluation order: " << formatChainPlan(plan, {"P", "S", "P"}) << " (about " << plan.flops
+         << " multiply-adds)" << endl;
+
+    // Step 2: Form the first product and stream the rows of the last one against 2 * P without storing PSP
+    MatrixDifference difference = compareChain(chain, plan, P, 2.0);
+
+    cout << "||PSP - 2P||_F = " << difference.frobenius() << endl;
+    cout << "max |PSP - 2P| = " << difference.maxAbs;
+    if (difference.maxRow >= 0) {
+        cout << " at (" << difference.maxRow + 1 << ", " << difference.maxCol + 1 << ")";
+    }
+    cout << endl;
 
-    if (areEqual) {
+    // Step 3: Compare PSP with 2 * P
+    if (difference.maxAbs <= tolerance) {
         cout << "PSP is equal to 2P!" << endl;
     } else {
         cout << "PSP is NOT equal to 2P." << endl;
     }
 
+    // Step 4: Check the electron count, trace(PSP) = trace(2P), again without storing PSP
+    cout << "trace(PSP) = " << traceOfChain(chain, plan) << ", trace(2P) = " << 2.0 * traceOfCsr(P) << endl;
+
+    // Step 5: Stream PSP to disk a block of rows at a time, if asked to
+    if (!filePSP.empty()) {
+        writeChainMatrixMarket(filePSP, chain, plan, "PSP of " + fileP + " and " + fileS);
+        cout << "PSP written to " << filePSP << endl;
+    }
+
     return 0;
 }
@@ -0,0 +1,599 @@
+#pragma once
+
+#include "csr_matrix.h"
+#include "dense_matrix.h"
+#include "matrix_layout.h"
+#include "sparse_multiply.h"
+
+#include <openvdb/openvdb.h>
+#include <openvdb/tools/Prune.h>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Forms a matrix can be kept in between products
+enum class MatrixStorage
+{
+    Grid,  // OpenVDB grid: memory follows the occupied leaves, with no per-row arrays
+    Csr,   // compressed rows: 12 bytes per float entry plus 8 per row
+    Dense  // every entry, row-major: 4 bytes per float entry, no indices at all
+};
+
+// Function to return the name of a storage form as it is logged
+inline const char *matrixStorageName(MatrixStorage storage)
+{
+    switch (storage)
+    {
+    case MatrixStorage::Grid:
+        return "grid";
+    case MatrixStorage::Csr:
+        return "csr";
+    default:
+        return "dense";
+    }
+}
+
+// Thresholds of the storage and kernel choices. The two costs are single-core times per multiply-add measured on
+// uniform 2000 x 2000 products of 1% to 40% fill; only their ratio, the fill of B at which the kernels break even,
+// matters, so it carries over between machines better than either of them alone.
+struct StorageOptions
+{
+    int bandRows = 256;                  // rows per band that density is measured and a kernel chosen for
+    double denseFill = 0.25;             // keep a matrix dense from this fraction of nonzero entries on
+    double gridEntriesPerRow = 1.0;      // keep a matrix in a grid below this many entries per row
+    double rowWiseNs = 3.5;              // one multiply-add of the row-wise product, scatter included
+    double denseRowNs = 0.5;             // one multiply-add of the dense-row kernel, which also multiplies zeros
+    size_t denseBytes = size_t(1) << 30; // largest dense copy of B a product may make
+};
+
+// Nonzero entries of a matrix, in total and per band of bandRows rows
+struct MatrixDensity
+{
+    int rows = 0;
+    int cols = 0;
+    int bandRows = 0;
+    size_t nonZeros = 0;
+    std::vector<size_t> bandNonZeros;
+
+    double fill() const
+    {
+        return rows > 0 && cols > 0 ? static_cast<double>(nonZeros) / (static_cast<double>(rows) * cols) : 0.0;
+    }
+    double entriesPerRow() const { return rows > 0 ? static_cast<double>(nonZeros) / rows : 0.0; }
+
+    double bandFill(size_t b) const
+    {
+        const int bandSize = std::min(bandRows, rows - static_cast<int>(b) * bandRows);
+        return bandSize > 0 && cols > 0 ? static_cast<double>(bandNonZeros[b]) / (static_cast<double>(bandSize) * cols) : 0.0;
+    }
+};
+
+// Function to measure the density of compressed rows, in total and per band of bandRows rows
+template <typename ValueType>
+inline MatrixDensity measureDensity(const CsrMatrixT<ValueType> &M, int bandRows = 256)
+{
+    MatrixDensity density;
+    density.rows = M.rows;
+    density.cols = M.cols;
+    density.bandRows = bandRows;
+    density.nonZeros = M.nonZeros();
+    const int numBands = (M.rows + bandRows - 1) / bandRows;
+    density.bandNonZeros.resize(numBands);
+    for (int b = 0; b < numBands; ++b)
+    {
+        density.bandNonZeros[b] = M.rowStart[std::min(M.rows, (b + 1) * bandRows)] - M.rowStart[b * bandRows];
+    }
+    return density;
+}
+
+// Function to measure the density of a matrix grid's rows x cols window without copying its entries.
+// Each leaf-high block of rows is counted by a single task; symmetric grids are expanded through gridToCsr first.
+template <typename Layout = SliceLayout, typename GridType>
+inline MatrixDensity measureDensity(const GridType &grid, int rows, int cols, int bandRows = 256)
+{
+    using ValueType = typename GridType::ValueType;
+
+    if (isMatrixSymmetric(grid))
+    {
+        return measureDensity(gridToCsr<Layout>(grid, rows, cols), bandRows);
+    }
+
+    checkMatrixLayout<Layout>(grid);
+    typename GridType::TreeType::ConstPtr tree = voxelTree(grid);
+    std::vector<const typename GridType::TreeType::LeafNodeType *> leaves = windowLeaves<Layout>(*tree, 0, 0, rows, cols);
+    std::vector<size_t> blockStart;
+    groupLeafBlocks(leaves, 0, blockStart);
+
+    std::vector<size_t> rowCounts(rows, 0);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, blockStart.size() - 1), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t b = range.begin(); b != range.end(); ++b)
+        {
+            forEachBlockEntry<Layout>(leaves, blockStart[b], blockStart[b + 1], 0, 0, rows, cols,
+                                      [&](int i, int, const ValueType &) { ++rowCounts[i]; });
+        }
+    });
+
+    MatrixDensity density;
+    density.rows = rows;
+    density.cols = cols;
+    density.bandRows = bandRows;
+    density.bandNonZeros.assign((rows + bandRows - 1) / bandRows, 0);
+    for (int i = 0; i < rows; ++i)
+    {
+        density.bandNonZeros[i / bandRows] += rowCounts[i];
+        density.nonZeros += rowCounts[i];
+    }
+    return density;
+}
+
+// Function to describe a density as it is logged, e.g. "2000 x 2000, 80000 non-zeros (2%, 40 per row, bands 1.5% to
+// 2.6%)"
+inline std::string formatDensity(const MatrixDensity &density)
+{
+    double lowest = 1.0, highest = 0.0;
+    for (size_t b = 0; b < density.bandNonZeros.size(); ++b)
+    {
+        lowest = std::min(lowest, density.bandFill(b));
+        highest = std::max(highest, density.bandFill(b));
+    }
+
+    std::ostringstream text;
+    text << std::setprecision(3) << density.rows << " x " << density.cols << ", " << density.nonZeros << " non-zeros ("
+         << 100.0 * density.fill() << "%, " << density.entriesPerRow() << " per row";
+    if (density.bandNonZeros.size() > 1)
+    {
+        text << ", bands " << 100.0 * lowest << "% to " << 100.0 * highest << "%";
+    }
+    text << ")";
+    return text.str();
+}
+
+// A storage form and why it was picked
+struct StorageChoice
+{
+    MatrixStorage storage = MatrixStorage::Csr;
+    std::string reason;
+};
+
+// Function to pick the storage of a matrix from its density: dense once a good fraction of its entries is nonzero,
+// a grid when it has so few entries that the row offsets of compressed rows would outweigh them, and compressed rows
+// otherwise
+inline StorageChoice chooseMatrixStorage(const MatrixDensity &density, const StorageOptions &options = StorageOptions())
+{
+    StorageChoice choice;
+    std::ostringstream reason;
+    reason << std::setprecision(3);
+    if (density.fill() >= options.denseFill)
+    {
+        choice.storage = MatrixStorage::Dense;
+        reason << 100.0 * density.fill() << "% of the entries are nonzero, at least " << 100.0 * options.denseFill
+               << "%: indices would cost more than the zeros";
+    }
+    else if (density.entriesPerRow() < options.gridEntriesPerRow)
+    {
+        choice.storage = MatrixStorage::Grid;
+        reason << density.entriesPerRow() << " entries per row, below " << options.gridEntriesPerRow
+               << ": row offsets would outweigh the entries";
+    }
+    else
+    {
+        choice.storage = MatrixStorage::Csr;
+        reason << 100.0 * density.fill() << "% of the entries are nonzero with " << density.entriesPerRow()
+               << " per row: compact rows are smallest";
+    }
+    choice.reason = reason.str();
+    return choice;
+}
+
+// Kernel a band of rows of a product is formed with
+enum class BandKernel
+{
+    RowWise,  // row-wise (Gustavson) product over compressed rows of B
+    DenseRows // every entry of A adds a whole row of a dense copy of B, tile by tile
+};
+
+// The choices made for one product and the measurements behind them
+struct AdaptiveProductReport
+{
+    MatrixDensity densityA;
+    MatrixDensity densityB;
+    MatrixDensity densityC;
+    StorageChoice storageA;
+    StorageChoice storageB;
+    std::vector<BandKernel> bandKernels; // one per band of rows of A
+    std::vector<double> bandProducts;    // multiply-adds of the row-wise product in every band
+    int denseBands = 0;
+    std::string kernelReason;
+    StorageChoice result;
+};
+
+// Function to choose the kernel of every band of rows of A*B from the measured densities of A and B.
+// The row-wise product of a band costs one scattered multiply-add per entry of B it reaches; the dense-row kernel costs
+// a contiguous one per entry of A times B.cols. Their ratio is the average fill of the rows of B the band reaches, so
+// a band takes the dense-row kernel once those rows are fuller than denseRowNs / rowWiseNs, provided a dense copy of B
+// fits in options.denseBytes.
+template <typename ValueType>
+inline void planAdaptiveProduct(const CsrMatrixT<ValueType> &A, const CsrMatrixT<ValueType> &B, AdaptiveProductReport &report,
+                                const StorageOptions &options = StorageOptions())
+{
+    report.densityA = measureDensity(A, options.bandRows);
+    report.densityB = measureDensity(B, options.bandRows);
+
+    const int numBands = static_cast<int>(report.densityA.bandNonZeros.size());
+    report.bandProducts.assign(numBands, 0.0);
+    report.bandKernels.assign(numBands, BandKernel::RowWise);
+    tbb::parallel_for(tbb::blocked_range<int>(0, numBands), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int b = range.begin(); b != range.end(); ++b)
+        {
+            double products = 0.0;
+            for (size_t p = A.rowStart[b * options.bandRows]; p < A.rowStart[std::min(A.rows, (b + 1) * options.bandRows)]; ++p)
+            {
+                const int k = A.colIndex[p];
+                if (k < B.rows)
+                {
+                    products += static_cast<double>(B.rowStart[k + 1] - B.rowStart[k]);
+                }
+            }
+            report.bandProducts[b] = products;
+        }
+    });
+
+    const double breakEven = options.denseRowNs / options.rowWiseNs;
+    const double denseBytes = static_cast<double>(B.rows) * B.cols * sizeof(ValueType);
+    const bool denseFits = denseBytes <= static_cast<double>(options.denseBytes);
+    double reached = 0.0, entries = 0.0;
+    int candidates = 0;
+    report.denseBands = 0;
+    for (int b = 0; b < numBands; ++b)
+    {
+        const double rowWiseCost = report.bandProducts[b] * options.rowWiseNs;
+        const double denseCost = static_cast<double>(report.densityA.bandNonZeros[b]) * B.cols * options.denseRowNs;
+        if (denseCost < rowWiseCost)
+        {
+            ++candidates;
+            reached += report.bandProducts[b];
+            entries += static_cast<double>(report.densityA.bandNonZeros[b]) * B.cols;
+            if (denseFits)
+            {
+                report.bandKernels[b] = BandKernel::DenseRows;
+                ++report.denseBands;
+            }
+        }
+    }
+
+    std::ostringstream reason;
+    reason << std::setprecision(3);
+    if (candidates == 0)
+    {
+        reason << "no band reaches rows of B fuller than the break-even fill of " << 100.0 * breakEven << "%";
+    }
+    else
+    {
+        reason << candidates << " bands reach rows of B that are " << 100.0 * reached / entries
+               << "% full on average, above the break-even fill of " << 100.0 * breakEven << "%";
+        if (!denseFits)
+        {
+            reason << ", but a dense copy of B would take " << denseBytes / (1 << 20) << " MB, over the limit of "
+                   << static_cast<double>(options.denseBytes) / (1 << 20) << " MB";
+        }
+    }
+    report.kernelReason = reason.str();
+}
+
+// Function to multiply compressed rows of A by a B with cols columns band by band with the kernels in report.
+// Bands of the row-wise kernel read B from csrB and bands of the dense-row kernel from denseB, so either may be left
+// empty when no band reads it. Bands are formed in parallel into their own buffers and then packed into place, as in
+// multiplyCsrInto. Both kernels leave out entries that sum to exactly zero and entries smaller in magnitude than
+// dropTolerance, so which kernel formed a band never shows in the pattern of C.
+template <typename AccumType = double, typename ValueType>
+inline CsrMatrixT<ValueType> multiplyAdaptiveBands(const CsrMatrixT<ValueType> &A, const CsrMatrixT<ValueType> &csrB,
+                                                   const DenseMatrixT<ValueType> &denseB, int cols,
+                                                   const AdaptiveProductReport &report, double dropTolerance = 0.0)
+{
+    const int bandRows = report.densityA.bandRows;
+    const int numBands = static_cast<int>(report.bandKernels.size());
+
+    auto kept = [dropTolerance](AccumType value)
+    {
+        return value != AccumType(0) && !(std::abs(value) < dropTolerance);
+    };
+
+    tbb::enumerable_thread_specific<SparseAccumulatorT<AccumType>> accumulators([cols]
+    {
+        return SparseAccumulatorT<AccumType>(cols);
+    });
+    tbb::enumerable_thread_specific<std::vector<AccumType>> denseRows([cols]
+    {
+        return std::vector<AccumType>(cols);
+    });
+
+    CsrMatrixT<ValueType> C;
+    C.rows = A.rows;
+    C.cols = cols;
+    C.rowStart.assign(A.rows + 1, 0);
+    std::vector<std::vector<int>> bandCols(numBands);
+    std::vector<std::vector<ValueType>> bandValues(numBands);
+
+    tbb::parallel_for(tbb::blocked_range<int>(0, numBands, 1), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int b = range.begin(); b != range.end(); ++b)
+        {
+            std::vector<int> &colIndex = bandCols[b];
+            std::vector<ValueType> &values = bandValues[b];
+            for (int i = b * bandRows; i < std::min(A.rows, (b + 1) * bandRows); ++i)
+            {
+                const size_t before = colIndex.size();
+                if (report.bandKernels[b] == BandKernel::DenseRows)
+                {
+                    AccumType *sum = denseRows.local().data();
+                    multiplyDenseRow(A, denseB, i, sum);
+                    for (int j = 0; j < cols; ++j)
+                    {
+                        if (kept(sum[j]))
+                        {
+                            colIndex.push_back(j);
+                            values.push_back(static_cast<ValueType>(sum[j]));
+                        }
+                    }
+                }
+                else
+                {
+                    SparseAccumulatorT<AccumType> &spa = accumulators.local();
+                    accumulateRow(A, csrB, i, 0.0, spa);
+                    for (int j : spa.touched)
+                    {
+                        if (kept(spa.values[j]))
+                        {
+                            colIndex.push_back(j);
+                            values.push_back(static_cast<ValueType>(spa.values[j]));
+                        }
+                    }
+                }
+                C.rowStart[i + 1] = colIndex.size() - before;
+            }
+        }
+    });
+
+    for (int i = 0; i < A.rows; ++i)
+    {
+        C.rowStart[i + 1] += C.rowStart[i];
+    }
+    C.colIndex.resize(C.rowStart[A.rows]);
+    C.values.resize(C.rowStart[A.rows]);
+    tbb::parallel_for(0, numBands, [&](int b)
+    {
+        const size_t offset = C.rowStart[b * bandRows];
+        std::copy(bandCols[b].begin(), bandCols[b].end(), C.colIndex.begin() + offset);
+        std::copy(bandValues[b].begin(), bandValues[b].end(), C.values.begin() + offset);
+    });
+    return C;
+}
+
+// Function to multiply two compressed-row matrices band by band with the kernels chosen by planAdaptiveProduct, as
+// multiplyAdaptiveBands does; a dense copy of B is made only when some band takes the dense-row kernel.
+template <typename AccumType = double, typename ValueType>
+inline CsrMatrixT<ValueType> multiplyAdaptiveCsr(const CsrMatrixT<ValueType> &A, const CsrMatrixT<ValueType> &B,
+                                                 const AdaptiveProductReport &report, double dropTolerance = 0.0)
+{
+    DenseMatrixT<ValueType> denseB;
+    if (report.denseBands > 0)
+    {
+        denseB = csrToDense(B);
+    }
+    return multiplyAdaptiveBands<AccumType>(A, B, denseB, B.cols, report, dropTolerance);
+}
+
+// Function to switch off the entries of a matrix grid that are exactly zero and prune the leaves left empty, a leaf per
+// task. A product assembled into a grid writes every column a row touched; this leaves it with the pattern the band
+// kernels of multiplyAdaptiveBands give the same product.
+template <typename GridType>
+inline void pruneZeroEntries(GridType &grid)
+{
+    using LeafType = typename GridType::TreeType::LeafNodeType;
+    using ValueType = typename GridType::ValueType;
+
+    std::vector<LeafType *> leaves;
+    leaves.reserve(grid.tree().leafCount());
+    grid.tree().getNodes(leaves);
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, leaves.size()), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t n = range.begin(); n != range.end(); ++n)
+        {
+            for (openvdb::Index offset = 0; offset < LeafType::SIZE; ++offset)
+            {
+                if (leaves[n]->isValueOn(offset) && leaves[n]->getValue(offset) == openvdb::zeroVal<ValueType>())
+                {
+                    leaves[n]->setValueOff(offset);
+                }
+            }
+        }
+    });
+
+    openvdb::tools::pruneInactive(grid.tree());
+}
+
+// A matrix held in whichever form its density called for; only the member named by storage is set
+template <typename GridType>
+struct AdaptiveMatrixT
+{
+    using ValueType = typename GridType::ValueType;
+
+    MatrixStorage storage = MatrixStorage::Csr;
+    typename GridType::Ptr grid;
+    CsrMatrixT<ValueType> csr;
+    DenseMatrixT<ValueType> dense;
+    int rows = 0;
+    int cols = 0;
+
+    // Heap bytes held by whichever form is set
+    size_t memUsage() const
+    {
+        if (storage == MatrixStorage::Grid)
+        {
+            return grid ? static_cast<size_t>(grid->memUsage()) : 0;
+        }
+        return storage == MatrixStorage::Dense ? dense.memUsage() : csr.memUsage();
+    }
+};
+
+using AdaptiveMatrix = AdaptiveMatrixT<openvdb::FloatGrid>;
+
+// Function to move compressed rows into the given storage form
+template <typename Layout = SliceLayout, typename GridType = openvdb::FloatGrid>
+inline AdaptiveMatrixT<GridType> storeAdaptive(CsrMatrixT<typename GridType::ValueType> &&csr, MatrixStorage storage)
+{
+    AdaptiveMatrixT<GridType> matrix;
+    matrix.storage = storage;
+    matrix.rows = csr.rows;
+    matrix.cols = csr.cols;
+    if (storage == MatrixStorage::Grid)
+    {
+        matrix.grid = csrToGrid<Layout, GridType>(csr);
+    }
+    else if (storage == MatrixStorage::Dense)
+    {
+        matrix.dense = csrToDense(csr);
+    }
+    else
+    {
+        matrix.csr = std::move(csr);
+    }
+    return matrix;
+}
+
+// Function to return a matrix in compressed rows, whatever form it is held in
+template <typename Layout = SliceLayout, typename GridType>
+inline CsrMatrixT<typename GridType::ValueType> adaptiveToCsr(const AdaptiveMatrixT<GridType> &matrix)
+{
+    if (matrix.storage == MatrixStorage::Grid)
+    {
+        return gridToCsr<Layout>(*matrix.grid, matrix.rows, matrix.cols);
+    }
+    if (matrix.storage == MatrixStorage::Dense)
+    {
+        return denseToCsr(matrix.dense);
+    }
+    return matrix.csr;
+}
+
+// Function to return a matrix as a grid, whatever form it is held in; a grid is shared rather than copied
+template <typename Layout = SliceLayout, typename GridType>
+inline typename GridType::Ptr adaptiveToGrid(const AdaptiveMatrixT<GridType> &matrix)
+{
+    if (matrix.storage == MatrixStorage::Grid)
+    {
+        return matrix.grid;
+    }
+    if (matrix.storage == MatrixStorage::Dense)
+    {
+        return csrToGrid<Layout, GridType>(denseToCsr(matrix.dense));
+    }
+    return csrToGrid<Layout, GridType>(matrix.csr);
+}
+
+// Function to multiply two matrix grids with the storage and kernels their measured densities call for.
+// A is rows x n and B is n x cols, where n is taken from the active voxels of both grids, as in multiplyMatrices.
+// The densities of A and B are measured on the grids themselves and each operand is read in the storage it calls for:
+// - A or B hypersparse (grid): the rows of C are assembled straight into a grid by assembleProductRows, so neither a
+//   banded plan nor compressed rows of C are made for a product that has almost nothing in it. Sums that are exactly
+//   zero are then pruned, so C has the same pattern whichever path formed it.
+// - B mostly full (dense): B is expanded straight from its grid into a dense copy, with no compressed rows of B at all,
+//   and every band of rows of A takes the dense-row kernel.
+// - Otherwise both are read into compressed rows and every band of rows of A is formed with the cheaper of the
+//   row-wise and the dense-row kernel, as planned by planAdaptiveProduct.
+// A dense A is still read as compressed rows, since both kernels walk its entries one by one. The product is kept in
+// the storage its own density calls for. Every choice and the measurements behind it are left in report, ready for
+// printAdaptiveReport.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline AdaptiveMatrixT<GridType> multiplyAdaptive(openvdb::SharedPtr<GridType> A, openvdb::SharedPtr<GridType> B, int rows,
+                                                  int cols, AdaptiveProductReport &report,
+                                                  const StorageOptions &options = StorageOptions())
+{
+    using ValueType = typename GridType::ValueType;
+
+    int rowsA = 0, colsA = 0, rowsB = 0, colsB = 0;
+    matrixExtent<Layout>(*A, rowsA, colsA);
+    matrixExtent<Layout>(*B, rowsB, colsB);
+    int inner = std::max(colsA, rowsB);
+
+    report.densityA = measureDensity<Layout>(*A, rows, inner, options.bandRows);
+    report.densityB = measureDensity<Layout>(*B, inner, cols, options.bandRows);
+    report.storageA = chooseMatrixStorage(report.densityA, options);
+    report.storageB = chooseMatrixStorage(report.densityB, options);
+    const bool denseFits = static_cast<double>(inner) * cols * sizeof(ValueType) <= static_cast<double>(options.denseBytes);
+
+    report.bandProducts.clear();
+    report.bandKernels.clear();
+    report.denseBands = 0;
+
+    CsrMatrixT<ValueType> C;
+    if (report.storageA.storage == MatrixStorage::Grid || report.storageB.storage == MatrixStorage::Grid)
+    {
+        report.kernelReason = "row-wise into a grid, as an operand is hypersparse";
+        typename GridType::Ptr gridC = multiplyMatricesParallel<Layout, AccumType>(A, B, rows, cols);
+        pruneZeroEntries(*gridC);
+        report.densityC = measureDensity<Layout>(*gridC, rows, cols, options.bandRows);
+        report.result = chooseMatrixStorage(report.densityC, options);
+        if (report.result.storage == MatrixStorage::Grid)
+        {
+            AdaptiveMatrixT<GridType> matrix;
+            matrix.storage = MatrixStorage::Grid;
+            matrix.grid = gridC;
+            matrix.rows = rows;
+            matrix.cols = cols;
+            return matrix;
+        }
+        C = gridToCsr<Layout>(*gridC, rows, cols);
+    }
+    else if (report.storageB.storage == MatrixStorage::Dense && denseFits)
+    {
+        const int numBands = static_cast<int>(report.densityA.bandNonZeros.size());
+        report.kernelReason = "B is read straight into a dense copy";
+        report.bandKernels.assign(numBands, BandKernel::DenseRows);
+        report.denseBands = numBands;
+        C = multiplyAdaptiveBands<AccumType>(gridToCsr<Layout>(*A, rows, inner), CsrMatrixT<ValueType>(),
+                                             gridToDense<Layout>(*B, inner, cols), cols, report);
+    }
+    else
+    {
+        CsrMatrixT<ValueType> csrA = gridToCsr<Layout>(*A, rows, inner);
+        CsrMatrixT<ValueType> csrB = gridToCsr<Layout>(*B, inner, cols);
+        planAdaptiveProduct(csrA, csrB, report, options);
+        C = multiplyAdaptiveCsr<AccumType>(csrA, csrB, report);
+    }
+
+    report.densityC = measureDensity(C, options.bandRows);
+    report.result = chooseMatrixStorage(report.densityC, options);
+    return storeAdaptive<Layout, GridType>(std::move(C), report.result.storage);
+}
+
+// Function to print the choices of an adaptive product and why they were made
+inline void printAdaptiveReport(std::ostream &out, const AdaptiveProductReport &report)
+{
+    out << "Density of A :: " << formatDensity(report.densityA) << std::endl;
+    out << "Storage of A :: " << matrixStorageName(report.storageA.storage) << ", " << report.storageA.reason << std::endl;
+    out << "Density of B :: " << formatDensity(report.densityB) << std::endl;
+    out << "Storage of B :: " << matrixStorageName(report.storageB.storage) << ", " << report.storageB.reason << std::endl;
+    if (report.bandKernels.empty())
+    {
+        out << "Kernels :: " << report.kernelReason << std::endl;
+    }
+    else
+    {
+        out << "Kernels :: " << report.denseBands << " of " << report.bandKernels.size()
+            << " bands dense-row, the rest row-wise; " << report.kernelReason << std::endl;
+    }
+    out << "Density of C :: " << formatDensity(report.densityC) << std::endl;
+    out << "Storage of C :: " << matrixStorageName(report.result.storage) << ", " << report.result.reason << std::endl;
+}
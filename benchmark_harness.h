@@ -0,0 +1,150 @@
+#pragma once
+
+#include "matrix_generator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Parameters shared by the benchmark programs; every combination of dims x nnzPerRow x patterns is measured on every
+// thread count. A program sets its own defaults before parsing and adds any options of its own.
+struct BenchmarkOptions
+{
+    std::vector<int> dims = {10000, 20000};
+    std::vector<int> nnzPerRow = {10};
+    std::vector<std::string> patterns = {"uniform", "banded"};
+    std::vector<int> threads = {1, 2, 4, 8};
+    int warmup = 1;
+    int reps = 5;
+    unsigned seed = 42;
+};
+
+// Function to split a comma-separated command line value
+inline std::vector<std::string> splitList(const std::string &value)
+{
+    std::vector<std::string> items;
+    std::stringstream stream(value);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        if (!item.empty())
+        {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// Function to split a comma-separated command line value into integers
+inline std::vector<int> splitIntList(const std::string &value)
+{
+    std::vector<int> items;
+    for (const std::string &item : splitList(value))
+    {
+        items.push_back(std::atoi(item.c_str()));
+    }
+    return items;
+}
+
+// Function to read benchmark parameters from "--name value" pairs into options. Names that are not shared are handed to
+// parseOption(name, value), which returns false for a name it does not know either.
+template <typename OptionOpType>
+inline void parseBenchmarkArguments(int argc, char *argv[], BenchmarkOptions &options, const OptionOpType &parseOption)
+{
+    for (int a = 1; a < argc; ++a)
+    {
+        std::string name = argv[a];
+        if (a + 1 >= argc)
+        {
+            std::cerr << "Error: Missing value for " << name << std::endl;
+            exit(1);
+        }
+        std::string value = argv[++a];
+
+        if (name == "--dims")
+        {
+            options.dims = splitIntList(value);
+        }
+        else if (name == "--nnz")
+        {
+            options.nnzPerRow = splitIntList(value);
+        }
+        else if (name == "--patterns")
+        {
+            options.patterns = splitList(value);
+        }
+        else if (name == "--threads")
+        {
+            options.threads = splitIntList(value);
+        }
+        else if (name == "--warmup")
+        {
+            options.warmup = std::atoi(value.c_str());
+        }
+        else if (name == "--reps")
+        {
+            options.reps = std::max(1, std::atoi(value.c_str()));
+        }
+        else if (name == "--seed")
+        {
+            options.seed = static_cast<unsigned>(std::strtoul(value.c_str(), nullptr, 10));
+        }
+        else if (!parseOption(name, value))
+        {
+            std::cerr << "Error: Unknown option " << name << std::endl;
+            exit(1);
+        }
+    }
+}
+
+// Function to generate an n x n matrix with a unit-range diagonal and nnzPerRow - 1 small off-diagonal entries per
+// row in the named pattern; banded matrices keep their columns within 4 * nnzPerRow of the diagonal
+inline std::vector<std::tuple<int, int, double>> makeBenchmarkMatrix(int n, int nnzPerRow, const std::string &pattern,
+                                                                     uint64_t seed, bool symmetric = false)
+{
+    MatrixGeneratorOptions options;
+    if (!sparsityPatternFromName(pattern, options.pattern))
+    {
+        std::cerr << "Error: Unknown pattern " << pattern << std::endl;
+        exit(1);
+    }
+    options.nnzPerRow = nnzPerRow;
+    options.bandwidth = 4 * nnzPerRow;
+    options.symmetric = symmetric;
+    options.seed = seed;
+    return generateMatrixTriplets(n, options);
+}
+
+// Function to run body warmup times untimed and then reps times timed, returning the timed samples in nanoseconds
+template <typename BodyType>
+inline std::vector<double> timePhase(int warmup, int reps, const BodyType &body)
+{
+    for (int r = 0; r < warmup; ++r)
+    {
+        body();
+    }
+
+    std::vector<double> samples;
+    for (int r = 0; r < reps; ++r)
+    {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        auto stop = std::chrono::steady_clock::now();
+        samples.push_back(static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count()));
+    }
+    return samples;
+}
+
+// Function to return the median of a set of samples
+inline double median(std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    return n % 2 == 1 ? samples[n / 2] : 0.5 * (samples[n / 2 - 1] + samples[n / 2]);
+}
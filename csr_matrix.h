@@ -0,0 +1,678 @@
+#pragma once
+
+#include "grid_builder.h"
+#include "matrix_layout.h"
+
+#include <openvdb/openvdb.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Compressed sparse row copy of a matrix stored in an OpenVDB grid under one of the layouts of matrix_layout.h.
+// The kernels work on this form so they can jump straight to the active entries of any row without probing the tree.
+// Values keep the storage type of the grid they came from.
+template <typename ValueType>
+struct CsrMatrixT
+{
+    int rows = 0;
+    int cols = 0;
+    std::vector<size_t> rowStart; // rows + 1 offsets into colIndex and values
+    std::vector<int> colIndex;    // ascending within each row
+    std::vector<ValueType> values;
+
+    size_t nonZeros() const { return colIndex.size(); }
+
+    // Heap bytes held by the three arrays
+    size_t memUsage() const
+    {
+        return rowStart.capacity() * sizeof(size_t) + colIndex.capacity() * sizeof(int) + values.capacity() * sizeof(ValueType);
+    }
+};
+
+using CsrMatrix = CsrMatrixT<float>;
+
+// Function to find the number of rows and columns spanned by the active voxels of a grid.
+// Folded layouts only give this to within one fold, which is enough to size the inner dimension of a product.
+// Symmetric grids are square.
+template <typename Layout = SliceLayout, typename GridType>
+inline void matrixExtent(const GridType &grid, int &rows, int &cols)
+{
+    openvdb::CoordBBox bbox = grid.evalActiveVoxelBoundingBox();
+    if (bbox.empty())
+    {
+        rows = 0;
+        cols = 0;
+        return;
+    }
+    Layout::extent(bbox, rows, cols);
+    if (isMatrixSymmetric(grid))
+    {
+        rows = cols = std::max(rows, cols); // only the lower triangle is stored
+    }
+}
+
+// Function to return a grid's tree with every active value stored at voxel level.
+// Matrix grids normally are; a copy is only made to expand active tiles left behind by pruning.
+template <typename GridType>
+inline typename GridType::TreeType::ConstPtr voxelTree(const GridType &grid)
+{
+    using TreeType = typename GridType::TreeType;
+
+    typename TreeType::ConstPtr tree = grid.constTreePtr();
+    if (tree->hasActiveTiles())
+    {
+        typename TreeType::Ptr voxelized(new TreeType(*tree));
+        voxelized->voxelizeActiveTiles();
+        tree = voxelized;
+    }
+    return tree;
+}
+
+// Function to return the voxels that hold the entries rows [firstRow, firstRow + rows) x cols [firstCol, firstCol + cols)
+// of a matrix; the window must not be empty
+template <typename Layout>
+inline openvdb::CoordBBox matrixWindowBox(int firstRow, int firstCol, int rows, int cols)
+{
+    openvdb::Coord first = Layout::toCoord(firstRow, firstCol);
+    openvdb::Coord last = Layout::toCoord(firstRow + rows - 1, firstCol + cols - 1);
+    return openvdb::CoordBBox(openvdb::Coord(first.x(), first.y(), 0), openvdb::Coord(last.x(), last.y(), 7));
+}
+
+// Function to return the origin of the leaf that holds entry (i, j) of a matrix grid
+template <typename Layout, typename LeafType>
+inline openvdb::Coord matrixLeafOrigin(int i, int j)
+{
+    return Layout::toCoord(i, j) & ~static_cast<openvdb::Int32>(LeafType::DIM - 1);
+}
+
+// Function to collect the leaves of a voxel tree that overlap a window of the matrix into leaves, in the tree's own
+// order. Only leaf pointers are gathered, so a small window of a large matrix costs one bounding-box test per leaf.
+// The vector is cleared first and keeps its capacity, so a caller that collects leaves again and again can keep one.
+template <typename Layout, typename TreeType>
+inline void collectWindowLeaves(const TreeType &tree, int firstRow, int firstCol, int rows, int cols,
+                                std::vector<const typename TreeType::LeafNodeType *> &leaves)
+{
+    using LeafType = typename TreeType::LeafNodeType;
+
+    leaves.clear();
+    if (rows <= 0 || cols <= 0)
+    {
+        return;
+    }
+    leaves.reserve(tree.leafCount());
+    tree.getNodes(leaves);
+
+    const openvdb::CoordBBox window = matrixWindowBox<Layout>(firstRow, firstCol, rows, cols);
+    leaves.erase(std::remove_if(leaves.begin(), leaves.end(), [&](const LeafType *leaf)
+    {
+        return !window.hasOverlap(leaf->getNodeBoundingBox());
+    }), leaves.end());
+}
+
+// Function to return the leaves of a voxel tree that overlap a window of the matrix, as above
+template <typename Layout, typename TreeType>
+inline std::vector<const typename TreeType::LeafNodeType *> windowLeaves(const TreeType &tree, int firstRow, int firstCol,
+                                                                         int rows, int cols)
+{
+    std::vector<const typename TreeType::LeafNodeType *> leaves;
+    collectWindowLeaves<Layout>(tree, firstRow, firstCol, rows, cols, leaves);
+    return leaves;
+}
+
+// Function to collect the leaves that hold the stored entries of a window: those overlapping it and, for a symmetric
+// grid, those overlapping the transposed window, whose entries mirror into it. A union is sorted by origin, so the
+// leaves come out in the same order on every run.
+template <typename Layout, typename TreeType>
+inline std::vector<const typename TreeType::LeafNodeType *> storedWindowLeaves(const TreeType &tree, bool symmetric,
+                                                                               int firstRow, int firstCol, int rows, int cols)
+{
+    using LeafType = typename TreeType::LeafNodeType;
+
+    std::vector<const LeafType *> leaves = windowLeaves<Layout>(tree, firstRow, firstCol, rows, cols);
+    if (!symmetric || (firstRow == firstCol && rows == cols))
+    {
+        return leaves; // a window on the diagonal is its own transpose
+    }
+    std::vector<const LeafType *> mirrored = windowLeaves<Layout>(tree, firstCol, firstRow, cols, rows);
+    leaves.insert(leaves.end(), mirrored.begin(), mirrored.end());
+    std::sort(leaves.begin(), leaves.end(), [](const LeafType *a, const LeafType *b)
+    {
+        return a->origin() < b->origin();
+    });
+    leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+    return leaves;
+}
+
+// Function to look up entry (i, j) of a matrix grid through an accessor; symmetric grids find the entries above the
+// diagonal at their mirrored position
+template <typename Layout, typename AccessorType, typename ValueType>
+inline bool probeMatrixEntry(const AccessorType &accessor, bool symmetric, int i, int j, ValueType &value)
+{
+    if (symmetric && j > i)
+    {
+        std::swap(i, j);
+    }
+    return accessor.probeValue(Layout::toCoord(i, j), value);
+}
+
+// Function to visit the active entries of one block of rows, i.e. the leaves leaves[first, last) that share an x origin.
+// Entries outside rows [firstRow, firstRow + rows) x cols [firstCol, firstCol + cols) are skipped; op gets indices
+// relative to (firstRow, firstCol).
+template <typename Layout, typename LeafType, typename OpType>
+inline void forEachBlockEntry(const std::vector<const LeafType *> &leaves, size_t first, size_t last, int firstRow,
+                              int firstCol, int rows, int cols, OpType &&op)
+{
+    for (size_t n = first; n < last; ++n)
+    {
+        for (auto iter = leaves[n]->cbeginValueOn(); iter; ++iter)
+        {
+            int i, j;
+            if (!Layout::toIndex(iter.getCoord(), i, j) || i < firstRow || i - firstRow >= rows || j < firstCol ||
+                j - firstCol >= cols)
+            {
+                continue;
+            }
+            op(i - firstRow, j - firstCol, iter.getValue());
+        }
+    }
+}
+
+// Function to sort leaves by their origin along axis, then by origin, and set blockStart to where each run of leaves
+// sharing that axis origin starts, followed by leaves.size(). Along x a run is a block of whole rows; along y every leaf
+// of a run holds the same columns, and no other leaf does.
+template <typename LeafType>
+inline void groupLeafBlocks(std::vector<const LeafType *> &leaves, int axis, std::vector<size_t> &blockStart)
+{
+    tbb::parallel_sort(leaves.begin(), leaves.end(), [axis](const LeafType *a, const LeafType *b)
+    {
+        return a->origin()[axis] != b->origin()[axis] ? a->origin()[axis] < b->origin()[axis] : a->origin() < b->origin();
+    });
+
+    blockStart.clear();
+    for (size_t n = 0; n < leaves.size(); ++n)
+    {
+        if (n == 0 || leaves[n]->origin()[axis] != leaves[n - 1]->origin()[axis])
+        {
+            blockStart.push_back(n);
+        }
+    }
+    blockStart.push_back(leaves.size());
+}
+
+// Leaf lists gridToStoredCsrInto works through; one kept by the caller makes repeated conversions allocation-free
+template <typename LeafType>
+struct GridCsrScratchT
+{
+    std::vector<const LeafType *> leaves;
+    std::vector<size_t> blockStart;
+    std::vector<size_t> next;
+};
+
+// Function to collect the entries stored in a grid into compressed rows, as they are in the tree.
+// This is gridToCsr for general grids; for symmetric grids it yields only the stored lower triangle.
+// Leaves are sorted by origin and grouped into blocks of rows, which are counted and scattered in parallel.
+// Within a block the leaves are visited in column order, so every row comes out sorted.
+// Entries outside rows x cols are ignored. With firstRow set only the row panel [firstRow, firstRow + rows) is collected,
+// and row i of the matrix becomes row i - firstRow of the result; firstCol does the same for the columns. Leaves
+// outside that window are never visited.
+// csr and scratch keep their capacity, so converting grids of a steady size over and over allocates nothing.
+template <typename Layout = SliceLayout, typename GridType>
+inline void gridToStoredCsrInto(const GridType &grid, CsrMatrixT<typename GridType::ValueType> &csr,
+                                GridCsrScratchT<typename GridType::TreeType::LeafNodeType> &scratch, int rows, int cols,
+                                int firstRow = 0, int firstCol = 0)
+{
+    using ValueType = typename GridType::ValueType;
+
+    checkMatrixLayout<Layout>(grid);
+
+    typename GridType::TreeType::ConstPtr tree = voxelTree(grid);
+
+    // Leaves with the same x origin hold the same rows, so each block of rows is owned by a single task
+    const auto &leaves = scratch.leaves;
+    const auto &blockStart = scratch.blockStart;
+    collectWindowLeaves<Layout>(*tree, firstRow, firstCol, rows, cols, scratch.leaves);
+    groupLeafBlocks(scratch.leaves, 0, scratch.blockStart);
+    const size_t numBlocks = blockStart.size() - 1;
+
+    csr.rows = rows;
+    csr.cols = cols;
+    csr.rowStart.assign(rows + 1, 0);
+
+    // First pass: count the entries of every row
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numBlocks), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t b = range.begin(); b != range.end(); ++b)
+        {
+            forEachBlockEntry<Layout>(leaves, blockStart[b], blockStart[b + 1], firstRow, firstCol, rows, cols,
+                                      [&](int i, int, const ValueType &) { ++csr.rowStart[i + 1]; });
+        }
+    });
+
+    for (int i = 0; i < rows; ++i)
+    {
+        csr.rowStart[i + 1] += csr.rowStart[i];
+    }
+
+    csr.colIndex.resize(csr.rowStart[rows]);
+    csr.values.resize(csr.rowStart[rows]);
+
+    // Second pass: scatter the entries into their rows
+    std::vector<size_t> &next = scratch.next;
+    next.assign(csr.rowStart.begin(), csr.rowStart.end() - 1);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numBlocks), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t b = range.begin(); b != range.end(); ++b)
+        {
+            forEachBlockEntry<Layout>(leaves, blockStart[b], blockStart[b + 1], firstRow, firstCol, rows, cols,
+                                      [&](int i, int j, const ValueType &value)
+            {
+                size_t n = next[i]++;
+                csr.colIndex[n] = j;
+                csr.values[n] = value;
+            });
+        }
+    });
+}
+
+// Function to collect the entries stored in a grid into new compressed rows, as above
+template <typename Layout = SliceLayout, typename GridType>
+inline CsrMatrixT<typename GridType::ValueType> gridToStoredCsr(const GridType &grid, int rows, int cols, int firstRow = 0,
+                                                                int firstCol = 0)
+{
+    CsrMatrixT<typename GridType::ValueType> csr;
+    GridCsrScratchT<typename GridType::TreeType::LeafNodeType> scratch;
+    gridToStoredCsrInto<Layout>(grid, csr, scratch, rows, cols, firstRow, firstCol);
+    return csr;
+}
+
+// Function to transpose a compressed-row matrix with a counting sort over the columns; rows come out sorted
+template <typename ValueType>
+inline CsrMatrixT<ValueType> transposeCsr(const CsrMatrixT<ValueType> &M)
+{
+    CsrMatrixT<ValueType> T;
+    T.rows = M.cols;
+    T.cols = M.rows;
+    T.rowStart.assign(M.cols + 1, 0);
+    for (int j : M.colIndex)
+    {
+        ++T.rowStart[j + 1];
+    }
+    for (int j = 0; j < M.cols; ++j)
+    {
+        T.rowStart[j + 1] += T.rowStart[j];
+    }
+
+    T.colIndex.resize(M.nonZeros());
+    T.values.resize(M.nonZeros());
+    std::vector<size_t> next(T.rowStart.begin(), T.rowStart.end() - 1);
+    for (int i = 0; i < M.rows; ++i)
+    {
+        for (size_t p = M.rowStart[i]; p < M.rowStart[i + 1]; ++p)
+        {
+            size_t n = next[M.colIndex[p]]++;
+            T.colIndex[n] = i;
+            T.values[n] = M.values[p];
+        }
+    }
+    return T;
+}
+
+// Function to walk row i of X and row i of Y together in column order, calling op(j, x, y) once for every column held
+// by either row; a row without an entry in column j passes zero for it
+template <typename ValueType, typename OpType>
+inline void forEachMergedEntry(const CsrMatrixT<ValueType> &X, const CsrMatrixT<ValueType> &Y, int i, OpType &&op)
+{
+    size_t p = i < X.rows ? X.rowStart[i] : 0, pEnd = i < X.rows ? X.rowStart[i + 1] : 0;
+    size_t q = i < Y.rows ? Y.rowStart[i] : 0, qEnd = i < Y.rows ? Y.rowStart[i + 1] : 0;
+    while (p < pEnd || q < qEnd)
+    {
+        int jx = p < pEnd ? X.colIndex[p] : std::numeric_limits<int>::max();
+        int jy = q < qEnd ? Y.colIndex[q] : std::numeric_limits<int>::max();
+        if (jx < jy)
+        {
+            op(jx, X.values[p++], ValueType(0));
+        }
+        else if (jy < jx)
+        {
+            op(jy, ValueType(0), Y.values[q++]);
+        }
+        else
+        {
+            op(jx, X.values[p++], Y.values[q++]);
+        }
+    }
+}
+
+// Function to form C = alpha * X with the sparsity pattern of X. C keeps its capacity from earlier calls.
+template <typename ValueType>
+inline void scaleCsrInto(double alpha, const CsrMatrixT<ValueType> &X, CsrMatrixT<ValueType> &C)
+{
+    C.rows = X.rows;
+    C.cols = X.cols;
+    C.rowStart.assign(X.rowStart.begin(), X.rowStart.end());
+    C.colIndex.assign(X.colIndex.begin(), X.colIndex.end());
+    C.values.resize(X.values.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, X.values.size()), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t p = range.begin(); p != range.end(); ++p)
+        {
+            C.values[p] = static_cast<ValueType>(alpha * static_cast<double>(X.values[p]));
+        }
+    });
+}
+
+// Function to form C = alpha * X + beta * Y, leaving out entries smaller in magnitude than dropTolerance.
+// Rows are merged in parallel, once to count and once to fill. C keeps its capacity from earlier calls, so a sequence
+// of sums of the same size allocates nothing after the first.
+template <typename ValueType>
+inline void addCsrInto(double alpha, const CsrMatrixT<ValueType> &X, double beta, const CsrMatrixT<ValueType> &Y,
+                       CsrMatrixT<ValueType> &C, double dropTolerance = 0.0)
+{
+    C.rows = std::max(X.rows, Y.rows);
+    C.cols = std::max(X.cols, Y.cols);
+    C.rowStart.assign(C.rows + 1, 0);
+
+    auto combine = [&](ValueType x, ValueType y) { return alpha * static_cast<double>(x) + beta * static_cast<double>(y); };
+
+    tbb::parallel_for(tbb::blocked_range<int>(0, C.rows), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int i = range.begin(); i != range.end(); ++i)
+        {
+            size_t count = 0;
+            forEachMergedEntry(X, Y, i, [&](int, ValueType x, ValueType y)
+            {
+                count += std::abs(combine(x, y)) >= dropTolerance;
+            });
+            C.rowStart[i + 1] = count;
+        }
+    });
+    for (int i = 0; i < C.rows; ++i)
+    {
+        C.rowStart[i + 1] += C.rowStart[i];
+    }
+
+    C.colIndex.resize(C.rowStart[C.rows]);
+    C.values.resize(C.rowStart[C.rows]);
+    tbb::parallel_for(tbb::blocked_range<int>(0, C.rows), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int i = range.begin(); i != range.end(); ++i)
+        {
+            size_t n = C.rowStart[i];
+            forEachMergedEntry(X, Y, i, [&](int j, ValueType x, ValueType y)
+            {
+                double value = combine(x, y);
+                if (std::abs(value) >= dropTolerance)
+                {
+                    C.colIndex[n] = j;
+                    C.values[n++] = static_cast<ValueType>(value);
+                }
+            });
+        }
+    });
+}
+
+// Function to collect the entries of a matrix grid into compressed rows; see gridToStoredCsr for the window.
+// A symmetric grid is expanded on the way: the window's entries on or below the diagonal are stored in place and those
+// above it at their mirrored position, i.e. in the transposed window, so both are collected and merged row by row.
+template <typename Layout = SliceLayout, typename GridType>
+inline CsrMatrixT<typename GridType::ValueType> gridToCsr(const GridType &grid, int rows, int cols, int firstRow = 0,
+                                                          int firstCol = 0)
+{
+    using ValueType = typename GridType::ValueType;
+
+    if (!isMatrixSymmetric(grid))
+    {
+        return gridToStoredCsr<Layout>(grid, rows, cols, firstRow, firstCol);
+    }
+
+    CsrMatrixT<ValueType> lower = gridToStoredCsr<Layout>(grid, rows, cols, firstRow, firstCol);
+    CsrMatrixT<ValueType> upper = transposeCsr(gridToStoredCsr<Layout>(grid, cols, rows, firstCol, firstRow));
+
+    // Row i takes the columns j <= i of lower and the columns j > i of upper (in matrix numbering), so the two parts
+    // of a row stay sorted when concatenated and the stored diagonal is taken once
+    auto lowerEnd = [&](int i)
+    {
+        auto first = lower.colIndex.begin() + lower.rowStart[i], last = lower.colIndex.begin() + lower.rowStart[i + 1];
+        return static_cast<size_t>(std::upper_bound(first, last, firstRow + i - firstCol) - lower.colIndex.begin());
+    };
+    auto upperBegin = [&](int i)
+    {
+        auto first = upper.colIndex.begin() + upper.rowStart[i], last = upper.colIndex.begin() + upper.rowStart[i + 1];
+        return static_cast<size_t>(std::upper_bound(first, last, firstRow + i - firstCol) - upper.colIndex.begin());
+    };
+
+    CsrMatrixT<ValueType> csr;
+    csr.rows = rows;
+    csr.cols = cols;
+    csr.rowStart.assign(rows + 1, 0);
+    tbb::parallel_for(tbb::blocked_range<int>(0, rows), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int i = range.begin(); i != range.end(); ++i)
+        {
+            csr.rowStart[i + 1] = (lowerEnd(i) - lower.rowStart[i]) + (upper.rowStart[i + 1] - upperBegin(i));
+        }
+    });
+    for (int i = 0; i < rows; ++i)
+    {
+        csr.rowStart[i + 1] += csr.rowStart[i];
+    }
+
+    csr.colIndex.resize(csr.rowStart[rows]);
+    csr.values.resize(csr.rowStart[rows]);
+    tbb::parallel_for(tbb::blocked_range<int>(0, rows), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int i = range.begin(); i != range.end(); ++i)
+        {
+            size_t n = csr.rowStart[i];
+            for (size_t p = lower.rowStart[i], end = lowerEnd(i); p < end; ++p, ++n)
+            {
+                csr.colIndex[n] = lower.colIndex[p];
+                csr.values[n] = lower.values[p];
+            }
+            for (size_t p = upperBegin(i); p < upper.rowStart[i + 1]; ++p, ++n)
+            {
+                csr.colIndex[n] = upper.colIndex[p];
+                csr.values[n] = upper.values[p];
+            }
+        }
+    });
+
+    return csr;
+}
+
+// Function to collect the entries of a matrix grid into compressed rows held by the caller, as gridToCsr does.
+// For general grids csr and scratch keep their capacity, so converting grids of a steady size allocates nothing; a
+// symmetric grid still goes through the expansion of gridToCsr, which builds its two triangles anew.
+template <typename Layout = SliceLayout, typename GridType>
+inline void gridToCsrInto(const GridType &grid, CsrMatrixT<typename GridType::ValueType> &csr,
+                          GridCsrScratchT<typename GridType::TreeType::LeafNodeType> &scratch, int rows, int cols,
+                          int firstRow = 0, int firstCol = 0)
+{
+    if (isMatrixSymmetric(grid))
+    {
+        csr = gridToCsr<Layout>(grid, rows, cols, firstRow, firstCol);
+        return;
+    }
+    gridToStoredCsrInto<Layout>(grid, csr, scratch, rows, cols, firstRow, firstCol);
+}
+
+// Function to build a matrix grid from compressed rows a whole leaf at a time, as buildGridFromTriplets does.
+// A leaf holds a TILE_ROWS x TILE_COLS tile, so every block of TILE_ROWS rows first lists the tiles its entries fall in,
+// in parallel; each leaf is then filled straight from the sorted columns of its block's rows by buildGridFromLeaves.
+template <typename Layout = SliceLayout, typename GridType = openvdb::FloatGrid, typename ValueType>
+inline typename GridType::Ptr csrToGrid(const CsrMatrixT<ValueType> &csr)
+{
+    using LeafType = typename GridType::TreeType::LeafNodeType;
+
+    const int blockRows = Layout::TILE_ROWS, tileCols = Layout::TILE_COLS;
+    const int numBlocks = (csr.rows + blockRows - 1) / blockRows;
+
+    std::vector<std::vector<int>> blockTiles(numBlocks);
+    tbb::parallel_for(tbb::blocked_range<int>(0, numBlocks), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int b = range.begin(); b != range.end(); ++b)
+        {
+            std::vector<int> &tiles = blockTiles[b];
+            for (int i = b * blockRows; i < std::min(csr.rows, (b + 1) * blockRows); ++i)
+            {
+                for (size_t p = csr.rowStart[i]; p < csr.rowStart[i + 1]; ++p)
+                {
+                    if (tiles.empty() || tiles.back() != csr.colIndex[p] / tileCols)
+                    {
+                        tiles.push_back(csr.colIndex[p] / tileCols);
+                    }
+                }
+            }
+            std::sort(tiles.begin(), tiles.end());
+            tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+        }
+    });
+
+    // One leaf per (block, tile) pair
+    std::vector<std::pair<int, int>> leafTiles;
+    for (int b = 0; b < numBlocks; ++b)
+    {
+        for (int tile : blockTiles[b])
+        {
+            leafTiles.emplace_back(b, tile);
+        }
+    }
+
+    return buildGridFromLeaves<Layout, GridType>(leafTiles.size(), [&](size_t l)
+    {
+        return matrixLeafOrigin<Layout, LeafType>(leafTiles[l].first * blockRows, leafTiles[l].second * tileCols);
+    },
+    [&](size_t l, LeafType &leaf)
+    {
+        const int firstRow = leafTiles[l].first * blockRows, firstCol = leafTiles[l].second * tileCols;
+        for (int i = firstRow; i < std::min(csr.rows, firstRow + blockRows); ++i)
+        {
+            auto first = csr.colIndex.begin() + csr.rowStart[i], last = csr.colIndex.begin() + csr.rowStart[i + 1];
+            for (auto it = std::lower_bound(first, last, firstCol); it != last && *it < firstCol + tileCols; ++it)
+            {
+                const size_t p = it - csr.colIndex.begin();
+                leaf.setValueOn(LeafType::coordToOffset(Layout::toCoord(i, *it)),
+                                static_cast<typename GridType::ValueType>(csr.values[p]));
+            }
+        }
+    });
+}
+
+// Read-only window onto the rows [firstRow, firstRow + rows) and columns [firstCol, firstCol + cols) of a matrix grid.
+// A view holds nothing but a reference to the grid and the window, so taking one copies no leaves. The kernels that
+// accept views only visit the leaves overlapping the window and number its entries from (0, 0).
+template <typename GridType>
+struct MatrixViewT
+{
+    typename GridType::ConstPtr grid;
+    int firstRow = 0;
+    int firstCol = 0;
+    int rows = 0;
+    int cols = 0;
+};
+
+// Function to take a view of the submatrix rows [firstRow, lastRow) x cols [firstCol, lastCol) of a grid
+template <typename GridType>
+inline MatrixViewT<GridType> subMatrix(openvdb::SharedPtr<GridType> grid, int firstRow, int lastRow, int firstCol, int lastCol)
+{
+    if (firstRow < 0 || lastRow < firstRow || firstCol < 0 || lastCol < firstCol)
+    {
+        OPENVDB_THROW(openvdb::ValueError, "invalid submatrix [" << firstRow << ", " << lastRow << ") x [" << firstCol
+                                                                  << ", " << lastCol << ")");
+    }
+    MatrixViewT<GridType> view;
+    view.grid = grid;
+    view.firstRow = firstRow;
+    view.firstCol = firstCol;
+    view.rows = lastRow - firstRow;
+    view.cols = lastCol - firstCol;
+    return view;
+}
+
+// Function to take a view of the submatrix rows [firstRow, lastRow) x cols [firstCol, lastCol) of another view
+template <typename GridType>
+inline MatrixViewT<GridType> subMatrix(const MatrixViewT<GridType> &view, int firstRow, int lastRow, int firstCol, int lastCol)
+{
+    if (firstRow < 0 || lastRow < firstRow || lastRow > view.rows || firstCol < 0 || lastCol < firstCol || lastCol > view.cols)
+    {
+        OPENVDB_THROW(openvdb::ValueError, "submatrix [" << firstRow << ", " << lastRow << ") x [" << firstCol << ", "
+                                                         << lastCol << ") does not fit the " << view.rows << "x" << view.cols
+                                                         << " view");
+    }
+    MatrixViewT<GridType> sub = view;
+    sub.firstRow += firstRow;
+    sub.firstCol += firstCol;
+    sub.rows = lastRow - firstRow;
+    sub.cols = lastCol - firstCol;
+    return sub;
+}
+
+// Function to take a view of a whole matrix grid, sized by its active voxels
+template <typename Layout = SliceLayout, typename GridType>
+inline MatrixViewT<GridType> matrixView(openvdb::SharedPtr<GridType> grid)
+{
+    int rows = 0, cols = 0;
+    matrixExtent<Layout>(*grid, rows, cols);
+    return subMatrix(grid, 0, rows, 0, cols);
+}
+
+// Function to collect the entries of a view into compressed rows numbered from (0, 0)
+template <typename Layout = SliceLayout, typename GridType>
+inline CsrMatrixT<typename GridType::ValueType> viewToCsr(const MatrixViewT<GridType> &view)
+{
+    return gridToCsr<Layout>(*view.grid, view.rows, view.cols, view.firstRow, view.firstCol);
+}
+
+// Function to gather 0-based (row, col, value) triplets into compressed rows.
+// Repeated coordinates keep the last value, as when the triplets are written into a grid; entries outside
+// rows x cols are ignored.
+template <typename ValueType = float>
+inline CsrMatrixT<ValueType> tripletsToCsr(const std::vector<std::tuple<int, int, double>> &triplets, int rows, int cols)
+{
+    // Sort by (row, col), with the triplet index breaking ties so the last repeat sorts last
+    std::vector<std::pair<uint64_t, size_t>> keys;
+    keys.reserve(triplets.size());
+    for (size_t n = 0; n < triplets.size(); ++n)
+    {
+        const auto &[row, col, value] = triplets[n];
+        if (row < 0 || row >= rows || col < 0 || col >= cols)
+        {
+            continue;
+        }
+        keys.emplace_back((uint64_t(row) << 32) | uint32_t(col), n);
+    }
+    tbb::parallel_sort(keys.begin(), keys.end());
+
+    CsrMatrixT<ValueType> csr;
+    csr.rows = rows;
+    csr.cols = cols;
+    csr.rowStart.assign(rows + 1, 0);
+    csr.colIndex.reserve(keys.size());
+    csr.values.reserve(keys.size());
+
+    for (size_t n = 0; n < keys.size(); ++n)
+    {
+        if (n + 1 < keys.size() && keys[n + 1].first == keys[n].first)
+        {
+            continue; // A later repeat of this coordinate wins
+        }
+        const auto &[row, col, value] = triplets[keys[n].second];
+        ++csr.rowStart[row + 1];
+        csr.colIndex.push_back(col);
+        csr.values.push_back(static_cast<ValueType>(value));
+    }
+
+    for (int i = 0; i < rows; ++i)
+    {
+        csr.rowStart[i + 1] += csr.rowStart[i];
+    }
+
+    return csr;
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include "csr_matrix.h"
+#include "matrix_layout.h"
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Dense copy of a matrix, row by row. Worth its rows * cols entries once a good part of them is nonzero: the kernels
+// then run over contiguous rows with no column indices to follow.
+template <typename ValueType>
+struct DenseMatrixT
+{
+    int rows = 0;
+    int cols = 0;
+    std::vector<ValueType> values; // rows * cols entries, row-major
+
+    ValueType *row(int i) { return values.data() + static_cast<size_t>(i) * cols; }
+    const ValueType *row(int i) const { return values.data() + static_cast<size_t>(i) * cols; }
+
+    // Heap bytes held by the entries
+    size_t memUsage() const { return values.capacity() * sizeof(ValueType); }
+};
+
+using DenseMatrix = DenseMatrixT<float>;
+
+// Function to expand compressed rows into a dense matrix, a block of rows per task
+template <typename ValueType>
+inline DenseMatrixT<ValueType> csrToDense(const CsrMatrixT<ValueType> &csr)
+{
+    DenseMatrixT<ValueType> dense;
+    dense.rows = csr.rows;
+    dense.cols = csr.cols;
+    dense.values.resize(static_cast<size_t>(csr.rows) * csr.cols);
+    tbb::parallel_for(tbb::blocked_range<int>(0, csr.rows), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int i = range.begin(); i != range.end(); ++i)
+        {
+            ValueType *row = dense.row(i);
+            std::fill(row, row + dense.cols, ValueType(0));
+            for (size_t p = csr.rowStart[i]; p < csr.rowStart[i + 1]; ++p)
+            {
+                row[csr.colIndex[p]] = csr.values[p];
+            }
+        }
+    });
+    return dense;
+}
+
+// Function to expand the rows x cols window of a matrix grid straight into a dense matrix, with no compressed-row copy
+// in between. Each leaf-high block of rows is written by a single task; symmetric grids are expanded through gridToCsr.
+template <typename Layout = SliceLayout, typename GridType>
+inline DenseMatrixT<typename GridType::ValueType> gridToDense(const GridType &grid, int rows, int cols)
+{
+    using ValueType = typename GridType::ValueType;
+
+    if (isMatrixSymmetric(grid))
+    {
+        return csrToDense(gridToCsr<Layout>(grid, rows, cols));
+    }
+
+    checkMatrixLayout<Layout>(grid);
+    typename GridType::TreeType::ConstPtr tree = voxelTree(grid);
+    std::vector<const typename GridType::TreeType::LeafNodeType *> leaves = windowLeaves<Layout>(*tree, 0, 0, rows, cols);
+    std::vector<size_t> blockStart;
+    groupLeafBlocks(leaves, 0, blockStart);
+
+    DenseMatrixT<ValueType> dense;
+    dense.rows = rows;
+    dense.cols = cols;
+    dense.values.assign(static_cast<size_t>(rows) * cols, ValueType(0));
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, blockStart.size() - 1), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t b = range.begin(); b != range.end(); ++b)
+        {
+            forEachBlockEntry<Layout>(leaves, blockStart[b], blockStart[b + 1], 0, 0, rows, cols,
+                                      [&](int i, int j, const ValueType &value) { dense.row(i)[j] = value; });
+        }
+    });
+    return dense;
+}
+
+// Function to gather the nonzero entries of a dense matrix into compressed rows; entries smaller in magnitude than
+// dropTolerance are left out. Rows are counted and then filled in parallel.
+template <typename ValueType>
+inline CsrMatrixT<ValueType> denseToCsr(const DenseMatrixT<ValueType> &dense, double dropTolerance = 0.0)
+{
+    auto kept = [&](const ValueType &value)
+    {
+        return value != ValueType(0) && !(std::abs(value) < dropTolerance);
+    };
+
+    CsrMatrixT<ValueType> csr;
+    csr.rows = dense.rows;
+    csr.cols = dense.cols;
+    csr.rowStart.assign(dense.rows + 1, 0);
+    tbb::parallel_for(tbb::blocked_range<int>(0, dense.rows), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int i = range.begin(); i != range.end(); ++i)
+        {
+            csr.rowStart[i + 1] = std::count_if(dense.row(i), dense.row(i) + dense.cols, kept);
+        }
+    });
+    for (int i = 0; i < dense.rows; ++i)
+    {
+        csr.rowStart[i + 1] += csr.rowStart[i];
+    }
+
+    csr.colIndex.resize(csr.rowStart[dense.rows]);
+    csr.values.resize(csr.rowStart[dense.rows]);
+    tbb::parallel_for(tbb::blocked_range<int>(0, dense.rows), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int i = range.begin(); i != range.end(); ++i)
+        {
+            size_t n = csr.rowStart[i];
+            const ValueType *row = dense.row(i);
+            for (int j = 0; j < dense.cols; ++j)
+            {
+                if (kept(row[j]))
+                {
+                    csr.colIndex[n] = j;
+                    csr.values[n] = row[j];
+                    ++n;
+                }
+            }
+        }
+    });
+    return csr;
+}
+
+// Function to form row i of A*B for a sparse A and a dense B in sum, a dense row of B.cols partial sums.
+// The row is built in tiles of tileCols columns, which stay in the L1 cache while the entries of row i of A add their
+// scaled segments of rows of B to them, four rows of B per pass so that every partial sum is loaded and stored once for
+// four multiply-adds. The inner loops are unit-stride with no indices, so they vectorize; every zero of B is multiplied
+// as well, which is what makes this worth it only for B that is mostly full.
+template <typename AccumType, typename ValueType>
+inline void multiplyDenseRow(const CsrMatrixT<ValueType> &A, const DenseMatrixT<ValueType> &B, int i, AccumType *sum,
+                             int tileCols = 1024)
+{
+    for (int first = 0; first < B.cols; first += tileCols)
+    {
+        const int last = std::min(B.cols, first + tileCols);
+        std::fill(sum + first, sum + last, AccumType(0));
+
+        AccumType a[4];
+        const ValueType *b[4];
+        int pending = 0;
+        for (size_t p = A.rowStart[i]; p < A.rowStart[i + 1]; ++p)
+        {
+            if (A.colIndex[p] >= B.rows)
+            {
+                continue;
+            }
+            a[pending] = static_cast<AccumType>(A.values[p]);
+            b[pending] = B.row(A.colIndex[p]);
+            if (++pending == 4)
+            {
+                for (int j = first; j < last; ++j)
+                {
+                    sum[j] += a[0] * static_cast<AccumType>(b[0][j]) + a[1] * static_cast<AccumType>(b[1][j]) +
+                              a[2] * static_cast<AccumType>(b[2][j]) + a[3] * static_cast<AccumType>(b[3][j]);
+                }
+                pending = 0;
+            }
+        }
+        for (int q = 0; q < pending; ++q)
+        {
+            for (int j = first; j < last; ++j)
+            {
+                sum[j] += a[q] * static_cast<AccumType>(b[q][j]);
+            }
+        }
+    }
+}
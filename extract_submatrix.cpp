@@ -1,109 +1,67 @@
 #include <openvdb/openvdb.h>
+#include <algorithm>
 #include <iostream>
-#include <fstream>
 #include <string>
-#include <sstream>
+#include <tuple>
 #include <vector>
 
+#include "csr_matrix.h"
+#include "matrix_cache.h"
+#include "matrix_market_index.h"
+#include "matrix_market_writer.h"
+
 using namespace std;
 
-// Function to read a matrix from a .mtx file and return only a 20x20 submatrix
-vector<tuple<int, int, double>> readSubMatrixFromFile(const string& filename, int& rows, int& cols)
+// Function to save a submatrix view of a loaded grid into a new .mtx file.
+// Only the leaves overlapping the view are touched, so the rest of the matrix is never copied or paged in.
+void saveSubMatrixToFile(const MatrixViewT<openvdb::FloatGrid>& subMatrixView, const string& outputFilename)
 {
-    vector<tuple<int, int, double>> subMatrixData;
-
-    ifstream file(filename);
-    if (!file.is_open()) {
-        cerr << "Error: Unable to open file " << filename << endl;
-        exit(1);
-    }
-
-    string line;
-    bool isHeader = true;
-
-    while (getline(file, line)) {
-        if (line[0] == '%' || line.empty()) {
-            // Skip comment lines or empty lines
-            continue;
-        }
-
-        if (isHeader) {
-            // Read the matrix size from the header (rows, cols, non-zeros)
-            isHeader = false;
-            stringstream ss(line);
-            int nonZeroElements;
-            ss >> rows >> cols >> nonZeroElements;  // Read the dimensions and the number of non-zero elements
-        } else {
-            // Read the matrix data (row, col, value)
-            stringstream ss(line);
-            int row, col;
-            double value;
-            ss >> row >> col >> value;
-
-            // MatrixMarket is 1-based, convert to 0-based
-            row--;
-            col--;
-
-            // Only keep entries within the 20x20 submatrix (i.e., row < 20, col < 20)
-            if (row < 20 && col < 20) {
-                subMatrixData.emplace_back(row, col, value);
-            }
-        }
-    }
-
-    file.close();
-    return subMatrixData;
+    string comment = "Generated " + to_string(subMatrixView.rows) + "x" + to_string(subMatrixView.cols) + " submatrix";
+    writeMatrixMarket(outputFilename, viewToCsr(subMatrixView), MatrixMarketSymmetry::Detect, comment);
+    cout << "Submatrix saved to " << outputFilename << endl;
 }
 
-// Function to save the 20x20 submatrix into a new .mtx file
-void saveSubMatrixToFile(const vector<tuple<int, int, double>>& subMatrixData, const string& outputFilename)
+// Function to read the leading 20x20 submatrix of a .mtx file straight from the text and save it into a new .mtx file.
+// The file's row index (built on the first run) limits parsing to the first block of rows instead of the whole file,
+// which suits a one-off extract from a matrix that has no .vdb cache and is not needed as a grid afterwards.
+void saveIndexedSubMatrixToFile(const string& filename, const string& outputFilename)
 {
-    ofstream outfile(outputFilename);
-    if (!outfile.is_open()) {
-        cerr << "Error: Unable to open file " << outputFilename << endl;
-        exit(1);
-    }
-
-    // Write the Matrix Market header
-    outfile << "%%MatrixMarket matrix coordinate real general" << endl;
-    outfile << "% Generated 20x20 submatrix" << endl;
-
-    // Write the dimensions and number of non-zero entries
-    outfile << "20 20 " << subMatrixData.size() << endl;  // 20x20 matrix, number of non-zero entries
-
-    // Write the non-zero matrix entries
-    for (const auto& entry : subMatrixData) {
-        int row, col;
-        double value;
-        tie(row, col, value) = entry;
-        
-        // Matrix Market format uses 1-based indices, so convert back to 1-based
-        outfile << row + 1 << " " << col + 1 << " " << value << endl;
-    }
-
-    outfile.close();
+    int rows = 0, cols = 0;
+    vector<tuple<int, int, double>> subMatrixData = readSubMatrixTriplets(filename, 0, 20, 0, 20, rows, cols);
+    rows = min(rows, 20);
+    cols = min(cols, 20);
+    string comment = "Generated " + to_string(rows) + "x" + to_string(cols) + " submatrix";
+    writeMatrixTriplets(outputFilename, subMatrixData, rows, cols, MatrixMarketSymmetry::Detect, comment);
     cout << "Submatrix saved to " << outputFilename << endl;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
     // Initialize OpenVDB library
     openvdb::initialize();
 
-    // Set matrix dimensions (will be read from the file header)
-    int rowsA = 0, colsA = 0;
+    // With --index the submatrices are parsed from the text through its row index instead of a loaded grid
+    const bool useIndex = argc > 1 && string(argv[1]) == "--index";
+    const string fileP = "/home/hp/Desktop/project/subodh_data/P.mtx";
+    const string fileS = "/home/hp/Desktop/project/subodh_data/S.mtx";
 
-    // Read the 20x20 submatrix from file
-    vector<tuple<int, int, double>> subMatrixP = readSubMatrixFromFile("/home/hp/Desktop/project/subodh_data/P.mtx", rowsA, colsA);
+    if (useIndex)
+    {
+        saveIndexedSubMatrixToFile(fileP, "submatrix_P_20x20.mtx");
+        saveIndexedSubMatrixToFile(fileS, "submatrix_S_20x20.mtx");
+        return 0;
+    }
 
-    // Save the submatrix to a new .mtx file
-    saveSubMatrixToFile(subMatrixP, "submatrix_P_20x20.mtx");
+    // Set matrix dimensions (will be read from the file header)
+    int rowsA = 0, colsA = 0;
 
-     // Read the 20x20 submatrix from file
-    vector<tuple<int, int, double>> subMatrixS = readSubMatrixFromFile("/home/hp/Desktop/project/subodh_data/S.mtx", rowsA, colsA);
+    // Load P, from its .vdb cache after the first run, and take its leading 20x20 block
+    openvdb::FloatGrid::Ptr P = readMatrixGridCached(fileP, rowsA, colsA);
+    saveSubMatrixToFile(subMatrix(P, 0, min(rowsA, 20), 0, min(colsA, 20)), "submatrix_P_20x20.mtx");
 
-    // Save the submatrix to a new .mtx file
-    saveSubMatrixToFile(subMatrixS, "submatrix_S_20x20.mtx");
+    // Same for S
+    openvdb::FloatGrid::Ptr S = readMatrixGridCached(fileS, rowsA, colsA);
+    saveSubMatrixToFile(subMatrix(S, 0, min(rowsA, 20), 0, min(colsA, 20)), "submatrix_S_20x20.mtx");
 
     return 0;
 }
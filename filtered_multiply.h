@@ -0,0 +1,304 @@
+#pragma once
+
+#include "csr_matrix.h"
+#include "matrix_layout.h"
+#include "sparse_multiply.h"
+
+#include <openvdb/openvdb.h>
+#include <openvdb/tools/Prune.h>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+// Frobenius norms of the nonzero tiles of a matrix, where a tile is the block of entries one leaf holds in a layout.
+// Tile row I covers rows [I * tileRows, (I + 1) * tileRows) and lists its tiles in ascending tile column order.
+struct TileNorms
+{
+    int tileRows = 0;
+    int tileCols = 0;
+    std::vector<size_t> rowStart; // tile rows + 1 offsets into tileCol and norm
+    std::vector<int> tileCol;
+    std::vector<double> norm;
+};
+
+// Function to compute the tile norms of a compressed-row matrix for tiles of tileRows x tileCols entries.
+// Tile rows are independent, so they are summed in parallel with a per-thread dense scratch row of tiles.
+template <typename ValueType>
+inline TileNorms computeTileNorms(const CsrMatrixT<ValueType> &M, int tileRows, int tileCols)
+{
+    const int numTileRows = (M.rows + tileRows - 1) / tileRows;
+    const int numTileCols = (M.cols + tileCols - 1) / tileCols;
+
+    TileNorms norms;
+    norms.tileRows = tileRows;
+    norms.tileCols = tileCols;
+    norms.rowStart.assign(numTileRows + 1, 0);
+
+    struct Scratch
+    {
+        std::vector<double> sums;
+        std::vector<int> marker;
+        std::vector<int> touched;
+    };
+    tbb::enumerable_thread_specific<Scratch> scratch([numTileCols]
+    {
+        return Scratch{std::vector<double>(numTileCols, 0.0), std::vector<int>(numTileCols, -1), {}};
+    });
+
+    std::vector<std::vector<std::pair<int, double>>> tileRowNorms(numTileRows);
+    tbb::parallel_for(tbb::blocked_range<int>(0, numTileRows), [&](const tbb::blocked_range<int> &range)
+    {
+        Scratch &local = scratch.local();
+        for (int I = range.begin(); I != range.end(); ++I)
+        {
+            local.touched.clear();
+            for (int i = I * tileRows; i < std::min(M.rows, (I + 1) * tileRows); ++i)
+            {
+                for (size_t p = M.rowStart[i]; p < M.rowStart[i + 1]; ++p)
+                {
+                    int J = M.colIndex[p] / tileCols;
+                    if (local.marker[J] != I)
+                    {
+                        local.marker[J] = I;
+                        local.sums[J] = 0.0;
+                        local.touched.push_back(J);
+                    }
+                    double value = static_cast<double>(M.values[p]);
+                    local.sums[J] += value * value;
+                }
+            }
+
+            std::sort(local.touched.begin(), local.touched.end());
+            for (int J : local.touched)
+            {
+                tileRowNorms[I].emplace_back(J, std::sqrt(local.sums[J]));
+            }
+            norms.rowStart[I + 1] = local.touched.size();
+        }
+    });
+
+    for (int I = 0; I < numTileRows; ++I)
+    {
+        norms.rowStart[I + 1] += norms.rowStart[I];
+    }
+    norms.tileCol.resize(norms.rowStart[numTileRows]);
+    norms.norm.resize(norms.rowStart[numTileRows]);
+    tbb::parallel_for(0, numTileRows, [&](int I)
+    {
+        size_t n = norms.rowStart[I];
+        for (const auto &[J, norm] : tileRowNorms[I])
+        {
+            norms.tileCol[n] = J;
+            norms.norm[n] = norm;
+            ++n;
+        }
+    });
+
+    return norms;
+}
+
+// Runs of each row of a matrix that fall in the same tile, each tagged with the norm of that tile.
+// Segment s covers the entries [offset[s], offset[s + 1]) of the matrix; row k owns segments [rowStart[k], rowStart[k + 1]).
+struct RowSegments
+{
+    std::vector<size_t> rowStart;
+    std::vector<size_t> offset; // one extra entry closes the last segment
+    std::vector<double> norm;
+    std::vector<double> rowMaxNorm; // largest segment norm of every row
+};
+
+// Function to split every row of B into per-tile segments carrying the tile norms of B
+template <typename ValueType>
+inline RowSegments computeRowSegments(const CsrMatrixT<ValueType> &B, const TileNorms &norms)
+{
+    RowSegments segments;
+    segments.rowStart.assign(B.rows + 1, 0);
+    segments.rowMaxNorm.assign(B.rows, 0.0);
+
+    // First pass: count the tiles every row touches
+    tbb::parallel_for(tbb::blocked_range<int>(0, B.rows), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int k = range.begin(); k != range.end(); ++k)
+        {
+            size_t count = 0;
+            for (size_t q = B.rowStart[k]; q < B.rowStart[k + 1]; ++q)
+            {
+                if (q == B.rowStart[k] || B.colIndex[q] / norms.tileCols != B.colIndex[q - 1] / norms.tileCols)
+                {
+                    ++count;
+                }
+            }
+            segments.rowStart[k + 1] = count;
+        }
+    });
+
+    for (int k = 0; k < B.rows; ++k)
+    {
+        segments.rowStart[k + 1] += segments.rowStart[k];
+    }
+    segments.offset.resize(segments.rowStart[B.rows] + 1);
+    segments.norm.resize(segments.rowStart[B.rows]);
+    segments.offset.back() = B.nonZeros();
+
+    // Second pass: record where every segment starts and look up its tile norm, walking the tile row in step
+    tbb::parallel_for(tbb::blocked_range<int>(0, B.rows), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int k = range.begin(); k != range.end(); ++k)
+        {
+            size_t s = segments.rowStart[k];
+            int K = k / norms.tileRows;
+            size_t t = norms.rowStart[K];
+            for (size_t q = B.rowStart[k]; q < B.rowStart[k + 1]; ++q)
+            {
+                int J = B.colIndex[q] / norms.tileCols;
+                if (q == B.rowStart[k] || J != B.colIndex[q - 1] / norms.tileCols)
+                {
+                    while (norms.tileCol[t] < J)
+                    {
+                        ++t;
+                    }
+                    segments.offset[s] = q;
+                    segments.norm[s] = norms.norm[t];
+                    segments.rowMaxNorm[k] = std::max(segments.rowMaxNorm[k], norms.norm[t]);
+                    ++s;
+                }
+            }
+        }
+    });
+
+    return segments;
+}
+
+// Function to accumulate row i of A*B, skipping every tile product whose norm bound falls below eps.
+// A[i,k] lies in a tile of A and each segment of row k of B in a tile of B; when the product of those two tile
+// norms is below eps the whole segment is skipped without reading its values, and when it is below eps for the
+// largest tile of the row the row of B is skipped outright. Entries of B skipped this way count as spa.skipped.
+template <typename ValueA, typename ValueB, typename AccumType>
+inline void accumulateRowFiltered(const CsrMatrixT<ValueA> &A, const TileNorms &normsA, const CsrMatrixT<ValueB> &B,
+                                  const RowSegments &segmentsB, int i, double eps, SparseAccumulatorT<AccumType> &spa)
+{
+    spa.touched.clear();
+    uint64_t products = 0, skipped = 0;
+
+    // Tiles of A's tile row are walked in step with the columns of row i
+    size_t t = normsA.rowStart[i / normsA.tileRows];
+
+    for (size_t p = A.rowStart[i]; p < A.rowStart[i + 1]; ++p)
+    {
+        int k = A.colIndex[p];
+        AccumType valueA = static_cast<AccumType>(A.values[p]);
+        if (valueA == AccumType(0) || k >= B.rows)
+        {
+            continue;
+        }
+
+        int K = k / normsA.tileCols;
+        while (normsA.tileCol[t] < K)
+        {
+            ++t;
+        }
+        double normA = normsA.norm[t];
+        if (normA * segmentsB.rowMaxNorm[k] < eps)
+        {
+            skipped += B.rowStart[k + 1] - B.rowStart[k];
+            continue;
+        }
+
+        for (size_t s = segmentsB.rowStart[k]; s < segmentsB.rowStart[k + 1]; ++s)
+        {
+            if (normA * segmentsB.norm[s] < eps)
+            {
+                skipped += segmentsB.offset[s + 1] - segmentsB.offset[s];
+                continue;
+            }
+            products += segmentsB.offset[s + 1] - segmentsB.offset[s];
+            for (size_t q = segmentsB.offset[s]; q < segmentsB.offset[s + 1]; ++q)
+            {
+                int j = B.colIndex[q];
+                if (spa.marker[j] != i)
+                {
+                    spa.marker[j] = i;
+                    spa.values[j] = AccumType(0);
+                    spa.touched.push_back(j);
+                }
+                spa.values[j] += valueA * static_cast<AccumType>(B.values[q]);
+            }
+        }
+    }
+
+    std::sort(spa.touched.begin(), spa.touched.end());
+    spa.products += products;
+    spa.skipped += skipped;
+}
+
+// Function to remove every leaf of a matrix grid whose Frobenius norm is below eps.
+// The leaves are measured in parallel, the small ones are switched off and the tree is then pruned of them.
+// Returns the number of leaves removed.
+template <typename GridType>
+inline size_t pruneSmallTiles(GridType &grid, double eps)
+{
+    using LeafType = typename GridType::TreeType::LeafNodeType;
+
+    std::vector<LeafType *> leaves;
+    leaves.reserve(grid.tree().leafCount());
+    grid.tree().getNodes(leaves);
+
+    std::vector<char> removed(leaves.size(), 0);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, leaves.size()), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t n = range.begin(); n != range.end(); ++n)
+        {
+            double sumSquares = 0.0;
+            for (auto iter = leaves[n]->cbeginValueOn(); iter; ++iter)
+            {
+                double value = static_cast<double>(iter.getValue());
+                sumSquares += value * value;
+            }
+            if (std::sqrt(sumSquares) < eps)
+            {
+                leaves[n]->setValuesOff();
+                removed[n] = 1;
+            }
+        }
+    });
+
+    openvdb::tools::pruneInactive(grid.tree());
+    return static_cast<size_t>(std::count(removed.begin(), removed.end(), 1));
+}
+
+// Function to multiply two sparse matrices with eps filtering, as in linear-scaling density-matrix codes.
+// Every leaf-sized tile of A and B carries its Frobenius norm, and a tile product is only computed when
+// ||A_tile|| * ||B_tile|| >= eps; tiles of the result whose norm ends up below eps are pruned from C. The work then
+// follows the decay of the matrices rather than their raw nonzero count. Same contract as multiplyMatricesParallel
+// otherwise, counters included; with eps = 0 the result equals the unfiltered product.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline typename GridType::Ptr multiplyMatricesFiltered(openvdb::SharedPtr<GridType> A, openvdb::SharedPtr<GridType> B, int rows,
+                                                       int cols, double eps, bool deterministic = false,
+                                                       ProductCounters *counters = nullptr)
+{
+    using ValueType = typename GridType::ValueType;
+
+    int rowsA = 0, colsA = 0, rowsB = 0, colsB = 0;
+    matrixExtent<Layout>(*A, rowsA, colsA);
+    matrixExtent<Layout>(*B, rowsB, colsB);
+    int inner = std::max(colsA, rowsB);
+
+    CsrMatrixT<ValueType> csrA = gridToCsr<Layout>(*A, rows, inner);
+    CsrMatrixT<ValueType> csrB = gridToCsr<Layout>(*B, inner, cols);
+
+    TileNorms normsA = computeTileNorms(csrA, Layout::TILE_ROWS, Layout::TILE_COLS);
+    RowSegments segmentsB = computeRowSegments(csrB, computeTileNorms(csrB, Layout::TILE_ROWS, Layout::TILE_COLS));
+
+    typename GridType::Ptr result = assembleProductRows<Layout, AccumType, GridType>(rows, cols, 0.0, deterministic,
+                                                                                    [&](int i, SparseAccumulatorT<AccumType> &spa)
+    {
+        accumulateRowFiltered(csrA, normsA, csrB, segmentsB, i, eps, spa);
+    }, 0, counters);
+
+    pruneSmallTiles(*result, eps);
+    return result;
+}
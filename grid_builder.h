@@ -0,0 +1,103 @@
+#pragma once
+
+#include "matrix_layout.h"
+
+#include <openvdb/openvdb.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+#include <cmath>
+#include <cstdint>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// HalfGrid is part of the standard grid types from OpenVDB 10 on
+#if OPENVDB_LIBRARY_MAJOR_VERSION_NUMBER >= 10
+#define MATRIX_HAS_HALF_GRID 1
+#endif
+
+// Function to make a matrix grid out of numLeaves leaves, the step shared by the builders that fill a leaf at a time.
+// Leaf l is created around originOf(l) and handed to fillLeaf(l, leaf), which sets its buffer and value mask directly.
+// The leaves are made and filled in parallel and attached to the tree in a single pass; the tree takes ownership.
+template <typename Layout, typename GridType, typename OriginOp, typename FillOp>
+inline typename GridType::Ptr buildGridFromLeaves(size_t numLeaves, const OriginOp &originOf, const FillOp &fillLeaf)
+{
+    using LeafType = typename GridType::TreeType::LeafNodeType;
+
+    std::vector<LeafType *> leaves(numLeaves);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numLeaves), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t l = range.begin(); l != range.end(); ++l)
+        {
+            LeafType *leaf = new LeafType(originOf(l), openvdb::zeroVal<typename GridType::ValueType>());
+            fillLeaf(l, *leaf);
+            leaves[l] = leaf;
+        }
+    });
+
+    typename GridType::Ptr grid = GridType::create();
+    setMatrixLayout<Layout>(*grid);
+    for (LeafType *leaf : leaves)
+    {
+        grid->tree().addLeaf(leaf);
+    }
+    return grid;
+}
+
+// Function to build a matrix grid from 0-based (row, col, value) triplets a whole leaf at a time.
+// Triplets are sorted by the origin of the leaf that holds them, every leaf's buffer and value mask are filled
+// directly in parallel, and the finished leaves are attached to the tree in a single pass, so no entry goes through
+// a tree traversal of its own. Repeated coordinates keep the last value, as with setValue.
+// Values smaller in magnitude than threshold are treated as zero and left out; the rest are rounded to the value type
+// of GridType, e.g. FloatGrid, DoubleGrid or HalfGrid.
+template <typename Layout = SliceLayout, typename GridType = openvdb::FloatGrid>
+inline typename GridType::Ptr buildGridFromTriplets(const std::vector<std::tuple<int, int, double>> &triplets,
+                                                    double threshold = 0.0)
+{
+    using ValueType = typename GridType::ValueType;
+    using LeafType = typename GridType::TreeType::LeafNodeType;
+    const int log2Dim = LeafType::LOG2DIM;
+
+    // Key every kept triplet by its leaf; the triplet index breaks ties so repeated coordinates stay in input order
+    std::vector<std::pair<uint64_t, size_t>> keys;
+    keys.reserve(triplets.size());
+    for (size_t n = 0; n < triplets.size(); ++n)
+    {
+        const auto &[row, col, value] = triplets[n];
+        if (std::abs(value) < threshold)
+        {
+            continue;
+        }
+        openvdb::Coord xyz = Layout::toCoord(row, col);
+        uint64_t key = (uint64_t(uint32_t(xyz.x() >> log2Dim)) << 32) | uint32_t(xyz.y() >> log2Dim);
+        keys.emplace_back(key, n);
+    }
+    tbb::parallel_sort(keys.begin(), keys.end());
+
+    // Each run of equal keys becomes one leaf
+    std::vector<size_t> leafStart;
+    for (size_t n = 0; n < keys.size(); ++n)
+    {
+        if (n == 0 || keys[n].first != keys[n - 1].first)
+        {
+            leafStart.push_back(n);
+        }
+    }
+    leafStart.push_back(keys.size());
+    const size_t numLeaves = leafStart.size() - 1;
+
+    return buildGridFromLeaves<Layout, GridType>(numLeaves, [&](size_t l)
+    {
+        const auto &[firstRow, firstCol, firstValue] = triplets[keys[leafStart[l]].second];
+        return Layout::toCoord(firstRow, firstCol);
+    },
+    [&](size_t l, LeafType &leaf)
+    {
+        for (size_t n = leafStart[l]; n < leafStart[l + 1]; ++n)
+        {
+            const auto &[row, col, value] = triplets[keys[n].second];
+            leaf.setValueOn(LeafType::coordToOffset(Layout::toCoord(row, col)), static_cast<ValueType>(value));
+        }
+    });
+}
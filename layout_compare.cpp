@@ -0,0 +1,95 @@
+#include <openvdb/openvdb.h>
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "grid_builder.h"
+#include "matrix_generator.h"
+#include "matrix_layout.h"
+#include "matrix_trace.h"
+#include "sparse_multiply.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Function to generate a sparse matrix with a unit-range diagonal and nnzPerRow - 1 small off-diagonal entries per row.
+// With band > 0 the off-diagonal columns stay within band of the diagonal, otherwise they are spread uniformly.
+vector<tuple<int, int, double>> makeMatrix(int n, int nnzPerRow, int band, uint64_t seed)
+{
+    MatrixGeneratorOptions options;
+    options.pattern = band > 0 ? SparsityPattern::Banded : SparsityPattern::Uniform;
+    options.nnzPerRow = nnzPerRow;
+    options.bandwidth = band;
+    options.seed = seed;
+    return generateMatrixTriplets(n, options);
+}
+
+// Function to build A and B in one layout and report their storage and the time to multiply them and take trace(A*B)
+template <typename Layout>
+double compareLayout(const vector<tuple<int, int, double>> &tripletsA, const vector<tuple<int, int, double>> &tripletsB, int n)
+{
+    openvdb::FloatGrid::Ptr A = buildGridFromTriplets<Layout>(tripletsA);
+    openvdb::FloatGrid::Ptr B = buildGridFromTriplets<Layout>(tripletsB);
+
+    auto start1 = high_resolution_clock::now();
+    openvdb::FloatGrid::Ptr result = multiplyMatricesParallel<Layout>(A, B, n, n, 0.0, true);
+    auto stop1 = high_resolution_clock::now();
+
+    auto start2 = high_resolution_clock::now();
+    double trace = traceOfProduct<Layout>(A, B, true);
+    auto stop2 = high_resolution_clock::now();
+
+    double nonZeros = static_cast<double>(A->activeVoxelCount());
+    cout << "  " << Layout::name() << " (" << Layout::TILE_ROWS << "x" << Layout::TILE_COLS << " tiles)" << endl;
+    cout << "    Leaves of A :: " << A->tree().leafCount() << endl;
+    cout << "    Memory of A :: " << A->memUsage() << " bytes (" << A->memUsage() / nonZeros << " per nonzero)" << endl;
+    cout << "    Leaves of A*B :: " << result->tree().leafCount() << ", memory " << result->memUsage() << " bytes" << endl;
+    cout << "    Time taken for matrix multiplication :: " << duration_cast<milliseconds>(stop1 - start1).count() << "ms"
+         << endl;
+    cout << "    Time taken for fused trace :: " << duration_cast<milliseconds>(stop2 - start2).count() << "ms" << endl;
+    cout << "    Trace of the result matrix :: " << trace << endl;
+
+    return trace;
+}
+
+// Function to run every layout on one pair of matrices and check that they agree on trace(A*B); returns false if not
+bool compareLayouts(const string &pattern, int n, int band)
+{
+    vector<tuple<int, int, double>> tripletsA = makeMatrix(n, 10, band, 1);
+    vector<tuple<int, int, double>> tripletsB = makeMatrix(n, 10, band, 2);
+
+    cout << endl
+         << pattern << " " << n << " by " << n << endl;
+
+    double slice = compareLayout<SliceLayout>(tripletsA, tripletsB, n);
+    double columnFold = compareLayout<ColumnFoldLayout>(tripletsA, tripletsB, n);
+    double tileFold = compareLayout<TileFoldLayout>(tripletsA, tripletsB, n);
+
+    // The fused trace sums entries in layout order, so only rounding differences are expected
+    double tolerance = 1e-9 * max(1.0, abs(slice));
+    if (abs(columnFold - slice) > tolerance || abs(tileFold - slice) > tolerance)
+    {
+        cerr << "Error: Layouts disagree on the trace of " << pattern << " " << n << " by " << n << endl;
+        return false;
+    }
+    return true;
+}
+
+int main()
+{
+    // Initialize OpenVDB library
+    openvdb::initialize();
+
+    // Run every case before failing, so one report shows all the layouts that regressed
+    bool agree = true;
+    for (int n = 10000; n <= 40000; n *= 2)
+    {
+        agree = compareLayouts("Uniform", n, 0) && agree;
+        agree = compareLayouts("Banded", n, 32) && agree;
+    }
+
+    return agree ? 0 : 1;
+}
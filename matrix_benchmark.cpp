@@ -0,0 +1,254 @@
+#include <openvdb/openvdb.h>
+#include <tbb/global_control.h>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "adaptive_multiply.h"
+#include "benchmark_harness.h"
+#include "csr_matrix.h"
+#include "grid_builder.h"
+#include "matrix_compare.h"
+#include "matrix_market.h"
+#include "memory_report.h"
+#include "matrix_trace.h"
+#include "sparse_multiply.h"
+
+using namespace std;
+
+// Parameter grid of one benchmark run; every combination of dims x nnzPerRow x patterns x threads is measured
+struct BenchmarkConfig : BenchmarkOptions
+{
+    string mtxFile; // optional .mtx file for the load phase
+    string output;  // JSON goes to stdout when empty
+};
+
+// Timings of one phase of one case, plus the work it did per call
+struct PhaseResult
+{
+    string pattern;
+    int dim = 0;
+    int nnzPerRow = 0;
+    int threads = 0;
+    string phase;
+    vector<double> ns; // one sample per repetition
+    double flops = 0.0;
+    double nonZeros = 0.0;
+    size_t memUsage = 0;
+    size_t rss = 0;     // resident set size after the phase, bytes
+    size_t peakRss = 0; // peak resident set size since this case started on this thread count, bytes
+};
+
+// Function to read the benchmark parameters from "--name value" pairs
+BenchmarkConfig parseArguments(int argc, char *argv[])
+{
+    BenchmarkConfig config;
+    parseBenchmarkArguments(argc, argv, config, [&](const string &name, const string &value)
+    {
+        if (name == "--mtx")
+        {
+            config.mtxFile = value;
+            return true;
+        }
+        if (name == "--out")
+        {
+            config.output = value;
+            return true;
+        }
+        return false;
+    });
+    return config;
+}
+
+// Function to count the scalar multiply-adds of A*B, i.e. sum over A[i,k] of the length of row k of B
+double countProducts(const CsrMatrix &A, const CsrMatrix &B)
+{
+    double products = 0.0;
+    for (size_t p = 0; p < A.nonZeros(); ++p)
+    {
+        int k = A.colIndex[p];
+        if (k < B.rows)
+        {
+            products += static_cast<double>(B.rowStart[k + 1] - B.rowStart[k]);
+        }
+    }
+    return products;
+}
+
+// Function to write one phase result as a JSON object; rates are computed from the median time
+void writeResult(ostream &out, const PhaseResult &result)
+{
+    double ns = median(result.ns);
+    double seconds = ns * 1e-9;
+
+    out << "    {\"pattern\": \"" << result.pattern << "\", \"dim\": " << result.dim << ", \"nnz_per_row\": " << result.nnzPerRow
+        << ", \"threads\": " << result.threads << ", \"phase\": \"" << result.phase << "\", \"reps\": " << result.ns.size()
+        << ", \"ns_per_op\": " << ns << ", \"ns_min\": " << *min_element(result.ns.begin(), result.ns.end())
+        << ", \"ns_max\": " << *max_element(result.ns.begin(), result.ns.end());
+    if (result.flops > 0.0)
+    {
+        out << ", \"gflops\": " << (seconds > 0.0 ? result.flops / seconds * 1e-9 : 0.0);
+    }
+    out << ", \"nnz_per_s\": " << (seconds > 0.0 ? result.nonZeros / seconds : 0.0) << ", \"mem_usage_bytes\": " << result.memUsage
+        << ", \"rss_kb\": " << result.rss / 1024 << ", \"peak_rss_kb\": " << result.peakRss / 1024 << "}";
+}
+
+// Function to measure build, multiply, adaptive multiply, trace and compare for one matrix size, density and pattern
+// on each thread count
+void benchmarkCase(const BenchmarkConfig &config, const string &pattern, int n, int nnzPerRow, vector<PhaseResult> &results)
+{
+    // Both matrices come from fixed seeds, so every run and every build measures the same inputs
+    vector<tuple<int, int, double>> tripletsA = makeBenchmarkMatrix(n, nnzPerRow, pattern, config.seed);
+    vector<tuple<int, int, double>> tripletsB = makeBenchmarkMatrix(n, nnzPerRow, pattern, config.seed + 1);
+
+    for (int threads : config.threads)
+    {
+        tbb::global_control control(tbb::global_control::max_allowed_parallelism, threads);
+        resetPeakRss();
+        cerr << pattern << " " << n << " x " << n << ", " << nnzPerRow << " nnz/row, " << threads << " threads" << endl;
+
+        auto record = [&](const string &phase, const vector<double> &ns, double flops, double nonZeros, size_t memUsage)
+        {
+            PhaseResult result;
+            result.pattern = pattern;
+            result.dim = n;
+            result.nnzPerRow = nnzPerRow;
+            result.threads = threads;
+            result.phase = phase;
+            result.ns = ns;
+            result.flops = flops;
+            result.nonZeros = nonZeros;
+            result.memUsage = memUsage;
+            result.rss = currentRssBytes();
+            result.peakRss = peakRssBytes();
+            results.push_back(result);
+        };
+
+        openvdb::FloatGrid::Ptr A, B, C;
+        vector<double> ns = timePhase(config.warmup, config.reps, [&]
+        {
+            A = buildGridFromTriplets(tripletsA);
+        });
+        B = buildGridFromTriplets(tripletsB);
+        record("build", ns, 0.0, static_cast<double>(tripletsA.size()), A->memUsage());
+
+        CsrMatrix csrA = gridToCsr(*A, n, n);
+        CsrMatrix csrB = gridToCsr(*B, n, n);
+        double products = countProducts(csrA, csrB);
+
+        ns = timePhase(config.warmup, config.reps, [&]
+        {
+            C = multiplyMatricesParallel(A, B, n, n, 0.0, true);
+        });
+        record("multiply", ns, 2.0 * products, static_cast<double>(C->activeVoxelCount()), C->memUsage());
+
+        // The same product with the storage and kernels the densities of A and B call for; the choices go to stderr
+        AdaptiveProductReport report;
+        AdaptiveMatrix adaptiveC;
+        ns = timePhase(config.warmup, config.reps, [&]
+        {
+            adaptiveC = multiplyAdaptive(A, B, n, n, report);
+        });
+        printAdaptiveReport(cerr, report);
+        record("adaptive_multiply", ns, 2.0 * products, static_cast<double>(report.densityC.nonZeros), adaptiveC.memUsage());
+
+        volatile double trace = 0.0;
+        ns = timePhase(config.warmup, config.reps, [&]
+        {
+            trace = traceOfProduct(A, B, true);
+        });
+        record("trace", ns, 2.0 * csrA.nonZeros(), static_cast<double>(csrA.nonZeros()), A->memUsage() + B->memUsage());
+
+        CsrMatrix csrC = gridToCsr(*C, n, n);
+        volatile double error = 0.0;
+        ns = timePhase(config.warmup, config.reps, [&]
+        {
+            error = compareProduct(csrA, csrB, csrC, 1.0).maxAbs;
+        });
+        record("compare", ns, 2.0 * products, static_cast<double>(csrC.nonZeros()), C->memUsage());
+    }
+}
+
+// Function to measure the load phase on a .mtx file for each thread count
+void benchmarkLoad(const BenchmarkConfig &config, vector<PhaseResult> &results)
+{
+    for (int threads : config.threads)
+    {
+        tbb::global_control control(tbb::global_control::max_allowed_parallelism, threads);
+        resetPeakRss();
+        cerr << "load " << config.mtxFile << ", " << threads << " threads" << endl;
+
+        int rows = 0, cols = 0;
+        size_t nonZeros = 0;
+        vector<double> ns = timePhase(config.warmup, config.reps, [&]
+        {
+            nonZeros = readMatrixTriplets(config.mtxFile, rows, cols).size();
+        });
+
+        PhaseResult result;
+        result.pattern = "file";
+        result.dim = rows;
+        result.nnzPerRow = rows > 0 ? static_cast<int>(nonZeros / rows) : 0;
+        result.threads = threads;
+        result.phase = "load";
+        result.ns = ns;
+        result.nonZeros = static_cast<double>(nonZeros);
+        result.rss = currentRssBytes();
+        result.peakRss = peakRssBytes();
+        results.push_back(result);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // Initialize OpenVDB library
+    openvdb::initialize();
+
+    BenchmarkConfig config = parseArguments(argc, argv);
+
+    vector<PhaseResult> results;
+    if (!config.mtxFile.empty())
+    {
+        benchmarkLoad(config, results);
+    }
+    for (const string &pattern : config.patterns)
+    {
+        for (int n : config.dims)
+        {
+            for (int nnzPerRow : config.nnzPerRow)
+            {
+                benchmarkCase(config, pattern, n, nnzPerRow, results);
+            }
+        }
+    }
+
+    ofstream file;
+    if (!config.output.empty())
+    {
+        file.open(config.output);
+        if (!file.is_open())
+        {
+            cerr << "Error: Unable to open file " << config.output << endl;
+            return 1;
+        }
+    }
+    ostream &out = config.output.empty() ? cout : file;
+    out << setprecision(10);
+
+    out << "{" << endl
+        << "  \"seed\": " << config.seed << ", \"warmup\": " << config.warmup << ", \"reps\": " << config.reps << "," << endl
+        << "  \"results\": [" << endl;
+    for (size_t r = 0; r < results.size(); ++r)
+    {
+        writeResult(out, results[r]);
+        out << (r + 1 < results.size() ? "," : "") << endl;
+    }
+    out << "  ]" << endl
+        << "}" << endl;
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "matrix_market.h"
+
+#include <openvdb/openvdb.h>
+#include <openvdb/io/File.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+// Identity of a source .mtx file, recorded in the metadata of its .vdb cache
+struct MatrixCacheKey
+{
+    std::string path;
+    int64_t size = 0;
+    int64_t mtime = 0;
+    double threshold = 0.0;
+    std::string layout;
+};
+
+// Function to build the cache key of a .mtx file from its absolute path, size and modification time
+inline MatrixCacheKey matrixCacheKey(const std::string &filename, double threshold, const std::string &layout)
+{
+    MatrixCacheKey key;
+    key.path = std::filesystem::absolute(filename).string();
+    key.size = static_cast<int64_t>(std::filesystem::file_size(filename));
+    key.mtime = static_cast<int64_t>(std::filesystem::last_write_time(filename).time_since_epoch().count());
+    key.threshold = threshold;
+    key.layout = layout;
+    return key;
+}
+
+// Function to return the sidecar cache path of a .mtx file, e.g. P.mtx -> P.mtx.vdb
+inline std::string matrixCachePath(const std::string &filename)
+{
+    return filename + ".vdb";
+}
+
+// Function to check whether cached grid metadata was written for the given key
+inline bool matchesCacheKey(const openvdb::MetaMap &meta, const MatrixCacheKey &key)
+{
+    try
+    {
+        return meta.metaValue<std::string>("source_path") == key.path &&
+               meta.metaValue<openvdb::Int64>("source_size") == key.size &&
+               meta.metaValue<openvdb::Int64>("source_mtime") == key.mtime &&
+               meta.metaValue<double>("threshold") == key.threshold &&
+               meta.metaValue<std::string>("matrix_layout") == key.layout;
+    }
+    catch (const openvdb::Exception &)
+    {
+        return false; // Written by something else, or missing fields
+    }
+}
+
+// Function to read a matrix from a .mtx file into an OpenVDB grid, reusing a sidecar .vdb cache.
+// The cache is only used when its recorded source path, size, modification time, threshold and layout all match; it is
+// opened with delayed loading, so leaf buffers are paged in from disk only when touched. Otherwise the text file is
+// parsed and the cache is (re)written next to it for the next run. A cache holding a different grid type is rewritten too.
+template <typename Layout = SliceLayout, typename GridType = openvdb::FloatGrid>
+inline typename GridType::Ptr readMatrixGridCached(const std::string &filename, int &rows, int &cols, double threshold = 0.0)
+{
+    const std::string gridName = "matrix";
+
+    if (!std::filesystem::exists(filename))
+    {
+        std::cerr << "Error: Unable to open file " << filename << std::endl;
+        exit(1);
+    }
+
+    MatrixCacheKey key = matrixCacheKey(filename, threshold, Layout::name());
+    std::string cachePath = matrixCachePath(filename);
+
+    if (std::filesystem::exists(cachePath))
+    {
+        try
+        {
+            openvdb::io::File file(cachePath);
+            file.open(true); // delayed loading
+
+            // Check the key from the grid metadata before touching any tree data
+            openvdb::GridBase::Ptr meta = file.readGridMetadata(gridName);
+            if (matchesCacheKey(*meta, key) && meta->isType<GridType>())
+            {
+                typename GridType::Ptr grid = openvdb::gridPtrCast<GridType>(file.readGrid(gridName));
+                file.close();
+                if (grid)
+                {
+                    rows = grid->template metaValue<openvdb::Int32>("rows");
+                    cols = grid->template metaValue<openvdb::Int32>("cols");
+                    return grid;
+                }
+            }
+            file.close();
+        }
+        catch (const openvdb::Exception &e)
+        {
+            std::cerr << "Warning: Ignoring unreadable cache " << cachePath << ": " << e.what() << std::endl;
+        }
+    }
+
+    typename GridType::Ptr grid = readMatrixGrid<Layout, GridType>(filename, rows, cols, threshold);
+    grid->setName(gridName);
+    grid->insertMeta("source_path", openvdb::StringMetadata(key.path));
+    grid->insertMeta("source_size", openvdb::Int64Metadata(key.size));
+    grid->insertMeta("source_mtime", openvdb::Int64Metadata(key.mtime));
+    grid->insertMeta("threshold", openvdb::DoubleMetadata(threshold));
+    grid->insertMeta("rows", openvdb::Int32Metadata(rows));
+    grid->insertMeta("cols", openvdb::Int32Metadata(cols));
+
+    // Write to a temporary file first so a crashed run never leaves a half-written cache behind
+    std::string tempPath = cachePath + ".tmp";
+    try
+    {
+        openvdb::GridPtrVec grids;
+        grids.push_back(grid);
+        openvdb::io::File file(tempPath);
+        file.write(grids);
+        file.close();
+        if (std::rename(tempPath.c_str(), cachePath.c_str()) != 0)
+        {
+            std::cerr << "Warning: Unable to move " << tempPath << " to " << cachePath << ": " << std::strerror(errno)
+                      << std::endl;
+            std::remove(tempPath.c_str());
+        }
+    }
+    catch (const openvdb::Exception &e)
+    {
+        std::remove(tempPath.c_str());
+        std::cerr << "Warning: Unable to write cache " << cachePath << ": " << e.what() << std::endl;
+    }
+
+    return grid;
+}
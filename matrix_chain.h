@@ -0,0 +1,502 @@
+#pragma once
+
+#include "csr_matrix.h"
+#include "matrix_compare.h"
+#include "matrix_layout.h"
+#include "matrix_market_writer.h"
+#include "sparse_multiply.h"
+
+#include <openvdb/openvdb.h>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Nonzero counts of every row and column of a matrix; the cost model of a matrix chain works on these alone.
+// For input matrices they are exact, for intermediate products they are estimates.
+struct SparsitySketch
+{
+    int rows = 0;
+    int cols = 0;
+    std::vector<double> rowCounts;
+    std::vector<double> colCounts;
+
+    double nonZeros() const
+    {
+        double sum = 0.0;
+        for (double count : rowCounts)
+        {
+            sum += count;
+        }
+        return sum;
+    }
+};
+
+// Function to take the exact sketch of a compressed-row matrix
+template <typename ValueType>
+inline SparsitySketch sketchOf(const CsrMatrixT<ValueType> &M)
+{
+    SparsitySketch sketch;
+    sketch.rows = M.rows;
+    sketch.cols = M.cols;
+    sketch.rowCounts.resize(M.rows);
+    sketch.colCounts.assign(M.cols, 0.0);
+    for (int i = 0; i < M.rows; ++i)
+    {
+        sketch.rowCounts[i] = static_cast<double>(M.rowStart[i + 1] - M.rowStart[i]);
+    }
+    for (int j : M.colIndex)
+    {
+        sketch.colCounts[j] += 1.0;
+    }
+    return sketch;
+}
+
+// Function to estimate the cost of X*Y from the sketches of X and Y.
+// The multiply-add count sum_k colCounts_X[k] * rowCounts_Y[k] is exact whenever the sketches are. The sketch of the
+// product spreads the products of each row and column evenly over the inner dimension and assumes products land on
+// random positions, so a row of c columns hit by p products holds about c * (1 - exp(-p / c)) entries.
+inline double estimateProduct(const SparsitySketch &X, const SparsitySketch &Y, SparsitySketch &XY)
+{
+    const int inner = std::min(X.cols, Y.rows);
+
+    double flops = 0.0;
+    for (int k = 0; k < inner; ++k)
+    {
+        flops += X.colCounts[k] * Y.rowCounts[k];
+    }
+
+    double perInnerY = inner > 0 ? Y.nonZeros() / inner : 0.0;
+    double perInnerX = inner > 0 ? X.nonZeros() / inner : 0.0;
+
+    XY.rows = X.rows;
+    XY.cols = Y.cols;
+    XY.rowCounts.resize(X.rows);
+    XY.colCounts.resize(Y.cols);
+    for (int i = 0; i < X.rows; ++i)
+    {
+        double products = X.rowCounts[i] * perInnerY;
+        XY.rowCounts[i] = Y.cols > 0 ? Y.cols * -std::expm1(-products / Y.cols) : 0.0;
+    }
+    double colSum = 0.0;
+    for (int j = 0; j < Y.cols; ++j)
+    {
+        double products = Y.colCounts[j] * perInnerX;
+        XY.colCounts[j] = X.rows > 0 ? X.rows * -std::expm1(-products / X.rows) : 0.0;
+        colSum += XY.colCounts[j];
+    }
+
+    // Both estimates count the same entries, so scale the columns to agree with the rows
+    double rowSum = XY.nonZeros();
+    if (colSum > 0.0)
+    {
+        for (double &count : XY.colCounts)
+        {
+            count *= rowSum / colSum;
+        }
+    }
+
+    return flops;
+}
+
+// Evaluation order of a matrix chain M0 * M1 * ... * Mn-1.
+// split[i][j] is the k at which the product of Mi..Mj is split into (Mi..Mk) * (Mk+1..Mj).
+struct ChainPlan
+{
+    int length = 0;
+    std::vector<std::vector<int>> split;
+    double flops = 0.0;     // estimated multiply-adds of the whole chain
+    double nonZeros = 0.0;  // estimated nonzeros of the final product
+};
+
+// Function to pick the cheapest evaluation order of a matrix chain by dynamic programming over its sketches.
+// Every sub-chain keeps the sketch of its cheapest split, which then prices the products it takes part in.
+inline ChainPlan planMatrixChain(const std::vector<SparsitySketch> &sketches)
+{
+    const int n = static_cast<int>(sketches.size());
+
+    ChainPlan plan;
+    plan.length = n;
+    plan.split.assign(n, std::vector<int>(n, -1));
+
+    std::vector<std::vector<double>> cost(n, std::vector<double>(n, 0.0));
+    std::vector<std::vector<SparsitySketch>> sketch(n, std::vector<SparsitySketch>(n));
+    for (int i = 0; i < n; ++i)
+    {
+        sketch[i][i] = sketches[i];
+    }
+
+    for (int length = 2; length <= n; ++length)
+    {
+        for (int i = 0; i + length - 1 < n; ++i)
+        {
+            int j = i + length - 1;
+            cost[i][j] = std::numeric_limits<double>::infinity();
+            for (int k = i; k < j; ++k)
+            {
+                SparsitySketch product;
+                double flops = estimateProduct(sketch[i][k], sketch[k + 1][j], product);
+                double total = cost[i][k] + cost[k + 1][j] + flops;
+                if (total < cost[i][j])
+                {
+                    cost[i][j] = total;
+                    plan.split[i][j] = k;
+                    sketch[i][j] = std::move(product);
+                }
+            }
+        }
+    }
+
+    if (n > 0)
+    {
+        plan.flops = cost[0][n - 1];
+        plan.nonZeros = sketch[0][n - 1].nonZeros();
+    }
+    return plan;
+}
+
+// Function to plan a chain of compressed-row matrices from their exact sketches
+template <typename ValueType>
+inline ChainPlan planMatrixChain(const std::vector<const CsrMatrixT<ValueType> *> &chain)
+{
+    std::vector<SparsitySketch> sketches;
+    for (const CsrMatrixT<ValueType> *M : chain)
+    {
+        sketches.push_back(sketchOf(*M));
+    }
+    return planMatrixChain(sketches);
+}
+
+// Function to write the evaluation order of the sub-chain Mi..Mj with the given names, e.g. "((P*S)*P)"
+inline std::string formatChainPlan(const ChainPlan &plan, const std::vector<std::string> &names, int i = 0, int j = -1)
+{
+    if (j < 0)
+    {
+        j = plan.length - 1;
+    }
+    if (i == j)
+    {
+        return names[i];
+    }
+    int k = plan.split[i][j];
+    return "(" + formatChainPlan(plan, names, i, k) + "*" + formatChainPlan(plan, names, k + 1, j) + ")";
+}
+
+// Function to multiply out the sub-chain Mi..Mj in the planned order.
+// Inputs are used in place; intermediates are cached by the exact sequence of matrices they multiply, so a repeated
+// sub-chain such as the two PS factors of P*S*P*S is only computed once.
+template <typename AccumType, typename ValueType>
+inline std::shared_ptr<const CsrMatrixT<ValueType>> evaluateSubChain(
+    const std::vector<const CsrMatrixT<ValueType> *> &chain, const ChainPlan &plan, int i, int j,
+    std::map<std::vector<const CsrMatrixT<ValueType> *>, std::shared_ptr<const CsrMatrixT<ValueType>>> &cache)
+{
+    if (i == j)
+    {
+        return std::shared_ptr<const CsrMatrixT<ValueType>>(chain[i], [](const CsrMatrixT<ValueType> *) {});
+    }
+
+    std::vector<const CsrMatrixT<ValueType> *> key(chain.begin() + i, chain.begin() + j + 1);
+    auto found = cache.find(key);
+    if (found != cache.end())
+    {
+        return found->second;
+    }
+
+    int k = plan.split[i][j];
+    std::shared_ptr<const CsrMatrixT<ValueType>> left = evaluateSubChain<AccumType>(chain, plan, i, k, cache);
+    std::shared_ptr<const CsrMatrixT<ValueType>> right = evaluateSubChain<AccumType>(chain, plan, k + 1, j, cache);
+    auto product = std::make_shared<const CsrMatrixT<ValueType>>(multiplyCsr<AccumType>(*left, *right));
+    cache[key] = product;
+    return product;
+}
+
+// Function to return an n x n identity in compressed rows
+template <typename ValueType>
+inline CsrMatrixT<ValueType> identityCsr(int n)
+{
+    CsrMatrixT<ValueType> I;
+    I.rows = n;
+    I.cols = n;
+    I.rowStart.resize(n + 1);
+    I.colIndex.resize(n);
+    I.values.assign(n, ValueType(1));
+    for (int i = 0; i <= n; ++i)
+    {
+        I.rowStart[i] = i;
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        I.colIndex[i] = i;
+    }
+    return I;
+}
+
+// The two factors of the last product of a planned chain, ready for a consumer to multiply row by row
+template <typename ValueType>
+struct ChainFactors
+{
+    std::shared_ptr<const CsrMatrixT<ValueType>> left;
+    std::shared_ptr<const CsrMatrixT<ValueType>> right;
+};
+
+// Function to evaluate everything but the last product of a chain. A single matrix is paired with an identity.
+template <typename AccumType, typename ValueType>
+inline ChainFactors<ValueType> chainFactors(const std::vector<const CsrMatrixT<ValueType> *> &chain, const ChainPlan &plan)
+{
+    const int n = static_cast<int>(chain.size());
+    std::map<std::vector<const CsrMatrixT<ValueType> *>, std::shared_ptr<const CsrMatrixT<ValueType>>> cache;
+
+    ChainFactors<ValueType> factors;
+    if (n == 1)
+    {
+        factors.left = evaluateSubChain<AccumType>(chain, plan, 0, 0, cache);
+        factors.right = std::make_shared<const CsrMatrixT<ValueType>>(identityCsr<ValueType>(chain[0]->cols));
+        return factors;
+    }
+
+    int k = plan.split[0][n - 1];
+    factors.left = evaluateSubChain<AccumType>(chain, plan, 0, k, cache);
+    factors.right = evaluateSubChain<AccumType>(chain, plan, k + 1, n - 1, cache);
+    return factors;
+}
+
+// Function to reduce over the rows of the chain product without storing it.
+// Each row of the last product is built in a per-thread sparse accumulator and handed to rowOp(i, spa, result);
+// the rows are reduced with a fixed split, so results are reproducible from run to run.
+template <typename AccumType, typename ResultType, typename ValueType, typename RowOpType, typename JoinType>
+inline ResultType reduceChainRows(const std::vector<const CsrMatrixT<ValueType> *> &chain, const ChainPlan &plan, int rows,
+                                  const RowOpType &rowOp, const JoinType &join)
+{
+    ChainFactors<ValueType> factors = chainFactors<AccumType>(chain, plan);
+    const CsrMatrixT<ValueType> &left = *factors.left;
+    const CsrMatrixT<ValueType> &right = *factors.right;
+
+    tbb::enumerable_thread_specific<SparseAccumulatorT<AccumType>> accumulators([cols = right.cols]
+    {
+        return SparseAccumulatorT<AccumType>(cols);
+    });
+
+    return tbb::parallel_deterministic_reduce(
+        tbb::blocked_range<int>(0, rows, 256), ResultType(),
+        [&](const tbb::blocked_range<int> &range, ResultType result)
+        {
+            SparseAccumulatorT<AccumType> &spa = accumulators.local();
+            for (int i = range.begin(); i != range.end(); ++i)
+            {
+                if (i < left.rows)
+                {
+                    accumulateRow(left, right, i, 0.0, spa);
+                }
+                else
+                {
+                    spa.touched.clear();
+                }
+                rowOp(i, spa, result);
+            }
+            return result;
+        },
+        join);
+}
+
+// Function to calculate the trace of a chain product, e.g. trace(S*P*S), with the last product fused into the sum
+template <typename AccumType = double, typename ValueType>
+inline AccumType traceOfChain(const std::vector<const CsrMatrixT<ValueType> *> &chain, const ChainPlan &plan)
+{
+    const int n = std::min(chain.front()->rows, chain.back()->cols);
+    return reduceChainRows<AccumType, AccumType>(chain, plan, n,
+        [](int i, const SparseAccumulatorT<AccumType> &spa, AccumType &sum)
+        {
+            if (spa.marker[i] == i)
+            {
+                sum += spa.values[i];
+            }
+        },
+        [](AccumType a, AccumType b) { return a + b; });
+}
+
+// Function to compare a chain product with scale * R, e.g. P*S*P with 2P, with the last product fused into the
+// comparison as in compareProduct
+template <typename ValueType>
+inline MatrixDifference compareChain(const std::vector<const CsrMatrixT<ValueType> *> &chain, const ChainPlan &plan,
+                                     const CsrMatrixT<ValueType> &R, double scale)
+{
+    const int rows = std::max(chain.front()->rows, R.rows);
+    return reduceChainRows<double, MatrixDifference>(chain, plan, rows,
+        [&](int i, const SparseAccumulator &spa, MatrixDifference &difference)
+        {
+            addRowDifference(spa, 1.0, R, i, scale, difference);
+        },
+        [](MatrixDifference a, const MatrixDifference &b)
+        {
+            a.merge(b);
+            return a;
+        });
+}
+
+// Function to hand the rows of a chain product to blockOp(block, firstRow) blockRows rows at a time, without storing the
+// whole product. Everything but the last product is evaluated first; the rows of the last one are formed block by block
+// with multiplyCsrInto, whose buffers and output block are reused, so memory stays bounded by one block of the result.
+template <typename AccumType = double, typename ValueType, typename BlockOpType>
+inline void forEachChainBlock(const std::vector<const CsrMatrixT<ValueType> *> &chain, const ChainPlan &plan,
+                              BlockOpType &&blockOp, int blockRows = 1 << 16)
+{
+    ChainFactors<ValueType> factors = chainFactors<AccumType>(chain, plan);
+    const CsrMatrixT<ValueType> &left = *factors.left;
+    const CsrMatrixT<ValueType> &right = *factors.right;
+
+    CsrMatrixT<ValueType> leftRows, block;
+    CsrProductBuffersT<ValueType, AccumType> buffers(right.cols);
+    for (int firstRow = 0; firstRow < left.rows; firstRow += blockRows)
+    {
+        const int lastRow = std::min(left.rows, firstRow + blockRows);
+        const size_t first = left.rowStart[firstRow], last = left.rowStart[lastRow];
+        leftRows.rows = lastRow - firstRow;
+        leftRows.cols = left.cols;
+        leftRows.rowStart.resize(leftRows.rows + 1);
+        for (int r = 0; r <= leftRows.rows; ++r)
+        {
+            leftRows.rowStart[r] = left.rowStart[firstRow + r] - first;
+        }
+        leftRows.colIndex.assign(left.colIndex.begin() + first, left.colIndex.begin() + last);
+        leftRows.values.assign(left.values.begin() + first, left.values.begin() + last);
+
+        multiplyCsrInto(leftRows, right, block, buffers);
+        blockOp(static_cast<const CsrMatrixT<ValueType> &>(block), firstRow);
+    }
+}
+
+// Function to write a chain product to a .mtx file, e.g. P*S*P, with the rows of the last product streamed to disk a
+// block at a time by writeMatrixMarketRows. The number of entries is only known at the end, so the size line is
+// written padded with blanks and filled in last.
+template <typename AccumType = double, typename ValueType>
+inline void writeChainMatrixMarket(const std::string &filename, const std::vector<const CsrMatrixT<ValueType> *> &chain,
+                                   const ChainPlan &plan, const std::string &comment = "")
+{
+    std::ofstream outfile(filename, std::ios::binary);
+    if (!outfile.is_open())
+    {
+        std::cerr << "Error: Unable to open file " << filename << std::endl;
+        exit(1);
+    }
+
+    outfile << "%%MatrixMarket matrix coordinate real general\n";
+    if (!comment.empty())
+    {
+        outfile << "% " << comment << "\n";
+    }
+    const std::streampos sizeLine = outfile.tellp();
+    outfile << std::string(MATRIX_MARKET_MAX_LINE, ' ') << "\n";
+
+    size_t entries = 0;
+    forEachChainBlock<AccumType>(chain, plan, [&](const CsrMatrixT<ValueType> &block, int firstRow)
+    {
+        entries += writeMatrixMarketRows(outfile, block, firstRow);
+    });
+
+    outfile.seekp(sizeLine);
+    outfile << chain.front()->rows << " " << chain.back()->cols << " " << entries;
+    outfile.close();
+    if (outfile.fail())
+    {
+        std::cerr << "Error: Unable to write file " << filename << std::endl;
+        exit(1);
+    }
+}
+
+// Compressed-row copies of the factors of a chain of matrix grids, and the chain of pointers to them that the entry
+// points above take. A grid that appears more than once with the same dimensions, e.g. P in P*S*P, is read once and
+// shared, so repeated sub-chains are still recognised and computed once.
+template <typename ValueType>
+struct GridChainT
+{
+    std::vector<std::unique_ptr<CsrMatrixT<ValueType>>> factors;
+    std::vector<const CsrMatrixT<ValueType> *> chain;
+};
+
+// Function to read a chain of matrix grids into compressed rows, every distinct factor once with gridToCsr.
+// The t-th factor is dims[t].first x dims[t].second, and the columns of each factor must match the rows of the next.
+template <typename Layout = SliceLayout, typename GridType>
+inline GridChainT<typename GridType::ValueType> readGridChain(const std::vector<openvdb::SharedPtr<const GridType>> &grids,
+                                                              const std::vector<std::pair<int, int>> &dims)
+{
+    using ValueType = typename GridType::ValueType;
+
+    if (grids.empty() || grids.size() != dims.size())
+    {
+        OPENVDB_THROW(openvdb::ValueError, "a chain of " << grids.size() << " grids needs as many dimensions, not "
+                                                         << dims.size());
+    }
+    for (size_t t = 0; t + 1 < dims.size(); ++t)
+    {
+        if (dims[t].second != dims[t + 1].first)
+        {
+            OPENVDB_THROW(openvdb::ValueError, "cannot multiply a " << dims[t].first << "x" << dims[t].second << " factor by a "
+                                                                    << dims[t + 1].first << "x" << dims[t + 1].second << " one");
+        }
+    }
+
+    GridChainT<ValueType> chain;
+    std::map<std::tuple<const GridType *, int, int>, const CsrMatrixT<ValueType> *> read;
+    for (size_t t = 0; t < grids.size(); ++t)
+    {
+        const std::tuple<const GridType *, int, int> key(grids[t].get(), dims[t].first, dims[t].second);
+        auto found = read.find(key);
+        if (found == read.end())
+        {
+            chain.factors.push_back(std::make_unique<CsrMatrixT<ValueType>>(
+                gridToCsr<Layout>(*grids[t], dims[t].first, dims[t].second)));
+            found = read.emplace(key, chain.factors.back().get()).first;
+        }
+        chain.chain.push_back(found->second);
+    }
+    return chain;
+}
+
+// Function to plan a chain of matrix grids, each factor read into compressed rows once; see readGridChain
+template <typename Layout = SliceLayout, typename GridType>
+inline ChainPlan planMatrixChain(const std::vector<openvdb::SharedPtr<const GridType>> &grids,
+                                 const std::vector<std::pair<int, int>> &dims)
+{
+    return planMatrixChain(readGridChain<Layout>(grids, dims).chain);
+}
+
+// Function to calculate the trace of a chain of matrix grids in its cheapest order; each factor is read once
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline AccumType traceOfChain(const std::vector<openvdb::SharedPtr<const GridType>> &grids,
+                              const std::vector<std::pair<int, int>> &dims)
+{
+    GridChainT<typename GridType::ValueType> chain = readGridChain<Layout>(grids, dims);
+    return traceOfChain<AccumType>(chain.chain, planMatrixChain(chain.chain));
+}
+
+// Function to compare a chain of matrix grids with scale * R in its cheapest order; each factor is read once and R,
+// the size of the product, once more
+template <typename Layout = SliceLayout, typename GridType>
+inline MatrixDifference compareChain(const std::vector<openvdb::SharedPtr<const GridType>> &grids,
+                                     const std::vector<std::pair<int, int>> &dims, const GridType &R, double scale)
+{
+    GridChainT<typename GridType::ValueType> chain = readGridChain<Layout>(grids, dims);
+    return compareChain(chain.chain, planMatrixChain(chain.chain),
+                        gridToCsr<Layout>(R, dims.front().first, dims.back().second), scale);
+}
+
+// Function to write a chain of matrix grids to a .mtx file in its cheapest order; each factor is read once
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline void writeChainMatrixMarket(const std::string &filename, const std::vector<openvdb::SharedPtr<const GridType>> &grids,
+                                   const std::vector<std::pair<int, int>> &dims, const std::string &comment = "")
+{
+    GridChainT<typename GridType::ValueType> chain = readGridChain<Layout>(grids, dims);
+    writeChainMatrixMarket<AccumType>(filename, chain.chain, planMatrixChain(chain.chain), comment);
+}
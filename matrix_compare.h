@@ -0,0 +1,159 @@
+#pragma once
+
+#include "csr_matrix.h"
+#include "sparse_multiply.h"
+
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_reduce.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Entry-wise difference X - Y between two matrices, accumulated over any number of entries
+struct MatrixDifference
+{
+    double sumSquares = 0.0;
+    double maxAbs = 0.0;
+    int maxRow = -1;
+    int maxCol = -1;
+
+    double frobenius() const { return std::sqrt(sumSquares); }
+
+    void add(int i, int j, double difference)
+    {
+        sumSquares += difference * difference;
+        if (std::abs(difference) > maxAbs)
+        {
+            maxAbs = std::abs(difference);
+            maxRow = i;
+            maxCol = j;
+        }
+    }
+
+    // Ties keep this side's entry, so joining partial results left to right reports the first largest error
+    void merge(const MatrixDifference &other)
+    {
+        sumSquares += other.sumSquares;
+        if (other.maxAbs > maxAbs)
+        {
+            maxAbs = other.maxAbs;
+            maxRow = other.maxRow;
+            maxCol = other.maxCol;
+        }
+    }
+};
+
+// Function to add the differences between one row held in a sparse accumulator (times xScale) and row i of Y
+// (times yScale). Both column lists are sorted, so they are merged in a single pass.
+template <typename ValueType>
+inline void addRowDifference(const SparseAccumulator &spa, double xScale, const CsrMatrixT<ValueType> &Y, int i,
+                             double yScale, MatrixDifference &difference)
+{
+    size_t p = 0;
+    size_t q = i < Y.rows ? Y.rowStart[i] : 0;
+    size_t qEnd = i < Y.rows ? Y.rowStart[i + 1] : 0;
+    while (p < spa.touched.size() || q < qEnd)
+    {
+        int jx = p < spa.touched.size() ? spa.touched[p] : std::numeric_limits<int>::max();
+        int jy = q < qEnd ? Y.colIndex[q] : std::numeric_limits<int>::max();
+        if (jx < jy)
+        {
+            difference.add(i, jx, xScale * spa.values[jx]);
+            ++p;
+        }
+        else if (jy < jx)
+        {
+            difference.add(i, jy, -yScale * Y.values[q]);
+            ++q;
+        }
+        else
+        {
+            difference.add(i, jx, xScale * spa.values[jx] - yScale * Y.values[q]);
+            ++p;
+            ++q;
+        }
+    }
+}
+
+// Function to compare A*B with scale*R, e.g. PS*P with 2P, without storing the product.
+// Each row of A*B is accumulated in a per-thread sparse accumulator and merged with the same row of R, so the
+// Frobenius norm and the largest entry of A*B - scale*R come out of a single streaming pass over the rows.
+// The comparison is always carried out in double precision, whatever the storage type of the matrices.
+template <typename ValueType>
+inline MatrixDifference compareProduct(const CsrMatrixT<ValueType> &A, const CsrMatrixT<ValueType> &B,
+                                       const CsrMatrixT<ValueType> &R, double scale)
+{
+    const int rows = std::max(A.rows, R.rows);
+
+    tbb::enumerable_thread_specific<SparseAccumulator> accumulators([&]
+    {
+        return SparseAccumulator(std::max(B.cols, R.cols));
+    });
+
+    return tbb::parallel_deterministic_reduce(
+        tbb::blocked_range<int>(0, rows, 256), MatrixDifference(),
+        [&](const tbb::blocked_range<int> &range, MatrixDifference difference)
+        {
+            SparseAccumulator &spa = accumulators.local();
+            for (int i = range.begin(); i != range.end(); ++i)
+            {
+                if (i < A.rows)
+                {
+                    accumulateRow(A, B, i, 0.0, spa);
+                }
+                else
+                {
+                    spa.touched.clear();
+                }
+                addRowDifference(spa, 1.0, R, i, scale, difference);
+            }
+            return difference;
+        },
+        [](MatrixDifference a, const MatrixDifference &b)
+        {
+            a.merge(b);
+            return a;
+        });
+}
+
+// Function to compare the product of two submatrix views with scale times a third, e.g. on one block of a loaded
+// production matrix without re-reading its file. Only the leaves overlapping the three windows are read; entries are
+// reported relative to the windows.
+template <typename Layout = SliceLayout, typename GridType>
+inline MatrixDifference compareProduct(const MatrixViewT<GridType> &A, const MatrixViewT<GridType> &B,
+                                       const MatrixViewT<GridType> &R, double scale)
+{
+    if (A.cols != B.rows || R.rows != A.rows || R.cols != B.cols)
+    {
+        OPENVDB_THROW(openvdb::ValueError, "cannot compare a " << A.rows << "x" << A.cols << " times " << B.rows << "x"
+                                                               << B.cols << " product with a " << R.rows << "x" << R.cols
+                                                               << " view");
+    }
+    return compareProduct(viewToCsr<Layout>(A), viewToCsr<Layout>(B), viewToCsr<Layout>(R), scale);
+}
+
+// Function to compare two compressed-row matrices entry by entry, X with scale*Y, e.g. DSD with D to measure how far
+// D is from idempotent. Rows are merged in parallel and reduced with a fixed split, as in compareProduct.
+template <typename ValueType>
+inline MatrixDifference compareCsr(const CsrMatrixT<ValueType> &X, const CsrMatrixT<ValueType> &Y, double scale = 1.0)
+{
+    return tbb::parallel_deterministic_reduce(
+        tbb::blocked_range<int>(0, std::max(X.rows, Y.rows), 256), MatrixDifference(),
+        [&](const tbb::blocked_range<int> &range, MatrixDifference difference)
+        {
+            for (int i = range.begin(); i != range.end(); ++i)
+            {
+                forEachMergedEntry(X, Y, i, [&](int j, ValueType x, ValueType y)
+                {
+                    difference.add(i, j, static_cast<double>(x) - scale * static_cast<double>(y));
+                });
+            }
+            return difference;
+        },
+        [](MatrixDifference a, const MatrixDifference &b)
+        {
+            a.merge(b);
+            return a;
+        });
+}
@@ -0,0 +1,270 @@
+#pragma once
+
+#include "grid_builder.h"
+#include "matrix_layout.h"
+
+#include <openvdb/openvdb.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Counter-based random number generator: the n-th draw of a stream is a hash of (seed, stream, n), so every row of a
+// matrix can be generated on any thread, in any order, and still come out the same
+class CounterRng
+{
+public:
+    CounterRng(uint64_t seed, uint64_t stream) : mKey(mix(seed ^ mix(stream + 0x9E3779B97F4A7C15ull))) {}
+
+    uint64_t next() { return mix(mKey + (++mCounter) * 0x9E3779B97F4A7C15ull); }
+
+    // Uniform in [0, 1)
+    double uniform() { return static_cast<double>(next() >> 11) * 0x1.0p-53; }
+
+    // Uniform in [low, high)
+    double uniform(double low, double high) { return low + (high - low) * uniform(); }
+
+    // Uniform in [low, high]
+    int uniformInt(int low, int high)
+    {
+        uint64_t range = static_cast<uint64_t>(high - low) + 1;
+        return low + static_cast<int>((static_cast<unsigned __int128>(next()) * range) >> 64);
+    }
+
+private:
+    // SplitMix64 finalizer
+    static uint64_t mix(uint64_t x)
+    {
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+
+    uint64_t mKey;
+    uint64_t mCounter = 0;
+};
+
+// Where the off-diagonal entries of a row may fall
+enum class SparsityPattern
+{
+    Uniform,       // anywhere in the row
+    Banded,        // within bandwidth of the diagonal
+    BlockDiagonal, // inside the diagonal block of blockSize rows that holds the row
+    PowerLaw       // anywhere, with row lengths following P(d) ~ d^-powerLawExponent
+};
+
+// Function to look up a sparsity pattern by its name ("uniform", "banded", "block_diagonal" or "power_law")
+inline bool sparsityPatternFromName(const std::string &name, SparsityPattern &pattern)
+{
+    if (name == "uniform")
+    {
+        pattern = SparsityPattern::Uniform;
+    }
+    else if (name == "banded")
+    {
+        pattern = SparsityPattern::Banded;
+    }
+    else if (name == "block_diagonal")
+    {
+        pattern = SparsityPattern::BlockDiagonal;
+    }
+    else if (name == "power_law")
+    {
+        pattern = SparsityPattern::PowerLaw;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// Shape and values of a generated matrix. The defaults give the test matrices of multiply_trace.cpp: a diagonal in
+// [0, 1) and 9 off-diagonal entries per row in [-0.02, 0.02).
+struct MatrixGeneratorOptions
+{
+    SparsityPattern pattern = SparsityPattern::Uniform;
+    int nnzPerRow = 10;             // average entries per row, diagonal included
+    int bandwidth = 64;             // Banded
+    int blockSize = 512;            // BlockDiagonal
+    double powerLawExponent = 2.5;  // PowerLaw
+    bool symmetric = false;         // mirror the upper triangle into the lower one
+    bool diagonallyDominant = false; // add the absolute row sum of the off-diagonal entries to the diagonal
+    double diagonalMin = 0.0;
+    double diagonalMax = 1.0;
+    double offDiagonalMax = 0.02;   // off-diagonal values are uniform in [-offDiagonalMax, offDiagonalMax)
+    uint64_t seed = 1;
+};
+
+// Function to draw the off-diagonal columns of row i of an n x n matrix into columns, in ascending order.
+// Symmetric matrices only draw the part right of the diagonal, about half a row, and get the rest by mirroring.
+inline void generateRowColumns(const MatrixGeneratorOptions &options, int n, int i, CounterRng &rng,
+                               std::vector<int> &columns)
+{
+    columns.clear();
+
+    // Columns the pattern allows, as [first, last]
+    int first = 0, last = n - 1;
+    if (options.pattern == SparsityPattern::Banded)
+    {
+        first = std::max(0, i - options.bandwidth);
+        last = std::min(n - 1, i + options.bandwidth);
+    }
+    else if (options.pattern == SparsityPattern::BlockDiagonal)
+    {
+        int blockSize = std::max(1, options.blockSize);
+        first = i / blockSize * blockSize;
+        last = std::min(n - 1, first + blockSize - 1);
+    }
+    if (options.symmetric)
+    {
+        first = i + 1;
+    }
+
+    // Number of off-diagonal entries of the row
+    double length = options.nnzPerRow;
+    if (options.pattern == SparsityPattern::PowerLaw)
+    {
+        // Pareto distribution scaled so that its mean is nnzPerRow when the exponent is above 2
+        double alpha = std::max(options.powerLawExponent, 1.01);
+        double minimum = alpha > 2.0 ? options.nnzPerRow * (alpha - 2.0) / (alpha - 1.0) : 1.0;
+        length = std::min(static_cast<double>(n), minimum * std::pow(1.0 - rng.uniform(), -1.0 / (alpha - 1.0)));
+    }
+    double offDiagonal = std::max(0.0, length - 1.0) * (options.symmetric ? 0.5 : 1.0);
+    int count = static_cast<int>(offDiagonal + rng.uniform()); // random rounding keeps the mean exact
+
+    int available = last - first + 1 - (i >= first && i <= last ? 1 : 0);
+    count = std::min(count, std::max(0, available));
+    if (count == 0)
+    {
+        return;
+    }
+
+    // Dense rows: partially shuffle the whole allowed range instead of rejecting repeats
+    if (2 * count > available)
+    {
+        for (int j = first; j <= last; ++j)
+        {
+            if (j != i)
+            {
+                columns.push_back(j);
+            }
+        }
+        for (int k = 0; k < count; ++k)
+        {
+            std::swap(columns[k], columns[rng.uniformInt(k, available - 1)]);
+        }
+        columns.resize(count);
+        std::sort(columns.begin(), columns.end());
+        return;
+    }
+
+    // Draw, sort and deduplicate until the row holds count distinct columns
+    while (static_cast<int>(columns.size()) < count)
+    {
+        for (int k = static_cast<int>(columns.size()); k < count; ++k)
+        {
+            int j = rng.uniformInt(first, last);
+            if (j != i)
+            {
+                columns.push_back(j);
+            }
+        }
+        std::sort(columns.begin(), columns.end());
+        columns.erase(std::unique(columns.begin(), columns.end()), columns.end());
+    }
+}
+
+// Function to generate an n x n sparse matrix as 0-based (row, col, value) triplets.
+// Every row draws from its own counter-based stream, so blocks of rows are generated in parallel and the result only
+// depends on the options, never on the thread count. Each block writes into its own buffer; the buffers are then
+// copied into place.
+inline std::vector<std::tuple<int, int, double>> generateMatrixTriplets(int n, const MatrixGeneratorOptions &options)
+{
+    using Triplet = std::tuple<int, int, double>;
+    const int blockRows = 1024;
+    const int numBlocks = (n + blockRows - 1) / blockRows;
+
+    // Off-diagonal entries first; diagonals are drawn once the row sums are known
+    std::vector<std::vector<Triplet>> blockEntries(numBlocks);
+    tbb::parallel_for(tbb::blocked_range<int>(0, numBlocks), [&](const tbb::blocked_range<int> &range)
+    {
+        std::vector<int> columns;
+        for (int b = range.begin(); b != range.end(); ++b)
+        {
+            std::vector<Triplet> &entries = blockEntries[b];
+            entries.reserve(static_cast<size_t>(blockRows) * std::max(0, options.nnzPerRow - 1));
+            for (int i = b * blockRows; i < std::min(n, (b + 1) * blockRows); ++i)
+            {
+                CounterRng rng(options.seed, static_cast<uint64_t>(i));
+                generateRowColumns(options, n, i, rng, columns);
+                for (int j : columns)
+                {
+                    entries.emplace_back(i, j, rng.uniform(-options.offDiagonalMax, options.offDiagonalMax));
+                }
+            }
+        }
+    });
+
+    std::vector<size_t> blockOffset(numBlocks + 1, 0);
+    for (int b = 0; b < numBlocks; ++b)
+    {
+        blockOffset[b + 1] = blockOffset[b] + blockEntries[b].size();
+    }
+    const size_t numOffDiagonal = blockOffset[numBlocks];
+    const size_t numMirrored = options.symmetric ? numOffDiagonal : 0;
+
+    std::vector<Triplet> triplets(numOffDiagonal + numMirrored + n);
+    tbb::parallel_for(0, numBlocks, [&](int b)
+    {
+        std::copy(blockEntries[b].begin(), blockEntries[b].end(), triplets.begin() + blockOffset[b]);
+        if (options.symmetric)
+        {
+            for (size_t e = 0; e < blockEntries[b].size(); ++e)
+            {
+                const auto &[i, j, value] = blockEntries[b][e];
+                triplets[numOffDiagonal + blockOffset[b] + e] = Triplet(j, i, value);
+            }
+        }
+        std::vector<Triplet>().swap(blockEntries[b]);
+    });
+
+    // Absolute off-diagonal row sums; mirrored entries land in other rows, so this pass is serial
+    std::vector<double> rowSum;
+    if (options.diagonallyDominant)
+    {
+        rowSum.assign(n, 0.0);
+        for (size_t e = 0; e < numOffDiagonal + numMirrored; ++e)
+        {
+            rowSum[std::get<0>(triplets[e])] += std::abs(std::get<2>(triplets[e]));
+        }
+    }
+
+    // The diagonal uses a stream of its own, so it does not depend on how many columns a row drew
+    tbb::parallel_for(tbb::blocked_range<int>(0, n), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int i = range.begin(); i != range.end(); ++i)
+        {
+            CounterRng rng(options.seed, (uint64_t(1) << 63) | static_cast<uint64_t>(i));
+            double value = rng.uniform(options.diagonalMin, options.diagonalMax);
+            if (options.diagonallyDominant)
+            {
+                value = std::copysign(rowSum[i] + std::abs(value), value == 0.0 ? 1.0 : value);
+            }
+            triplets[numOffDiagonal + numMirrored + i] = Triplet(i, i, value);
+        }
+    });
+
+    return triplets;
+}
+
+// Function to generate an n x n sparse matrix straight into a grid, filled a leaf at a time
+template <typename Layout = SliceLayout, typename GridType = openvdb::FloatGrid>
+inline typename GridType::Ptr generateMatrixGrid(int n, const MatrixGeneratorOptions &options)
+{
+    return buildGridFromTriplets<Layout, GridType>(generateMatrixTriplets(n, options));
+}
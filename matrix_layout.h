@@ -0,0 +1,123 @@
+#pragma once
+
+#include <openvdb/openvdb.h>
+#include <string>
+
+// Mappings from matrix entry (i, j) to a grid voxel. Every kernel takes one as a template parameter.
+// Each layout keeps the rows of a leaf a function of its x origin alone, and orders the columns of a row by (y, z),
+// so leaves sharing an x origin form a block of whole rows that can be read in column order.
+
+// Original layout: (i, j, 0). A leaf holds an 8x8 tile in its z = 0 slice and leaves 7/8 of its voxels unused.
+struct SliceLayout
+{
+    static const int TILE_ROWS = 8;
+    static const int TILE_COLS = 8;
+
+    static const char *name() { return "slice"; }
+
+    static openvdb::Coord toCoord(int i, int j) { return openvdb::Coord(i, j, 0); }
+
+    // Returns false for voxels that do not hold a matrix entry in this layout
+    static bool toIndex(const openvdb::Coord &xyz, int &i, int &j)
+    {
+        i = xyz.x();
+        j = xyz.y();
+        return xyz.z() == 0;
+    }
+
+    // Upper bounds on the rows and columns held by an active bounding box
+    static void extent(const openvdb::CoordBBox &bbox, int &rows, int &cols)
+    {
+        rows = bbox.max().x() + 1;
+        cols = bbox.max().y() + 1;
+    }
+};
+
+// Column index folded into z: (i, j / 8, j % 8). A leaf holds a dense 8x64 tile.
+struct ColumnFoldLayout
+{
+    static const int TILE_ROWS = 8;
+    static const int TILE_COLS = 64;
+
+    static const char *name() { return "column_fold"; }
+
+    static openvdb::Coord toCoord(int i, int j) { return openvdb::Coord(i, j >> 3, j & 7); }
+
+    static bool toIndex(const openvdb::Coord &xyz, int &i, int &j)
+    {
+        i = xyz.x();
+        j = (xyz.y() << 3) | xyz.z();
+        return (xyz.z() & ~7) == 0;
+    }
+
+    static void extent(const openvdb::CoordBBox &bbox, int &rows, int &cols)
+    {
+        rows = bbox.max().x() + 1;
+        cols = (bbox.max().y() + 1) * 8;
+    }
+};
+
+// Low bits of both indices folded into z: (i / 2, j / 4, 4 * (i % 2) + j % 4). A leaf holds a dense 16x32 tile.
+struct TileFoldLayout
+{
+    static const int TILE_ROWS = 16;
+    static const int TILE_COLS = 32;
+
+    static const char *name() { return "tile_fold"; }
+
+    static openvdb::Coord toCoord(int i, int j) { return openvdb::Coord(i >> 1, j >> 2, ((i & 1) << 2) | (j & 3)); }
+
+    static bool toIndex(const openvdb::Coord &xyz, int &i, int &j)
+    {
+        i = (xyz.x() << 1) | (xyz.z() >> 2);
+        j = (xyz.y() << 2) | (xyz.z() & 3);
+        return (xyz.z() & ~7) == 0;
+    }
+
+    static void extent(const openvdb::CoordBBox &bbox, int &rows, int &cols)
+    {
+        rows = (bbox.max().x() + 1) * 2;
+        cols = (bbox.max().y() + 1) * 4;
+    }
+};
+
+// Function to record in a grid's metadata which layout its entries were written in
+template <typename Layout>
+inline void setMatrixLayout(openvdb::GridBase &grid)
+{
+    grid.insertMeta("matrix_layout", openvdb::StringMetadata(Layout::name()));
+}
+
+// Function to check that a grid was written in the given layout; grids without a layout tag are taken as they are
+template <typename Layout>
+inline void checkMatrixLayout(const openvdb::GridBase &grid)
+{
+    openvdb::StringMetadata::ConstPtr layout = grid.getMetadata<openvdb::StringMetadata>("matrix_layout");
+    if (layout && layout->value() != Layout::name())
+    {
+        OPENVDB_THROW(openvdb::ValueError, "matrix grid is stored in the " << layout->value() << " layout, not "
+                                                                             << Layout::name());
+    }
+}
+
+// Function to return the metadata name of the symmetric tag. The name is too long to be stored inside a string, so it
+// is built once rather than on every lookup, which keeps checking the tag free of heap allocations.
+inline const openvdb::Name &matrixSymmetricKey()
+{
+    static const openvdb::Name key("matrix_symmetric");
+    return key;
+}
+
+// Function to mark a matrix grid as symmetric. A symmetric grid holds only the lower triangle (i >= j) of its matrix;
+// gridToCsr and the kernels mirror the stored entries to the upper triangle as they read them.
+inline void setMatrixSymmetric(openvdb::GridBase &grid, bool symmetric = true)
+{
+    grid.insertMeta(matrixSymmetricKey(), openvdb::BoolMetadata(symmetric));
+}
+
+// Function to check whether a grid holds a symmetric matrix in lower-triangle form; untagged grids are general
+inline bool isMatrixSymmetric(const openvdb::GridBase &grid)
+{
+    openvdb::BoolMetadata::ConstPtr symmetric = grid.getMetadata<openvdb::BoolMetadata>(matrixSymmetricKey());
+    return symmetric && symmetric->value();
+}
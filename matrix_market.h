@@ -0,0 +1,359 @@
+#pragma once
+
+#include "grid_builder.h"
+
+#include <openvdb/openvdb.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &filename)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            std::cerr << "Error: Unable to open file " << filename << std::endl;
+            exit(1);
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            mSize = static_cast<size_t>(info.st_size);
+            void *data = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                std::cerr << "Error: Unable to map file " << filename << std::endl;
+                exit(1);
+            }
+            madvise(data, mSize, MADV_SEQUENTIAL);
+            mData = static_cast<const char *>(data);
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if (mData != nullptr)
+        {
+            munmap(const_cast<char *>(mData), mSize);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *begin() const { return mData; }
+    const char *end() const { return mData + mSize; }
+    size_t size() const { return mSize; }
+
+private:
+    const char *mData = nullptr;
+    size_t mSize = 0;
+};
+
+// Size line of a MatrixMarket coordinate file, plus where the entry lines start
+struct MatrixMarketHeader
+{
+    int rows = 0;
+    int cols = 0;
+    size_t nonZeros = 0;        // entry lines in the file, i.e. one triangle of a symmetric matrix
+    bool symmetric = false;     // "symmetric" banner: the file holds one triangle and the other is implied
+    const char *body = nullptr;
+};
+
+// Function to return the end of the line starting at first (the '\n' or last)
+inline const char *lineEnd(const char *first, const char *last)
+{
+    const void *eol = std::memchr(first, '\n', last - first);
+    return eol != nullptr ? static_cast<const char *>(eol) : last;
+}
+
+// Function to skip spaces, tabs and carriage returns
+inline const char *skipBlanks(const char *first, const char *last)
+{
+    while (first < last && (*first == ' ' || *first == '\t' || *first == '\r'))
+    {
+        ++first;
+    }
+    return first;
+}
+
+// Function to tell whether a line holds data, i.e. it is neither blank nor a '%' comment
+inline bool isDataLine(const char *first, const char *last)
+{
+    first = skipBlanks(first, last);
+    return first < last && *first != '%';
+}
+
+// Function to read the symmetry field of a "%%MatrixMarket matrix coordinate <field> <symmetry>" banner line.
+// Returns true for "symmetric"; the banner is case-insensitive. Skew-symmetric and Hermitian files are not supported.
+inline bool parseMatrixMarketBanner(const char *first, const char *last, const std::string &filename)
+{
+    std::string banner(first, last);
+    std::transform(banner.begin(), banner.end(), banner.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (banner.find("skew-symmetric") != std::string::npos || banner.find("hermitian") != std::string::npos)
+    {
+        std::cerr << "Error: Unsupported MatrixMarket symmetry in " << filename << ": " << std::string(first, last)
+                  << std::endl;
+        exit(1);
+    }
+    return banner.find("symmetric") != std::string::npos;
+}
+
+// Function to parse the banner, comments and size line of a mapped .mtx file
+inline MatrixMarketHeader parseMatrixMarketHeader(const MappedFile &file, const std::string &filename)
+{
+    MatrixMarketHeader header;
+    const char *last = file.end();
+
+    for (const char *line = file.begin(); line < last;)
+    {
+        const char *eol = lineEnd(line, last);
+        if (line == file.begin() && eol - line >= 14 && std::memcmp(line, "%%MatrixMarket", 14) == 0)
+        {
+            header.symmetric = parseMatrixMarketBanner(line, eol, filename);
+        }
+        if (isDataLine(line, eol))
+        {
+            // Read the matrix size from the header (rows, cols, non-zeros)
+            const char *p = skipBlanks(line, eol);
+            auto [p1, e1] = std::from_chars(p, eol, header.rows);
+            auto [p2, e2] = std::from_chars(skipBlanks(p1, eol), eol, header.cols);
+            auto [p3, e3] = std::from_chars(skipBlanks(p2, eol), eol, header.nonZeros);
+            if (e1 != std::errc() || e2 != std::errc() || e3 != std::errc())
+            {
+                std::cerr << "Error: Malformed size line in " << filename << std::endl;
+                exit(1);
+            }
+            header.body = std::min(eol + 1, last);
+            return header;
+        }
+        line = eol + 1;
+    }
+
+    std::cerr << "Error: No size line in " << filename << std::endl;
+    exit(1);
+}
+
+// Function to parse one "row col [value]" entry line of a rows x cols matrix into 0-based indices; pattern entries get
+// the value 1. Returns false for a malformed line: an index outside 1..rows or 1..cols, or anything but blanks after
+// the value.
+inline bool parseEntryLine(const char *first, const char *last, int rows, int cols, int &row, int &col, double &value)
+{
+    const char *p = skipBlanks(first, last);
+    auto [p1, e1] = std::from_chars(p, last, row);
+    auto [p2, e2] = std::from_chars(skipBlanks(p1, last), last, col);
+    if (e1 != std::errc() || e2 != std::errc() || row < 1 || row > rows || col < 1 || col > cols)
+    {
+        return false;
+    }
+
+    value = 1.0;
+    p = skipBlanks(p2, last);
+    if (p < last && *p == '+')
+    {
+        ++p; // from_chars does not accept an explicit plus sign
+    }
+    if (p < last)
+    {
+        auto [p3, e3] = std::from_chars(p, last, value);
+        if (e3 != std::errc() || skipBlanks(p3, last) != last)
+        {
+            return false;
+        }
+    }
+
+    // MatrixMarket is 1-based, convert to 0-based
+    --row;
+    --col;
+    return true;
+}
+
+// Function to split the text [first, last) into chunks of about chunkBytes that each start right after a newline.
+// Returns the chunk starts followed by last.
+inline std::vector<const char *> splitLineChunks(const char *first, const char *last, size_t chunkBytes = size_t(4) << 20)
+{
+    std::vector<const char *> chunkStart(1, first);
+    while (last - chunkStart.back() > static_cast<std::ptrdiff_t>(chunkBytes))
+    {
+        chunkStart.push_back(lineEnd(chunkStart.back() + chunkBytes, last) + 1);
+    }
+    if (chunkStart.back() > last)
+    {
+        chunkStart.back() = last;
+    }
+    chunkStart.push_back(last);
+    return chunkStart;
+}
+
+// Function to parse the entry lines of the text [first, last) of a rows x cols matrix, which must start at a line, into
+// 0-based triplets.
+// The text is split into newline-aligned chunks. A first parallel pass counts the entry lines of every chunk, which
+// sizes the output up front, and a second parallel pass parses each chunk straight into its slice of the output with
+// std::from_chars. A malformed entry line is reported with its text and ends the program.
+inline std::vector<std::tuple<int, int, double>> parseEntryLines(const char *first, const char *last, int rows, int cols,
+                                                                 const std::string &filename)
+{
+    std::vector<const char *> chunkStart = splitLineChunks(first, last);
+    const size_t numChunks = chunkStart.size() - 1;
+
+    // First pass: count the entry lines of every chunk
+    std::vector<size_t> chunkOffset(numChunks + 1, 0);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numChunks, 1), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t c = range.begin(); c != range.end(); ++c)
+        {
+            size_t count = 0;
+            for (const char *line = chunkStart[c]; line < chunkStart[c + 1];)
+            {
+                const char *eol = lineEnd(line, chunkStart[c + 1]);
+                count += isDataLine(line, eol);
+                line = eol + 1;
+            }
+            chunkOffset[c + 1] = count;
+        }
+    });
+    for (size_t c = 0; c < numChunks; ++c)
+    {
+        chunkOffset[c + 1] += chunkOffset[c];
+    }
+
+    // Second pass: parse every chunk into its own slice of the output
+    std::vector<std::tuple<int, int, double>> matrixData(chunkOffset[numChunks]);
+    std::atomic<bool> malformed(false);
+    const char *malformedLine = nullptr, *malformedEnd = nullptr; // set by the first task to find one
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numChunks, 1), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t c = range.begin(); c != range.end(); ++c)
+        {
+            size_t n = chunkOffset[c];
+            for (const char *line = chunkStart[c]; line < chunkStart[c + 1];)
+            {
+                const char *eol = lineEnd(line, chunkStart[c + 1]);
+                if (isDataLine(line, eol))
+                {
+                    int row = 0, col = 0;
+                    double value = 0.0;
+                    if (!parseEntryLine(line, eol, rows, cols, row, col, value) && !malformed.exchange(true))
+                    {
+                        malformedLine = line;
+                        malformedEnd = eol;
+                    }
+                    matrixData[n++] = std::make_tuple(row, col, value);
+                }
+                line = eol + 1;
+            }
+        }
+    });
+
+    if (malformed)
+    {
+        std::cerr << "Error: Malformed entry line in " << filename << ": " << std::string(malformedLine, malformedEnd)
+                  << std::endl;
+        exit(1);
+    }
+
+    return matrixData;
+}
+
+// Function to read the entries stored in a .mtx file as 0-based triplets (row, col, value), without expanding a
+// symmetric file; symmetric is set from the banner. The file is memory-mapped and its entry lines are parsed in
+// parallel by parseEntryLines; their number must match the nonzero count of the header. The entries of a symmetric
+// file are all returned in the lower triangle (row >= col), whichever triangle the file holds.
+inline std::vector<std::tuple<int, int, double>> readStoredMatrixTriplets(const std::string &filename, int &rows, int &cols,
+                                                                          bool &symmetric)
+{
+    MappedFile file(filename);
+    MatrixMarketHeader header = parseMatrixMarketHeader(file, filename);
+    rows = header.rows;
+    cols = header.cols;
+    symmetric = header.symmetric;
+
+    std::vector<std::tuple<int, int, double>> matrixData =
+        parseEntryLines(header.body, file.end(), header.rows, header.cols, filename);
+    if (matrixData.size() != header.nonZeros)
+    {
+        std::cerr << "Error: " << filename << " declares " << header.nonZeros << " entries but holds " << matrixData.size()
+                  << std::endl;
+        exit(1);
+    }
+
+    if (symmetric)
+    {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, matrixData.size()), [&](const tbb::blocked_range<size_t> &range)
+        {
+            for (size_t n = range.begin(); n != range.end(); ++n)
+            {
+                auto &[row, col, value] = matrixData[n];
+                if (col > row)
+                {
+                    std::swap(row, col);
+                }
+            }
+        });
+    }
+
+    return matrixData;
+}
+
+// Function to append the mirror (col, row) of every off-diagonal triplet, turning one triangle into the whole matrix
+inline void expandSymmetricTriplets(std::vector<std::tuple<int, int, double>> &matrixData)
+{
+    const size_t stored = matrixData.size();
+    for (size_t n = 0; n < stored; ++n)
+    {
+        const auto [row, col, value] = matrixData[n];
+        if (row != col)
+        {
+            matrixData.emplace_back(col, row, value);
+        }
+    }
+}
+
+// Function to read a matrix from a .mtx file and return it as a vector of 0-based triplets (row, col, value).
+// A symmetric file is expanded to both triangles, so the triplets always describe the whole matrix.
+inline std::vector<std::tuple<int, int, double>> readMatrixTriplets(const std::string &filename, int &rows, int &cols)
+{
+    bool symmetric = false;
+    std::vector<std::tuple<int, int, double>> matrixData = readStoredMatrixTriplets(filename, rows, cols, symmetric);
+    if (symmetric)
+    {
+        expandSymmetricTriplets(matrixData);
+    }
+    return matrixData;
+}
+
+// Function to read a matrix from a .mtx file and store it in an OpenVDB grid.
+// Values smaller in magnitude than threshold are treated as zero and left out. A symmetric file gives a symmetric grid
+// that keeps only the lower triangle (see setMatrixSymmetric), half the memory of the expanded matrix.
+template <typename Layout = SliceLayout, typename GridType = openvdb::FloatGrid>
+inline typename GridType::Ptr readMatrixGrid(const std::string &filename, int &rows, int &cols, double threshold = 0.0)
+{
+    bool symmetric = false;
+    typename GridType::Ptr grid =
+        buildGridFromTriplets<Layout, GridType>(readStoredMatrixTriplets(filename, rows, cols, symmetric), threshold);
+    if (symmetric)
+    {
+        setMatrixSymmetric(*grid);
+    }
+    return grid;
+}
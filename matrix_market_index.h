@@ -0,0 +1,381 @@
+#pragma once
+
+#include "matrix_cache.h"
+#include "matrix_market.h"
+#include "matrix_market_writer.h"
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Byte offsets of the row blocks of a .mtx file whose entry lines are sorted by row, kept in a small sidecar file
+// next to it (P.mtx -> P.mtx.idx). The entries of rows [b * blockRows, (b + 1) * blockRows) lie in the bytes
+// [blockOffset[b], blockOffset[b + 1]) of the file, so any range of rows can be parsed without scanning the rest.
+struct MatrixMarketIndex
+{
+    int64_t sourceSize = 0;  // size and modification time of the indexed file
+    int64_t sourceMtime = 0;
+    int rows = 0;
+    int cols = 0;
+    uint64_t nonZeros = 0;
+    int blockRows = 0;
+    bool sorted = false;               // false when the entry lines are not in row order; the offsets are then unset
+    std::vector<uint64_t> blockOffset; // blocks + 1 offsets, the last one is the end of the file
+
+    int blocks() const { return blockOffset.empty() ? 0 : static_cast<int>(blockOffset.size()) - 1; }
+};
+
+// Function to return the sidecar index path of a .mtx file, e.g. P.mtx -> P.mtx.idx
+inline std::string matrixIndexPath(const std::string &filename)
+{
+    return filename + ".idx";
+}
+
+// Function to scan a .mtx file once, in parallel, and index its row blocks.
+// Only the row number of every entry line is parsed. The lines must be in nondecreasing row order for the offsets to
+// be recorded; otherwise the index only notes that the file is unsorted (see sortMatrixMarketFile).
+inline MatrixMarketIndex buildMatrixMarketIndex(const std::string &filename, int blockRows = 256)
+{
+    MappedFile file(filename);
+    MatrixMarketHeader header = parseMatrixMarketHeader(file, filename);
+
+    MatrixCacheKey key = matrixCacheKey(filename, 0.0, "");
+    MatrixMarketIndex index;
+    index.sourceSize = key.size;
+    index.sourceMtime = key.mtime;
+    index.rows = header.rows;
+    index.cols = header.cols;
+    index.nonZeros = header.nonZeros;
+    index.blockRows = blockRows;
+
+    // What one chunk of lines holds: its first and last row, whether it is sorted, and where each block starts in it
+    struct ChunkRows
+    {
+        int firstRow = -1;
+        int lastRow = -1;
+        bool sorted = true;
+        bool malformed = false;
+        uint64_t entries = 0;
+        std::vector<std::pair<int, uint64_t>> blockStarts; // (block, offset of its first line in this chunk)
+    };
+
+    std::vector<const char *> chunkStart = splitLineChunks(header.body, file.end());
+    const size_t numChunks = chunkStart.size() - 1;
+    std::vector<ChunkRows> chunks(numChunks);
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numChunks, 1), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t c = range.begin(); c != range.end(); ++c)
+        {
+            ChunkRows &chunk = chunks[c];
+            for (const char *line = chunkStart[c]; line < chunkStart[c + 1];)
+            {
+                const char *eol = lineEnd(line, chunkStart[c + 1]);
+                if (isDataLine(line, eol))
+                {
+                    int row = 0;
+                    if (std::from_chars(skipBlanks(line, eol), eol, row).ec != std::errc() || row < 1 || row > header.rows)
+                    {
+                        chunk.malformed = true;
+                        break;
+                    }
+                    --row;
+                    if (row < chunk.lastRow)
+                    {
+                        chunk.sorted = false;
+                    }
+                    if (chunk.lastRow < 0 || row / blockRows != chunk.lastRow / blockRows)
+                    {
+                        chunk.blockStarts.emplace_back(row / blockRows, static_cast<uint64_t>(line - file.begin()));
+                    }
+                    if (chunk.firstRow < 0)
+                    {
+                        chunk.firstRow = row;
+                    }
+                    chunk.lastRow = row;
+                    ++chunk.entries;
+                }
+                line = eol + 1;
+            }
+        }
+    });
+
+    // Join the chunks in file order: the file is sorted if every chunk is and no chunk starts below its predecessor
+    index.sorted = true;
+    uint64_t entries = 0;
+    int lastRow = -1;
+    for (const ChunkRows &chunk : chunks)
+    {
+        if (chunk.malformed)
+        {
+            std::cerr << "Error: Malformed entry line in " << filename << std::endl;
+            exit(1);
+        }
+        if (chunk.entries == 0)
+        {
+            continue;
+        }
+        index.sorted = index.sorted && chunk.sorted && chunk.firstRow >= lastRow;
+        lastRow = chunk.lastRow;
+        entries += chunk.entries;
+    }
+    if (entries != header.nonZeros)
+    {
+        std::cerr << "Error: " << filename << " declares " << header.nonZeros << " entries but holds " << entries << std::endl;
+        exit(1);
+    }
+    if (!index.sorted)
+    {
+        return index;
+    }
+
+    // Block b starts at the first line of any block >= b; blocks without entries are empty ranges
+    const int numBlocks = (header.rows + blockRows - 1) / blockRows;
+    index.blockOffset.assign(numBlocks + 1, file.size());
+    int nextBlock = 0;
+    for (const ChunkRows &chunk : chunks)
+    {
+        for (const auto &[block, offset] : chunk.blockStarts)
+        {
+            while (nextBlock <= block)
+            {
+                index.blockOffset[nextBlock++] = offset;
+            }
+        }
+    }
+    return index;
+}
+
+// Function to write an index to its sidecar file. Failures only cost the next run a rescan, so they are warnings.
+inline void writeMatrixMarketIndex(const std::string &path, const MatrixMarketIndex &index)
+{
+    const char magic[8] = {'M', 'T', 'X', 'I', 'D', 'X', '1', '\0'};
+    uint64_t numOffsets = index.blockOffset.size();
+    int32_t header[4] = {index.rows, index.cols, index.blockRows, index.sorted ? 1 : 0};
+
+    // Write to a temporary file first so a crashed run never leaves a half-written index behind
+    std::string tempPath = path + ".tmp";
+    std::ofstream outfile(tempPath, std::ios::binary);
+    outfile.write(magic, sizeof(magic));
+    outfile.write(reinterpret_cast<const char *>(&index.sourceSize), sizeof(index.sourceSize));
+    outfile.write(reinterpret_cast<const char *>(&index.sourceMtime), sizeof(index.sourceMtime));
+    outfile.write(reinterpret_cast<const char *>(header), sizeof(header));
+    outfile.write(reinterpret_cast<const char *>(&index.nonZeros), sizeof(index.nonZeros));
+    outfile.write(reinterpret_cast<const char *>(&numOffsets), sizeof(numOffsets));
+    outfile.write(reinterpret_cast<const char *>(index.blockOffset.data()), numOffsets * sizeof(uint64_t));
+    outfile.close();
+    if (outfile.fail())
+    {
+        std::remove(tempPath.c_str());
+        std::cerr << "Warning: Unable to write index " << path << std::endl;
+        return;
+    }
+    if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        std::cerr << "Warning: Unable to move " << tempPath << " to " << path << ": " << std::strerror(errno) << std::endl;
+        std::remove(tempPath.c_str());
+    }
+}
+
+// Function to read a sidecar index; returns false if it is missing, damaged or was written for another version of
+// the file
+inline bool readMatrixMarketIndex(const std::string &path, const MatrixCacheKey &key, MatrixMarketIndex &index)
+{
+    std::ifstream infile(path, std::ios::binary);
+    if (!infile.is_open())
+    {
+        return false;
+    }
+
+    char magic[8] = {};
+    int32_t header[4] = {};
+    uint64_t numOffsets = 0;
+    infile.read(magic, sizeof(magic));
+    infile.read(reinterpret_cast<char *>(&index.sourceSize), sizeof(index.sourceSize));
+    infile.read(reinterpret_cast<char *>(&index.sourceMtime), sizeof(index.sourceMtime));
+    infile.read(reinterpret_cast<char *>(header), sizeof(header));
+    infile.read(reinterpret_cast<char *>(&index.nonZeros), sizeof(index.nonZeros));
+    infile.read(reinterpret_cast<char *>(&numOffsets), sizeof(numOffsets));
+    if (!infile || std::string(magic) != "MTXIDX1" || index.sourceSize != key.size || index.sourceMtime != key.mtime ||
+        header[2] <= 0 || numOffsets > static_cast<uint64_t>(key.size) + 2)
+    {
+        return false;
+    }
+    index.rows = header[0];
+    index.cols = header[1];
+    index.blockRows = header[2];
+    index.sorted = header[3] != 0;
+    index.blockOffset.resize(numOffsets);
+    infile.read(reinterpret_cast<char *>(index.blockOffset.data()), numOffsets * sizeof(uint64_t));
+    return static_cast<bool>(infile);
+}
+
+// Function to return the row index of a .mtx file, reusing its sidecar when the file has not changed since it was
+// written and (re)building it otherwise
+inline MatrixMarketIndex loadMatrixMarketIndex(const std::string &filename, int blockRows = 256)
+{
+    if (!std::filesystem::exists(filename))
+    {
+        std::cerr << "Error: Unable to open file " << filename << std::endl;
+        exit(1);
+    }
+
+    MatrixCacheKey key = matrixCacheKey(filename, 0.0, "");
+    std::string indexPath = matrixIndexPath(filename);
+
+    MatrixMarketIndex index;
+    if (readMatrixMarketIndex(indexPath, key, index))
+    {
+        return index;
+    }
+
+    index = buildMatrixMarketIndex(filename, blockRows);
+    writeMatrixMarketIndex(indexPath, index);
+    return index;
+}
+
+// Function to parse the entries stored on the rows [firstRow, lastRow) of a .mtx file through its index, i.e. only the
+// bytes of the row blocks covering the range, so the cost follows the size of the range rather than that of the file
+inline std::vector<std::tuple<int, int, double>> parseIndexedRows(const MappedFile &file, const MatrixMarketIndex &index,
+                                                                  const MatrixMarketHeader &header, int firstRow, int lastRow,
+                                                                  const std::string &filename)
+{
+    const char *first = file.begin() + index.blockOffset[firstRow / index.blockRows];
+    const char *last = file.begin() + index.blockOffset[(lastRow - 1) / index.blockRows + 1];
+    std::vector<std::tuple<int, int, double>> matrixData =
+        parseEntryLines(first, last, header.rows, header.cols, filename);
+
+    // The first and last blocks may hold rows outside the range
+    matrixData.erase(std::remove_if(matrixData.begin(), matrixData.end(), [&](const std::tuple<int, int, double> &entry)
+    {
+        return std::get<0>(entry) < firstRow || std::get<0>(entry) >= lastRow;
+    }), matrixData.end());
+    return matrixData;
+}
+
+// Function to read the submatrix rows [firstRow, lastRow) x cols [firstCol, lastCol) of a .mtx file as 0-based triplets
+// numbered as in the whole matrix. With a sorted index only the stored rows that can hold the window are parsed:
+// its own rows and, for a symmetric file, whose other triangle is implied, also the rows [firstCol, lastCol), which
+// store the mirrors of its entries on the far side of the diagonal. Unsorted files are scanned in full.
+inline std::vector<std::tuple<int, int, double>> readMatrixWindow(const std::string &filename, int firstRow, int lastRow,
+                                                                  int firstCol, int lastCol, int &rows, int &cols)
+{
+    MatrixMarketIndex index = loadMatrixMarketIndex(filename);
+    MappedFile file(filename);
+    MatrixMarketHeader header = parseMatrixMarketHeader(file, filename);
+    rows = header.rows;
+    cols = header.cols;
+    firstRow = std::max(firstRow, 0);
+    lastRow = std::min(lastRow, rows);
+    firstCol = std::max(firstCol, 0);
+    lastCol = std::min(lastCol, cols);
+    if (firstRow >= lastRow || firstCol >= lastCol)
+    {
+        return {};
+    }
+
+    // Stored rows to parse, as disjoint ranges
+    std::vector<std::pair<int, int>> rowRanges = {{firstRow, lastRow}};
+    if (header.symmetric)
+    {
+        if (firstCol <= lastRow && firstRow <= lastCol)
+        {
+            rowRanges[0] = {std::min(firstRow, firstCol), std::max(lastRow, lastCol)};
+        }
+        else
+        {
+            rowRanges.emplace_back(firstCol, lastCol);
+        }
+    }
+
+    std::vector<std::vector<std::tuple<int, int, double>>> stored;
+    if (index.sorted)
+    {
+        for (const auto &[first, last] : rowRanges)
+        {
+            stored.push_back(parseIndexedRows(file, index, header, first, last, filename));
+        }
+    }
+    else
+    {
+        stored.push_back(parseEntryLines(header.body, file.end(), header.rows, header.cols, filename));
+    }
+
+    // Every stored entry stands for itself and, in a symmetric file, for its mirror
+    auto inWindow = [&](int row, int col)
+    {
+        return row >= firstRow && row < lastRow && col >= firstCol && col < lastCol;
+    };
+    std::vector<std::tuple<int, int, double>> windowData;
+    for (const auto &entries : stored)
+    {
+        for (const auto &[row, col, value] : entries)
+        {
+            if (inWindow(row, col))
+            {
+                windowData.emplace_back(row, col, value);
+            }
+            if (header.symmetric && row != col && inWindow(col, row))
+            {
+                windowData.emplace_back(col, row, value);
+            }
+        }
+    }
+    return windowData;
+}
+
+// Function to read the rows [firstRow, lastRow) of a .mtx file as 0-based triplets numbered as in the whole matrix.
+// See readMatrixWindow: a general file only has the range parsed, while the rows of a symmetric file take their
+// entries above the diagonal from all the later rows, so such a read costs a scan of the rest of the file.
+inline std::vector<std::tuple<int, int, double>> readMatrixRowRange(const std::string &filename, int firstRow, int lastRow,
+                                                                    int &rows, int &cols)
+{
+    return readMatrixWindow(filename, firstRow, lastRow, 0, std::numeric_limits<int>::max(), rows, cols);
+}
+
+// Function to read the submatrix rows [firstRow, lastRow) x cols [firstCol, lastCol) of a .mtx file as 0-based triplets
+// numbered from (firstRow, firstCol), parsing only the row blocks that hold it
+inline std::vector<std::tuple<int, int, double>> readSubMatrixTriplets(const std::string &filename, int firstRow, int lastRow,
+                                                                       int firstCol, int lastCol, int &rows, int &cols)
+{
+    std::vector<std::tuple<int, int, double>> subMatrixData =
+        readMatrixWindow(filename, firstRow, lastRow, firstCol, lastCol, rows, cols);
+    for (auto &[row, col, value] : subMatrixData)
+    {
+        row -= std::max(firstRow, 0);
+        col -= std::max(firstCol, 0);
+    }
+    return subMatrixData;
+}
+
+// Function to rewrite a .mtx file with its entry lines in row-major order, so that it can be indexed, and index it.
+// Repeated coordinates keep the last value, as when the file is read into a grid. A symmetric file stays symmetric
+// and keeps its lower triangle.
+inline MatrixMarketIndex sortMatrixMarketFile(const std::string &filename, int blockRows = 256)
+{
+    int rows = 0, cols = 0;
+    bool symmetric = false;
+    std::vector<std::tuple<int, int, double>> matrixData = readStoredMatrixTriplets(filename, rows, cols, symmetric);
+
+    std::string tempPath = filename + ".sorted.tmp";
+    writeMatrixTriplets(tempPath, matrixData, rows, cols,
+                        symmetric ? MatrixMarketSymmetry::Symmetric : MatrixMarketSymmetry::General, "Sorted by row");
+    std::filesystem::rename(tempPath, filename);
+
+    MatrixMarketIndex index = buildMatrixMarketIndex(filename, blockRows);
+    writeMatrixMarketIndex(matrixIndexPath(filename), index);
+    return index;
+}
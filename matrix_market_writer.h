@@ -0,0 +1,242 @@
+#pragma once
+
+#include "csr_matrix.h"
+#include "matrix_layout.h"
+
+#include <openvdb/openvdb.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_pipeline.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/task_arena.h>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+// How a matrix is written to a MatrixMarket file
+enum class MatrixMarketSymmetry
+{
+    General,   // every entry
+    Symmetric, // the caller guarantees A = A^T; only the lower triangle is written
+    Detect     // symmetric if the matrix turns out to be, general otherwise
+};
+
+// Longest entry line: two 10-digit indices, the longest shortest-round-trip double and the separators
+constexpr size_t MATRIX_MARKET_MAX_LINE = 64;
+
+// Function to format one 0-based entry as a 1-based "row col value" line and return the end of the text.
+// Values are written with std::to_chars in their shortest form that reads back to the same float or double.
+template <typename ValueType>
+inline char *formatMatrixEntry(char *out, int row, int col, ValueType value)
+{
+    char *last = out + MATRIX_MARKET_MAX_LINE;
+    out = std::to_chars(out, last, row + 1).ptr;
+    *out++ = ' ';
+    out = std::to_chars(out, last, col + 1).ptr;
+    *out++ = ' ';
+    if constexpr (std::is_floating_point_v<ValueType>)
+    {
+        out = std::to_chars(out, last, value).ptr;
+    }
+    else
+    {
+        out = std::to_chars(out, last, static_cast<float>(value)).ptr; // e.g. half
+    }
+    *out++ = '\n';
+    return out;
+}
+
+// Function to check whether a compressed-row matrix equals its transpose, value for value
+template <typename ValueType>
+inline bool isSymmetricCsr(const CsrMatrixT<ValueType> &M)
+{
+    if (M.rows != M.cols)
+    {
+        return false;
+    }
+
+    std::atomic<bool> symmetric(true);
+    tbb::parallel_for(tbb::blocked_range<int>(0, M.rows), [&](const tbb::blocked_range<int> &range)
+    {
+        for (int i = range.begin(); i != range.end() && symmetric.load(std::memory_order_relaxed); ++i)
+        {
+            for (size_t p = M.rowStart[i]; p < M.rowStart[i + 1]; ++p)
+            {
+                // Look for the mirrored entry (j, i); rows are sorted by column
+                int j = M.colIndex[p];
+                auto first = M.colIndex.begin() + M.rowStart[j];
+                auto last = M.colIndex.begin() + M.rowStart[j + 1];
+                auto mirror = std::lower_bound(first, last, i);
+                if (mirror == last || *mirror != i || !(M.values[mirror - M.colIndex.begin()] == M.values[p]))
+                {
+                    symmetric = false;
+                    break;
+                }
+            }
+        }
+    });
+    return symmetric;
+}
+
+// Function to count the entries a MatrixMarket file of the matrix holds, i.e. all of them or only the lower triangle
+template <typename ValueType>
+inline size_t countMatrixMarketEntries(const CsrMatrixT<ValueType> &M, bool lowerTriangle)
+{
+    if (!lowerTriangle)
+    {
+        return M.nonZeros();
+    }
+    auto countRows = [&](const tbb::blocked_range<int> &range, size_t count)
+    {
+        for (int i = range.begin(); i != range.end(); ++i)
+        {
+            auto first = M.colIndex.begin() + M.rowStart[i];
+            auto last = M.colIndex.begin() + M.rowStart[i + 1];
+            count += std::upper_bound(first, last, i) - first;
+        }
+        return count;
+    };
+    return tbb::parallel_reduce(tbb::blocked_range<int>(0, M.rows), size_t(0), countRows, [](size_t a, size_t b)
+    {
+        return a + b;
+    });
+}
+
+// Function to write the entry lines of a compressed-row matrix in row-major order, numbering its rows from firstRow.
+// Rows are cut into chunks of about a quarter million entries that a TBB pipeline formats in parallel into their own
+// buffers and hands to a single writer in order, so formatting overlaps with output and memory stays bounded by a few
+// chunks per thread. With lowerTriangle set only entries with col <= row are written. Returns the number of entries.
+template <typename ValueType>
+inline size_t writeMatrixMarketRows(std::ostream &out, const CsrMatrixT<ValueType> &M, int firstRow = 0,
+                                    bool lowerTriangle = false)
+{
+    const size_t chunkEntries = size_t(1) << 18;
+
+    // Chunk c covers the rows [chunkStart[c], chunkStart[c + 1])
+    std::vector<int> chunkStart(1, 0);
+    for (int i = 0; i < M.rows; ++i)
+    {
+        if (M.rowStart[i + 1] - M.rowStart[chunkStart.back()] >= chunkEntries)
+        {
+            chunkStart.push_back(i + 1);
+        }
+    }
+    if (chunkStart.back() != M.rows)
+    {
+        chunkStart.push_back(M.rows);
+    }
+    const size_t numChunks = chunkStart.size() - 1;
+
+    struct Chunk
+    {
+        size_t index = 0;
+        size_t entries = 0;
+        std::vector<char> text;
+    };
+
+    size_t next = 0, written = 0;
+    tbb::parallel_pipeline(2 * tbb::this_task_arena::max_concurrency(),
+        tbb::make_filter<void, Chunk>(tbb::filter_mode::serial_in_order, [&](tbb::flow_control &control)
+        {
+            Chunk chunk;
+            if (next == numChunks)
+            {
+                control.stop();
+                return chunk;
+            }
+            chunk.index = next++;
+            return chunk;
+        }) &
+        tbb::make_filter<Chunk, Chunk>(tbb::filter_mode::parallel, [&](Chunk chunk)
+        {
+            int first = chunkStart[chunk.index], last = chunkStart[chunk.index + 1];
+            chunk.text.resize((M.rowStart[last] - M.rowStart[first]) * MATRIX_MARKET_MAX_LINE);
+            char *end = chunk.text.data();
+            for (int i = first; i < last; ++i)
+            {
+                for (size_t p = M.rowStart[i]; p < M.rowStart[i + 1]; ++p)
+                {
+                    if (lowerTriangle && M.colIndex[p] > i + firstRow)
+                    {
+                        break; // columns are sorted, the rest of the row is upper triangle
+                    }
+                    end = formatMatrixEntry(end, i + firstRow, M.colIndex[p], M.values[p]);
+                    ++chunk.entries;
+                }
+            }
+            chunk.text.resize(end - chunk.text.data());
+            return chunk;
+        }) &
+        tbb::make_filter<Chunk, void>(tbb::filter_mode::serial_in_order, [&](const Chunk &chunk)
+        {
+            out.write(chunk.text.data(), static_cast<std::streamsize>(chunk.text.size()));
+            written += chunk.entries;
+        }));
+
+    return written;
+}
+
+// Function to write a compressed-row matrix to a .mtx file.
+// Symmetric matrices get the "symmetric" banner and only their lower triangle, as the format expects; with
+// MatrixMarketSymmetry::Detect the matrix is checked first. An optional comment goes below the banner.
+template <typename ValueType>
+inline void writeMatrixMarket(const std::string &filename, const CsrMatrixT<ValueType> &M,
+                              MatrixMarketSymmetry symmetry = MatrixMarketSymmetry::Detect, const std::string &comment = "")
+{
+    bool symmetric = symmetry == MatrixMarketSymmetry::Symmetric ||
+                     (symmetry == MatrixMarketSymmetry::Detect && isSymmetricCsr(M));
+
+    std::ofstream outfile(filename, std::ios::binary);
+    if (!outfile.is_open())
+    {
+        std::cerr << "Error: Unable to open file " << filename << std::endl;
+        exit(1);
+    }
+
+    // Write the Matrix Market header
+    outfile << "%%MatrixMarket matrix coordinate real " << (symmetric ? "symmetric" : "general") << "\n";
+    if (!comment.empty())
+    {
+        outfile << "% " << comment << "\n";
+    }
+    outfile << M.rows << " " << M.cols << " " << countMatrixMarketEntries(M, symmetric) << "\n";
+
+    writeMatrixMarketRows(outfile, M, 0, symmetric);
+
+    outfile.close();
+    if (outfile.fail())
+    {
+        std::cerr << "Error: Unable to write file " << filename << std::endl;
+        exit(1);
+    }
+}
+
+// Function to write 0-based (row, col, value) triplets to a .mtx file in row-major order.
+// Repeated coordinates keep the last value and entries outside rows x cols are dropped, as in tripletsToCsr.
+inline void writeMatrixTriplets(const std::string &filename, const std::vector<std::tuple<int, int, double>> &triplets,
+                                int rows, int cols, MatrixMarketSymmetry symmetry = MatrixMarketSymmetry::Detect,
+                                const std::string &comment = "")
+{
+    writeMatrixMarket(filename, tripletsToCsr<double>(triplets, rows, cols), symmetry, comment);
+}
+
+// Function to export the active values of a matrix grid to a .mtx file in row-major order.
+// A symmetric grid already holds just the lower triangle the file needs, so it is written as stored.
+template <typename Layout = SliceLayout, typename GridType>
+inline void writeMatrixGrid(const std::string &filename, const GridType &grid, int rows, int cols,
+                            MatrixMarketSymmetry symmetry = MatrixMarketSymmetry::Detect, const std::string &comment = "")
+{
+    if (isMatrixSymmetric(grid))
+    {
+        writeMatrixMarket(filename, gridToStoredCsr<Layout>(grid, rows, cols), MatrixMarketSymmetry::Symmetric, comment);
+        return;
+    }
+    writeMatrixMarket(filename, gridToCsr<Layout>(grid, rows, cols), symmetry, comment);
+}
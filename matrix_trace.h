@@ -0,0 +1,331 @@
+#pragma once
+
+#include "csr_matrix.h"
+#include "matrix_transpose.h"
+#include "sparse_multiply.h"
+
+#include <openvdb/openvdb.h>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_reduce.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+// Function to sum a reduction body over [0, size), either with TBB's fastest split or with a fixed split that
+// gives bitwise-identical results from run to run
+template <typename AccumType, typename BodyType>
+inline AccumType reduceSum(size_t size, size_t grain, bool deterministic, const BodyType &body)
+{
+    tbb::blocked_range<size_t> range(0, size, grain);
+    if (deterministic)
+    {
+        return tbb::parallel_deterministic_reduce(range, AccumType(0), body, std::plus<AccumType>());
+    }
+    return tbb::parallel_reduce(range, AccumType(0), body, std::plus<AccumType>());
+}
+
+// Function to calculate trace(A*B) = sum of A[i,k] * B[k,i] without forming the product.
+// Each active entry of A is looked up at its transposed position in B through a per-task accessor; the entries of one
+// leaf of A transpose into only a few leaves of B, so almost every lookup hits the accessor's cached leaf.
+// Products and partial sums are kept in AccumType, double by default, whatever the storage type of the grids.
+// Taking views, only the leaves of A overlapping its window are visited, so the trace of a small block of a large
+// matrix costs no more than the block.
+// Symmetric grids are read in their stored form: every stored off-diagonal entry of A stands for itself and its mirror,
+// and B is probed at the lower-triangle position of either. For two symmetric matrices only half the entries of A are
+// visited, and the two lookups of an entry land on the same voxel of B.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline AccumType traceOfProduct(const MatrixViewT<GridType> &A, const MatrixViewT<GridType> &B, bool deterministic = false)
+{
+    using TreeType = typename GridType::TreeType;
+    using ValueType = typename GridType::ValueType;
+    using LeafType = typename TreeType::LeafNodeType;
+
+    if (A.rows != B.cols || A.cols != B.rows)
+    {
+        OPENVDB_THROW(openvdb::ValueError, "trace of a " << A.rows << "x" << A.cols << " view times a " << B.rows << "x"
+                                                         << B.cols << " view is undefined");
+    }
+    checkMatrixLayout<Layout>(*A.grid);
+    checkMatrixLayout<Layout>(*B.grid);
+    const bool symmetricA = isMatrixSymmetric(*A.grid);
+    const bool symmetricB = isMatrixSymmetric(*B.grid);
+
+    typename TreeType::ConstPtr treeA = voxelTree(*A.grid);
+    typename TreeType::ConstPtr treeB = voxelTree(*B.grid);
+
+    std::vector<const LeafType *> leaves =
+        storedWindowLeaves<Layout>(*treeA, symmetricA, A.firstRow, A.firstCol, A.rows, A.cols);
+
+    return reduceSum<AccumType>(leaves.size(), 64, deterministic, [&](const tbb::blocked_range<size_t> &range, AccumType sum)
+    {
+        openvdb::tree::ValueAccessor<const TreeType> accessorB(*treeB);
+
+        // Function to return B[k,i] for the entry of A at (row, col) of its matrix, or zero outside A's window
+        auto transposedB = [&](int row, int col)
+        {
+            int i = row - A.firstRow, k = col - A.firstCol;
+            ValueType valueB;
+            if (i >= 0 && i < A.rows && k >= 0 && k < A.cols &&
+                probeMatrixEntry<Layout>(accessorB, symmetricB, B.firstRow + k, B.firstCol + i, valueB))
+            {
+                return static_cast<AccumType>(valueB);
+            }
+            return AccumType(0);
+        };
+
+        for (size_t n = range.begin(); n != range.end(); ++n)
+        {
+            for (auto iter = leaves[n]->cbeginValueOn(); iter; ++iter)
+            {
+                int row, col;
+                if (!Layout::toIndex(iter.getCoord(), row, col))
+                {
+                    continue;
+                }
+                sum += static_cast<AccumType>(iter.getValue()) * transposedB(row, col);
+                if (symmetricA && row != col)
+                {
+                    sum += static_cast<AccumType>(iter.getValue()) * transposedB(col, row);
+                }
+            }
+        }
+        return sum;
+    });
+}
+
+// Function to calculate trace(A*B) of two whole matrix grids, as above
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline AccumType traceOfProduct(openvdb::SharedPtr<GridType> A, openvdb::SharedPtr<GridType> B, bool deterministic = false)
+{
+    int rowsA = 0, colsA = 0, rowsB = 0, colsB = 0;
+    matrixExtent<Layout>(*A, rowsA, colsA);
+    matrixExtent<Layout>(*B, rowsB, colsB);
+    int rows = std::max(rowsA, colsB);
+    int inner = std::max(colsA, rowsB);
+
+    return traceOfProduct<Layout, AccumType>(subMatrix(A, 0, rows, 0, inner), subMatrix(B, 0, inner, 0, rows), deterministic);
+}
+
+// Function to calculate trace(A*B) = sum of A[i,k] * Bt[i,k] from A and the transpose Bt of B, e.g. one kept by a
+// TransposeCacheT. Matching entries of A and Bt sit at the same voxel, so every leaf of A is paired with the leaf of Bt
+// at its origin and both buffers are read at the same offsets, with no accessor lookups.
+// Both grids must be general; a symmetric grid is read in stored form, which this pairing does not expand.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline AccumType traceOfProductTransposed(const GridType &A, const GridType &Bt, bool deterministic = false)
+{
+    using TreeType = typename GridType::TreeType;
+    using LeafType = typename TreeType::LeafNodeType;
+
+    checkMatrixLayout<Layout>(A);
+    checkMatrixLayout<Layout>(Bt);
+    if (isMatrixSymmetric(A) || isMatrixSymmetric(Bt))
+    {
+        OPENVDB_THROW(openvdb::ValueError, "the trace of a product with a transposed operand takes general grids only");
+    }
+
+    typename TreeType::ConstPtr treeA = voxelTree(A);
+    typename TreeType::ConstPtr treeBt = voxelTree(Bt);
+
+    std::vector<const LeafType *> leaves;
+    leaves.reserve(treeA->leafCount());
+    treeA->getNodes(leaves);
+
+    return reduceSum<AccumType>(leaves.size(), 64, deterministic, [&](const tbb::blocked_range<size_t> &range, AccumType sum)
+    {
+        for (size_t n = range.begin(); n != range.end(); ++n)
+        {
+            const LeafType *leafBt = treeBt->probeConstLeaf(leaves[n]->origin());
+            if (!leafBt)
+            {
+                continue;
+            }
+            for (auto iter = leaves[n]->cbeginValueOn(); iter; ++iter)
+            {
+                if (leafBt->isValueOn(iter.pos()))
+                {
+                    sum += static_cast<AccumType>(iter.getValue()) * static_cast<AccumType>(leafBt->getValue(iter.pos()));
+                }
+            }
+        }
+        return sum;
+    });
+}
+
+// Function to calculate trace(A*B) of two whole matrix grids with the transpose of B taken from a cache, so that a
+// trace against the same B, e.g. in every iteration of a loop, transposes B once. Symmetric grids need no transpose
+// and go through traceOfProduct as they are.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline AccumType traceOfProduct(openvdb::SharedPtr<GridType> A, openvdb::SharedPtr<GridType> B,
+                                TransposeCacheT<GridType> &cache, bool deterministic = false)
+{
+    if (isMatrixSymmetric(*A) || isMatrixSymmetric(*B))
+    {
+        return traceOfProduct<Layout, AccumType>(A, B, deterministic);
+    }
+    return traceOfProductTransposed<Layout, AccumType>(*A, *cache.template transpose<Layout>(B), deterministic);
+}
+
+// Function to calculate trace(A*B*C) without forming any product grid, e.g. trace(PSP).
+// The rows of A are read straight from its leaves, a leaf-high block at a time, into a per-thread buffer; row i of A*B
+// is built from them in a per-thread sparse accumulator and dotted with column i of C through an accessor. B is read by
+// rows, so it is the one operand copied into compressed rows: the extra memory is O(nnz(B)) plus one block of rows of
+// A and one accumulator per thread. A symmetric A is expanded into compressed rows as well, since both triangles of a
+// row are needed. Sums are kept in AccumType, as in traceOfProduct.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline AccumType traceOfTripleProduct(const MatrixViewT<GridType> &A, const MatrixViewT<GridType> &B,
+                                      const MatrixViewT<GridType> &C, bool deterministic = false)
+{
+    using TreeType = typename GridType::TreeType;
+    using ValueType = typename GridType::ValueType;
+    using LeafType = typename TreeType::LeafNodeType;
+
+    if (A.cols != B.rows || B.cols != C.rows || C.cols != A.rows)
+    {
+        OPENVDB_THROW(openvdb::ValueError, "trace of a " << A.rows << "x" << A.cols << " times " << B.rows << "x" << B.cols
+                                                         << " times " << C.rows << "x" << C.cols << " product is undefined");
+    }
+
+    checkMatrixLayout<Layout>(*A.grid);
+    checkMatrixLayout<Layout>(*C.grid);
+    const bool symmetricA = isMatrixSymmetric(*A.grid);
+    const bool symmetricC = isMatrixSymmetric(*C.grid);
+    CsrMatrixT<ValueType> csrB = viewToCsr<Layout>(B);
+    typename TreeType::ConstPtr treeC = voxelTree(*C.grid);
+
+    // Blocks of TILE_ROWS rows of A: the leaves sharing an x origin, or rows of the expanded copy of a symmetric A
+    const int blockRows = Layout::TILE_ROWS;
+    CsrMatrixT<ValueType> csrA;
+    std::vector<const LeafType *> leaves;
+    std::vector<size_t> blockStart;
+    size_t numBlocks;
+    if (symmetricA)
+    {
+        csrA = viewToCsr<Layout>(A);
+        numBlocks = (A.rows + blockRows - 1) / blockRows;
+    }
+    else
+    {
+        typename TreeType::ConstPtr treeA = voxelTree(*A.grid);
+        leaves = windowLeaves<Layout>(*treeA, A.firstRow, A.firstCol, A.rows, A.cols);
+        groupLeafBlocks(leaves, 0, blockStart);
+        numBlocks = blockStart.size() - 1;
+    }
+
+    const int inner = B.cols;
+    tbb::enumerable_thread_specific<SparseAccumulatorT<AccumType>> accumulators([inner]
+    {
+        return SparseAccumulatorT<AccumType>(inner);
+    });
+    tbb::enumerable_thread_specific<CsrMatrixT<ValueType>> blocks;
+    tbb::enumerable_thread_specific<std::vector<size_t>> cursors;
+
+    return reduceSum<AccumType>(numBlocks, 16, deterministic, [&](const tbb::blocked_range<size_t> &range, AccumType sum)
+    {
+        SparseAccumulatorT<AccumType> &spa = accumulators.local();
+        CsrMatrixT<ValueType> &block = blocks.local();
+        std::vector<size_t> &next = cursors.local();
+        openvdb::tree::ValueAccessor<const TreeType> accessorC(*treeC);
+        for (size_t b = range.begin(); b != range.end(); ++b)
+        {
+            // Gather the block's rows of A, numbered from firstRow, into compressed rows
+            int firstRow = static_cast<int>(b) * blockRows;
+            block.rows = blockRows;
+            block.cols = A.cols;
+            block.rowStart.assign(blockRows + 1, 0);
+            if (symmetricA)
+            {
+                const int lastRow = std::min(A.rows, firstRow + blockRows);
+                const size_t first = csrA.rowStart[firstRow], last = csrA.rowStart[lastRow];
+                block.colIndex.assign(csrA.colIndex.begin() + first, csrA.colIndex.begin() + last);
+                block.values.assign(csrA.values.begin() + first, csrA.values.begin() + last);
+                for (int r = 0; r < blockRows; ++r)
+                {
+                    block.rowStart[r + 1] = csrA.rowStart[std::min(lastRow, firstRow + r + 1)] - first;
+                }
+            }
+            else
+            {
+                int originRow, originCol;
+                Layout::toIndex(leaves[blockStart[b]]->origin(), originRow, originCol);
+                firstRow = originRow - A.firstRow;
+                forEachBlockEntry<Layout>(leaves, blockStart[b], blockStart[b + 1], A.firstRow, A.firstCol, A.rows, A.cols,
+                                          [&](int i, int, const ValueType &) { ++block.rowStart[i - firstRow + 1]; });
+                for (int r = 0; r < blockRows; ++r)
+                {
+                    block.rowStart[r + 1] += block.rowStart[r];
+                }
+                block.colIndex.resize(block.rowStart[blockRows]);
+                block.values.resize(block.rowStart[blockRows]);
+                next.assign(block.rowStart.begin(), block.rowStart.end() - 1);
+                forEachBlockEntry<Layout>(leaves, blockStart[b], blockStart[b + 1], A.firstRow, A.firstCol, A.rows, A.cols,
+                                          [&](int i, int k, const ValueType &value)
+                {
+                    const size_t n = next[i - firstRow]++;
+                    block.colIndex[n] = k;
+                    block.values[n] = value;
+                });
+            }
+
+            for (int r = 0; r < blockRows; ++r)
+            {
+                const int i = firstRow + r;
+                if (block.rowStart[r] == block.rowStart[r + 1])
+                {
+                    continue;
+                }
+                accumulateRow(block, csrB, r, 0.0, spa);
+                for (int j : spa.touched)
+                {
+                    ValueType valueC;
+                    if (probeMatrixEntry<Layout>(accessorC, symmetricC, C.firstRow + j, C.firstCol + i, valueC))
+                    {
+                        sum += spa.values[j] * static_cast<AccumType>(valueC);
+                    }
+                    // Rows of every block are numbered from 0, so a marker must not outlive its row
+                    spa.marker[j] = -1;
+                }
+            }
+        }
+        return sum;
+    });
+}
+
+// Function to calculate trace(A*B*C) of three whole matrix grids, as above; dimensions are taken from their active
+// voxels
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline AccumType traceOfTripleProduct(openvdb::SharedPtr<GridType> A, openvdb::SharedPtr<GridType> B,
+                                      openvdb::SharedPtr<GridType> C, bool deterministic = false)
+{
+    int rowsA = 0, colsA = 0, rowsB = 0, colsB = 0, rowsC = 0, colsC = 0;
+    matrixExtent<Layout>(*A, rowsA, colsA);
+    matrixExtent<Layout>(*B, rowsB, colsB);
+    matrixExtent<Layout>(*C, rowsC, colsC);
+    int rows = std::max(rowsA, colsC);
+    int innerAB = std::max(colsA, rowsB);
+    int innerBC = std::max(colsB, rowsC);
+
+    return traceOfTripleProduct<Layout, AccumType>(subMatrix(A, 0, rows, 0, innerAB), subMatrix(B, 0, innerAB, 0, innerBC),
+                                                   subMatrix(C, 0, innerBC, 0, rows), deterministic);
+}
+
+// Function to sum the diagonal of a compressed-row matrix, e.g. trace(DS) from a stored product DS.
+// Rows are sorted, so each diagonal entry is found by a binary search of its row.
+template <typename AccumType = double, typename ValueType>
+inline AccumType traceOfCsr(const CsrMatrixT<ValueType> &M, bool deterministic = false)
+{
+    return reduceSum<AccumType>(std::min(M.rows, M.cols), 1024, deterministic,
+                                [&](const tbb::blocked_range<size_t> &range, AccumType sum)
+    {
+        for (size_t i = range.begin(); i != range.end(); ++i)
+        {
+            auto first = M.colIndex.begin() + M.rowStart[i], last = M.colIndex.begin() + M.rowStart[i + 1];
+            auto diagonal = std::lower_bound(first, last, static_cast<int>(i));
+            if (diagonal != last && *diagonal == static_cast<int>(i))
+            {
+                sum += static_cast<AccumType>(M.values[diagonal - M.colIndex.begin()]);
+            }
+        }
+        return sum;
+    });
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "csr_matrix.h"
+#include "matrix_layout.h"
+
+#include <openvdb/openvdb.h>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Function to check whether source holds any entry in the square block of Layout::TILE_ROWS rows and columns starting
+// at (firstRow, firstCol)
+template <typename Layout, typename LeafType>
+inline bool hasBlockEntries(const LeafType &source, int firstRow, int firstCol)
+{
+    for (int r = 0; r < Layout::TILE_ROWS; ++r)
+    {
+        for (int c = 0; c < Layout::TILE_ROWS; ++c)
+        {
+            if (source.isValueOn(LeafType::coordToOffset(Layout::toCoord(firstRow + r, firstCol + c))))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Function to copy the square block of Layout::TILE_ROWS rows and columns starting at (firstRow, firstCol) of source
+// into target at its transposed position, i.e. entry (i, j) of source becomes entry (j, i) of target
+template <typename Layout, typename LeafType>
+inline void transposeLeafBlock(const LeafType &source, int firstRow, int firstCol, LeafType &target)
+{
+    for (int r = 0; r < Layout::TILE_ROWS; ++r)
+    {
+        for (int c = 0; c < Layout::TILE_ROWS; ++c)
+        {
+            const openvdb::Index offset = LeafType::coordToOffset(Layout::toCoord(firstRow + r, firstCol + c));
+            if (source.isValueOn(offset))
+            {
+                target.setValueOn(LeafType::coordToOffset(Layout::toCoord(firstCol + c, firstRow + r)), source.getValue(offset));
+            }
+        }
+    }
+}
+
+// Function to return the transpose of a matrix grid, built leaf by leaf on all TBB worker threads.
+// A leaf holds a tile of TILE_ROWS x TILE_COLS entries, which splits into TILE_COLS / TILE_ROWS square blocks; each
+// block transposes into a block of one leaf of the result. For the slice layout a tile is square, so every leaf swaps
+// its origin and has its buffer transposed; the folded layouts gather every leaf of the result from the blocks of
+// TILE_COLS / TILE_ROWS leaves. The leaves of the result are found first, then filled in parallel, each by a single
+// task, and finally linked into the tree. No voxel is set through an accessor.
+// A symmetric grid is its own transpose and is copied as it is.
+template <typename Layout = SliceLayout, typename GridType>
+inline typename GridType::Ptr transposeMatrix(const GridType &A)
+{
+    using TreeType = typename GridType::TreeType;
+    using ValueType = typename GridType::ValueType;
+    using LeafType = typename TreeType::LeafNodeType;
+
+    static_assert(Layout::TILE_COLS % Layout::TILE_ROWS == 0, "a leaf tile must split into square blocks");
+    const int blockRows = Layout::TILE_ROWS;
+    const int numBlocks = Layout::TILE_COLS / Layout::TILE_ROWS;
+
+    checkMatrixLayout<Layout>(A);
+    if (isMatrixSymmetric(A))
+    {
+        return A.deepCopy();
+    }
+
+    typename TreeType::ConstPtr tree = voxelTree(A);
+    const ValueType background = tree->background();
+
+    std::vector<const LeafType *> leaves;
+    leaves.reserve(tree->leafCount());
+    tree->getNodes(leaves);
+
+    // Origins of the result's leaves: block a of the leaf at (firstRow, firstCol) lands in the leaf holding
+    // (firstCol + a * TILE_ROWS, firstRow)
+    tbb::enumerable_thread_specific<std::vector<openvdb::Coord>> localOrigins;
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, leaves.size()), [&](const tbb::blocked_range<size_t> &range)
+    {
+        std::vector<openvdb::Coord> &origins = localOrigins.local();
+        for (size_t n = range.begin(); n != range.end(); ++n)
+        {
+            int firstRow, firstCol;
+            if (!Layout::toIndex(leaves[n]->origin(), firstRow, firstCol))
+            {
+                continue;
+            }
+            for (int a = 0; a < numBlocks; ++a)
+            {
+                if (hasBlockEntries<Layout>(*leaves[n], firstRow, firstCol + a * blockRows))
+                {
+                    origins.push_back(matrixLeafOrigin<Layout, LeafType>(firstCol + a * blockRows, firstRow));
+                }
+            }
+        }
+    });
+
+    std::vector<openvdb::Coord> origins;
+    for (const std::vector<openvdb::Coord> &local : localOrigins)
+    {
+        origins.insert(origins.end(), local.begin(), local.end());
+    }
+    std::sort(origins.begin(), origins.end());
+    origins.erase(std::unique(origins.begin(), origins.end()), origins.end());
+
+    // Block b of the leaf of the result at (firstRow, firstCol) comes from the leaf of A holding
+    // (firstCol + b * TILE_ROWS, firstRow)
+    std::vector<LeafType *> transposed(origins.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, origins.size()), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t n = range.begin(); n != range.end(); ++n)
+        {
+            int firstRow, firstCol;
+            Layout::toIndex(origins[n], firstRow, firstCol);
+            transposed[n] = new LeafType(origins[n], background);
+            for (int b = 0; b < numBlocks; ++b)
+            {
+                const int sourceRow = firstCol + b * blockRows;
+                if (const LeafType *source = tree->probeConstLeaf(matrixLeafOrigin<Layout, LeafType>(sourceRow, firstRow)))
+                {
+                    transposeLeafBlock<Layout>(*source, sourceRow, firstRow, *transposed[n]);
+                }
+            }
+        }
+    });
+
+    typename GridType::Ptr result = GridType::create(background);
+    setMatrixLayout<Layout>(*result);
+    for (LeafType *leaf : transposed)
+    {
+        result->tree().addLeaf(leaf);
+    }
+    return result;
+}
+
+// Transposes of matrix grids, made once and handed out again, e.g. the transposed B of trace(A*B) in every iteration
+// of a loop. An entry is made again when its grid has been given a new tree; a grid whose values are changed in place
+// must be invalidated. The transposes are shared with the callers, which must not change them. Safe to use from
+// several threads.
+template <typename GridType>
+class TransposeCacheT
+{
+public:
+    using GridPtr = typename GridType::Ptr;
+
+    // Function to return the transpose of grid, making it on first use
+    template <typename Layout = SliceLayout>
+    GridPtr transpose(const openvdb::SharedPtr<const GridType> &grid)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        // Entries of grids that are gone, or that have a new tree, can never be handed out again
+        mEntries.erase(std::remove_if(mEntries.begin(), mEntries.end(), [](const Entry &entry)
+        {
+            openvdb::SharedPtr<const GridType> source = entry.grid.lock();
+            return !source || source->constTreePtr() != entry.tree;
+        }), mEntries.end());
+
+        for (const Entry &entry : mEntries)
+        {
+            if (entry.grid.lock() == grid && entry.layout == Layout::name())
+            {
+                return entry.transpose;
+            }
+        }
+
+        Entry entry;
+        entry.grid = grid;
+        entry.tree = grid->constTreePtr();
+        entry.layout = Layout::name();
+        entry.transpose = transposeMatrix<Layout>(*grid);
+        mEntries.push_back(entry);
+        return entry.transpose;
+    }
+
+    // Function to drop the transposes of a grid, e.g. after its values were changed in place
+    void invalidate(const GridType &grid)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mEntries.erase(std::remove_if(mEntries.begin(), mEntries.end(), [&](const Entry &entry)
+        {
+            return entry.grid.lock().get() == &grid;
+        }), mEntries.end());
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mEntries.clear();
+    }
+
+private:
+    struct Entry
+    {
+        std::weak_ptr<const GridType> grid;
+        typename GridType::TreeType::ConstPtr tree; // held so that a replaced tree is never mistaken for a new one
+        std::string layout;
+        GridPtr transpose;
+    };
+
+    std::mutex mMutex;
+    std::vector<Entry> mEntries;
+};
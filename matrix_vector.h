@@ -0,0 +1,255 @@
+#pragma once
+
+#include "csr_matrix.h"
+
+#include <openvdb/openvdb.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <algorithm>
+#include <array>
+#include <type_traits>
+#include <vector>
+
+// Leaves of a matrix window grouped for repeated products with vectors, e.g. the iterations of Lanczos, conjugate
+// gradient or a power method. Building a plan sorts the leaves once; every product after that only walks them.
+// The plan shares the grid's tree, so it stays valid as long as the grid's entries are not changed.
+template <typename Layout, typename GridType>
+struct MatrixVectorPlanT
+{
+    using TreeType = typename GridType::TreeType;
+    using LeafType = typename TreeType::LeafNodeType;
+
+    typename TreeType::ConstPtr tree;
+    bool symmetric = false;
+    int firstRow = 0;
+    int firstCol = 0;
+    int rows = 0;
+    int cols = 0;
+    std::vector<const LeafType *> rowLeaves; // leaves overlapping the window, in blocks of whole rows
+    std::vector<size_t> rowBlockStart;
+    std::vector<const LeafType *> mirrorLeaves; // symmetric grids: leaves overlapping the transposed window, by columns
+    std::vector<size_t> mirrorBlockStart;
+};
+
+// Function to group the leaves of a view for products with vectors
+template <typename Layout = SliceLayout, typename GridType>
+inline MatrixVectorPlanT<Layout, GridType> planMatrixVector(const MatrixViewT<GridType> &A)
+{
+    checkMatrixLayout<Layout>(*A.grid);
+
+    MatrixVectorPlanT<Layout, GridType> plan;
+    plan.tree = voxelTree(*A.grid);
+    plan.symmetric = isMatrixSymmetric(*A.grid);
+    plan.firstRow = A.firstRow;
+    plan.firstCol = A.firstCol;
+    plan.rows = A.rows;
+    plan.cols = A.cols;
+    plan.rowLeaves = windowLeaves<Layout>(*plan.tree, A.firstRow, A.firstCol, A.rows, A.cols);
+    groupLeafBlocks(plan.rowLeaves, 0, plan.rowBlockStart);
+
+    // A stored entry (i, j) above the window's diagonal stands for (j, i), which adds to row j. Leaves sharing a y origin
+    // hold the same values of j, so each block of them is again owned by a single task.
+    if (plan.symmetric)
+    {
+        plan.mirrorLeaves = windowLeaves<Layout>(*plan.tree, A.firstCol, A.firstRow, A.cols, A.rows);
+        groupLeafBlocks(plan.mirrorLeaves, 1, plan.mirrorBlockStart);
+    }
+    return plan;
+}
+
+// Function to group the leaves of a whole matrix grid for products with vectors
+template <typename Layout = SliceLayout, typename GridType>
+inline MatrixVectorPlanT<Layout, GridType> planMatrixVector(openvdb::SharedPtr<GridType> A)
+{
+    return planMatrixVector<Layout>(matrixView<Layout>(A));
+}
+
+// Function to call body with std::integral_constant<int, k> for the vector counts worth a kernel of their own, and with
+// std::integral_constant<int, 0> for any other k. A count known at compile time lets the loops over the k vectors of an
+// entry unroll into SIMD instructions and keep the running sums of a row in registers.
+template <typename BodyType>
+inline void dispatchVectorCount(int k, const BodyType &body)
+{
+    switch (k)
+    {
+    case 1:
+        body(std::integral_constant<int, 1>());
+        break;
+    case 2:
+        body(std::integral_constant<int, 2>());
+        break;
+    case 4:
+        body(std::integral_constant<int, 4>());
+        break;
+    case 8:
+        body(std::integral_constant<int, 8>());
+        break;
+    case 16:
+        body(std::integral_constant<int, 16>());
+        break;
+    default:
+        body(std::integral_constant<int, 0>());
+        break;
+    }
+}
+
+// Function to check that X holds k vectors of cols entries
+template <typename VectorType>
+inline void checkVectorCount(int rows, int cols, const std::vector<VectorType> &X, int k)
+{
+    if (k < 1 || X.size() != static_cast<size_t>(cols) * k)
+    {
+        OPENVDB_THROW(openvdb::ValueError, "cannot multiply a " << rows << "x" << cols << " matrix by " << k
+                                                                << " vectors stored in " << X.size() << " entries");
+    }
+}
+
+// Function to add A*X to Y for the entries held by the leaves [first, last) of one block, skipping entries outside the
+// window as forEachBlockEntry does. X and Y hold K vectors (k when K is 0) interleaved, i.e. entry j of vector v is
+// X[j * k + v]. The leaves visit the entries of a row in runs, so a run is summed in a local buffer before it is added
+// to its row of Y. With Transposed set every entry (i, j) is taken as (j, i) and the diagonal is skipped.
+template <int K, bool Transposed, typename Layout, typename LeafType, typename VectorType>
+inline void multiplyBlockVectors(const std::vector<const LeafType *> &leaves, size_t first, size_t last, int firstRow,
+                                 int firstCol, int rows, int cols, const VectorType *X, VectorType *Y, int k)
+{
+    using ValueType = typename LeafType::ValueType;
+
+    const int width = K > 0 ? K : k;
+    std::array<VectorType, (K > 0 ? K : 1)> fixedSum;
+    std::vector<VectorType> dynamicSum(K > 0 ? 0 : k);
+    VectorType *sum = K > 0 ? fixedSum.data() : dynamicSum.data();
+
+    int row = -1;
+    auto flush = [&]
+    {
+        if (row >= 0)
+        {
+            VectorType *y = Y + static_cast<size_t>(row) * width;
+            for (int v = 0; v < width; ++v)
+            {
+                y[v] += sum[v];
+            }
+        }
+    };
+
+    forEachBlockEntry<Layout>(leaves, first, last, firstRow, firstCol, rows, cols, [&](int i, int j, const ValueType &value)
+    {
+        if (Transposed)
+        {
+            if (i + firstRow == j + firstCol)
+            {
+                return; // the diagonal was taken in place
+            }
+            std::swap(i, j);
+        }
+        if (i != row)
+        {
+            flush();
+            row = i;
+            std::fill(sum, sum + width, VectorType(0));
+        }
+        const VectorType a = static_cast<VectorType>(value);
+        const VectorType *x = X + static_cast<size_t>(j) * width;
+        for (int v = 0; v < width; ++v)
+        {
+            sum[v] += a * x[v];
+        }
+    });
+    flush();
+}
+
+// Function to multiply a matrix by k vectors at once, Y = A*X, walking the active leaves of the plan's window.
+// X holds k vectors of plan.cols entries interleaved, X[j * k + v], and Y is resized to k vectors of plan.rows entries
+// in the same order, so every entry of A is read once for all k vectors and the k products are contiguous.
+// Blocks of rows are spread over the TBB worker threads. A symmetric grid takes a second pass over blocks of columns
+// for its mirrored entries. Each row of Y is summed in a fixed order, so the results are the same from run to run.
+template <typename Layout, typename GridType, typename VectorType>
+inline void multiplyMatrixVectors(const MatrixVectorPlanT<Layout, GridType> &plan, const std::vector<VectorType> &X,
+                                  std::vector<VectorType> &Y, int k)
+{
+    checkVectorCount(plan.rows, plan.cols, X, k);
+    Y.assign(static_cast<size_t>(plan.rows) * k, VectorType(0));
+
+    dispatchVectorCount(k, [&](auto count)
+    {
+        constexpr int K = decltype(count)::value;
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, plan.rowBlockStart.size() - 1),
+                          [&](const tbb::blocked_range<size_t> &range)
+        {
+            for (size_t b = range.begin(); b != range.end(); ++b)
+            {
+                multiplyBlockVectors<K, false, Layout>(plan.rowLeaves, plan.rowBlockStart[b], plan.rowBlockStart[b + 1],
+                                                       plan.firstRow, plan.firstCol, plan.rows, plan.cols, X.data(),
+                                                       Y.data(), k);
+            }
+        });
+
+        if (plan.symmetric)
+        {
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, plan.mirrorBlockStart.size() - 1),
+                              [&](const tbb::blocked_range<size_t> &range)
+            {
+                for (size_t b = range.begin(); b != range.end(); ++b)
+                {
+                    multiplyBlockVectors<K, true, Layout>(plan.mirrorLeaves, plan.mirrorBlockStart[b],
+                                                          plan.mirrorBlockStart[b + 1], plan.firstCol, plan.firstRow,
+                                                          plan.cols, plan.rows, X.data(), Y.data(), k);
+                }
+            });
+        }
+    });
+}
+
+// Function to multiply a matrix by one vector, y = A*x, as above
+template <typename Layout, typename GridType, typename VectorType>
+inline void multiplyMatrixVector(const MatrixVectorPlanT<Layout, GridType> &plan, const std::vector<VectorType> &x,
+                                 std::vector<VectorType> &y)
+{
+    multiplyMatrixVectors(plan, x, y, 1);
+}
+
+// Function to multiply a compressed-row matrix by k interleaved vectors, Y = A*X, one row per iteration on all TBB
+// worker threads. This is the baseline the grid kernels are measured against.
+template <typename ValueType, typename VectorType>
+inline void multiplyCsrVectors(const CsrMatrixT<ValueType> &A, const std::vector<VectorType> &X, std::vector<VectorType> &Y,
+                               int k)
+{
+    checkVectorCount(A.rows, A.cols, X, k);
+    Y.assign(static_cast<size_t>(A.rows) * k, VectorType(0));
+
+    dispatchVectorCount(k, [&](auto count)
+    {
+        constexpr int K = decltype(count)::value;
+        const int width = K > 0 ? K : k;
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, A.rows), [&](const tbb::blocked_range<int> &range)
+        {
+            std::array<VectorType, (K > 0 ? K : 1)> fixedSum;
+            std::vector<VectorType> dynamicSum(K > 0 ? 0 : k);
+            VectorType *sum = K > 0 ? fixedSum.data() : dynamicSum.data();
+
+            for (int i = range.begin(); i != range.end(); ++i)
+            {
+                std::fill(sum, sum + width, VectorType(0));
+                for (size_t p = A.rowStart[i]; p < A.rowStart[i + 1]; ++p)
+                {
+                    const VectorType a = static_cast<VectorType>(A.values[p]);
+                    const VectorType *x = X.data() + static_cast<size_t>(A.colIndex[p]) * width;
+                    for (int v = 0; v < width; ++v)
+                    {
+                        sum[v] += a * x[v];
+                    }
+                }
+                std::copy(sum, sum + width, Y.data() + static_cast<size_t>(i) * width);
+            }
+        });
+    });
+}
+
+// Function to multiply a compressed-row matrix by one vector, y = A*x, as above
+template <typename ValueType, typename VectorType>
+inline void multiplyCsrVector(const CsrMatrixT<ValueType> &A, const std::vector<VectorType> &x, std::vector<VectorType> &y)
+{
+    multiplyCsrVectors(A, x, y, 1);
+}
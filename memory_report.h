@@ -0,0 +1,123 @@
+#pragma once
+
+#include <openvdb/openvdb.h>
+#include <cstdint>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Function to return the current resident set size of the process in bytes
+inline size_t currentRssBytes()
+{
+    size_t pages = 0, resident = 0;
+    FILE *statm = std::fopen("/proc/self/statm", "r");
+    if (statm != nullptr)
+    {
+        if (std::fscanf(statm, "%zu %zu", &pages, &resident) != 2)
+        {
+            resident = 0;
+        }
+        std::fclose(statm);
+    }
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+// Function to reset the peak resident set size of the process to its current size, so that peakRssBytes measures what
+// follows. Returns false where the kernel does not support it, and the peak then covers the whole run.
+inline bool resetPeakRss()
+{
+    FILE *clearRefs = std::fopen("/proc/self/clear_refs", "w");
+    if (clearRefs == nullptr)
+    {
+        return false;
+    }
+    bool written = std::fputs("5", clearRefs) >= 0;
+    return std::fclose(clearRefs) == 0 && written;
+}
+
+// Function to return the peak resident set size of the process in bytes since the last resetPeakRss
+inline size_t peakRssBytes()
+{
+    size_t peakKb = 0;
+    FILE *status = std::fopen("/proc/self/status", "r");
+    if (status != nullptr)
+    {
+        char line[256];
+        while (std::fgets(line, sizeof(line), status) != nullptr)
+        {
+            if (std::sscanf(line, "VmHWM: %zu kB", &peakKb) == 1)
+            {
+                break;
+            }
+        }
+        std::fclose(status);
+    }
+    if (peakKb == 0)
+    {
+        struct rusage usage;
+        peakKb = getrusage(RUSAGE_SELF, &usage) == 0 ? static_cast<size_t>(usage.ru_maxrss) : 0;
+    }
+    return peakKb * 1024;
+}
+
+// Storage of one matrix grid, as reported by memoryTableRow
+struct GridMemoryStats
+{
+    std::string label;
+    std::string layout;         // "matrix_layout" metadata, "-" when untagged
+    uint64_t memUsage = 0;      // Grid::memUsage(), bytes
+    uint64_t leafNodes = 0;
+    uint64_t internalNodes = 0; // root and internal nodes
+    uint64_t activeVoxels = 0;
+    uint64_t leafVoxels = 0;    // voxels per leaf node
+    size_t rssBytes = 0;        // resident set size of the process when the grid was measured
+
+    double bytesPerNonZero() const { return activeVoxels > 0 ? static_cast<double>(memUsage) / activeVoxels : 0.0; }
+
+    // Fraction of the voxels of the allocated leaves that hold an entry
+    double leafFill() const
+    {
+        return leafNodes > 0 ? static_cast<double>(activeVoxels) / static_cast<double>(leafNodes * leafVoxels) : 0.0;
+    }
+};
+
+// Function to measure the storage of a matrix grid, together with the current resident set size of the process
+template <typename GridType>
+inline GridMemoryStats gridMemoryStats(const GridType &grid, const std::string &label)
+{
+    GridMemoryStats stats;
+    stats.label = label;
+    openvdb::StringMetadata::ConstPtr layout = grid.template getMetadata<openvdb::StringMetadata>("matrix_layout");
+    stats.layout = layout ? layout->value() : "-";
+    stats.memUsage = grid.memUsage();
+    stats.leafNodes = grid.tree().leafCount();
+    stats.internalNodes = grid.tree().nonLeafCount();
+    stats.activeVoxels = grid.activeVoxelCount();
+    stats.leafVoxels = GridType::TreeType::LeafNodeType::SIZE;
+    stats.rssBytes = currentRssBytes();
+    return stats;
+}
+
+// Function to write the header line of the comma-separated memory table
+inline void writeMemoryTableHeader(std::ostream &out)
+{
+    out << "label,layout,mem_usage_bytes,leaf_nodes,internal_nodes,active_voxels,bytes_per_nnz,leaf_fill,rss_bytes"
+        << std::endl;
+}
+
+// Function to write one grid as a line of the comma-separated memory table
+inline void writeMemoryTableRow(std::ostream &out, const GridMemoryStats &stats)
+{
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::defaultfloat << std::setprecision(6);
+    out << stats.label << "," << stats.layout << "," << stats.memUsage << "," << stats.leafNodes << ","
+        << stats.internalNodes << "," << stats.activeVoxels << "," << stats.bytesPerNonZero() << "," << stats.leafFill()
+        << "," << stats.rssBytes << std::endl;
+    out.flags(flags);
+    out.precision(precision);
+}
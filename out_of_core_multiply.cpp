@@ -0,0 +1,72 @@
+#include <openvdb/openvdb.h>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "matrix_cache.h"
+#include "streaming_multiply.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Function to return a .vdb file holding the given matrix: .vdb files are used as they are, .mtx files through their
+// sidecar cache, which is written on the first run (this conversion still needs the matrix in memory once)
+string matrixVdbPath(const string &filename)
+{
+    if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".vdb") == 0)
+    {
+        return filename;
+    }
+
+    int rows = 0, cols = 0;
+    readMatrixGridCached(filename, rows, cols);
+    return matrixCachePath(filename);
+}
+
+int main(int argc, char *argv[])
+{
+    // Initialize OpenVDB library
+    openvdb::initialize();
+
+    if (argc < 5)
+    {
+        cerr << "Usage: " << argv[0] << " A.mtx|A.vdb B.mtx|B.vdb C.mtx|C.vdb budget_mb [--paged]" << endl;
+        return 1;
+    }
+
+    StreamingOptions options;
+    options.memoryBudget = static_cast<size_t>(atof(argv[4]) * (1 << 20));
+    options.pagedB = argc > 5 && string(argv[5]) == "--paged";
+    options.deterministic = true;
+
+    string fileA = matrixVdbPath(argv[1]);
+    string fileB = matrixVdbPath(argv[2]);
+
+    auto start = high_resolution_clock::now();
+    StreamingReport report;
+    try
+    {
+        report = multiplyMatricesStreaming(fileA, fileB, argv[3], options);
+    }
+    catch (const openvdb::Exception &e)
+    {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+    auto stop = high_resolution_clock::now();
+
+    printStreamingReport(cout, report);
+    if (!report.outputs.empty())
+    {
+        cout << "Output :: " << report.outputs.front();
+        if (report.outputs.size() > 1)
+        {
+            cout << " ... " << report.outputs.back();
+        }
+        cout << endl;
+    }
+    cout << "Time taken for streaming multiplication :: " << duration_cast<milliseconds>(stop - start).count() << "ms" << endl;
+
+    return report.withinBudget() ? 0 : 2;
+}
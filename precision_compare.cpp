@@ -0,0 +1,77 @@
+#include <openvdb/openvdb.h>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cmath>
+#include <tuple>
+#include <vector>
+
+#include "grid_builder.h"
+#include "matrix_generator.h"
+#include "matrix_trace.h"
+#include "sparse_multiply.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Function to generate a sparse matrix with a unit-range diagonal and 9 small off-diagonal entries per row
+vector<tuple<int, int, double>> makeMatrix(int n, uint64_t seed)
+{
+    MatrixGeneratorOptions options;
+    options.seed = seed;
+    return generateMatrixTriplets(n, options);
+}
+
+// Function to store A and B in one grid type and report their memory and trace(A*B) with float and double sums
+template <typename GridType>
+void comparePrecision(const char *name, const vector<tuple<int, int, double>> &tripletsA,
+                      const vector<tuple<int, int, double>> &tripletsB, double reference)
+{
+    typename GridType::Ptr A = buildGridFromTriplets<SliceLayout, GridType>(tripletsA);
+    typename GridType::Ptr B = buildGridFromTriplets<SliceLayout, GridType>(tripletsB);
+
+    auto start1 = high_resolution_clock::now();
+    float traceFloat = traceOfProduct<SliceLayout, float>(A, B, true);
+    auto stop1 = high_resolution_clock::now();
+
+    auto start2 = high_resolution_clock::now();
+    double traceDouble = traceOfProduct<SliceLayout, double>(A, B, true);
+    auto stop2 = high_resolution_clock::now();
+
+    cout << "  " << name << endl;
+    cout << "    Memory of A :: " << A->memUsage() << " bytes" << endl;
+    cout << "    Trace with float sums :: " << traceFloat << " (error " << abs(traceFloat - reference) << ", "
+         << duration_cast<milliseconds>(stop1 - start1).count() << "ms)" << endl;
+    cout << "    Trace with double sums :: " << traceDouble << " (error " << abs(traceDouble - reference) << ", "
+         << duration_cast<milliseconds>(stop2 - start2).count() << "ms)" << endl;
+}
+
+int main()
+{
+    // Initialize OpenVDB library
+    openvdb::initialize();
+
+    cout << setprecision(12);
+
+    for (int n = 10000; n <= 40000; n *= 2)
+    {
+        vector<tuple<int, int, double>> tripletsA = makeMatrix(n, 1);
+        vector<tuple<int, int, double>> tripletsB = makeMatrix(n, 2);
+
+        // Double storage with double sums is the reference every other combination is measured against
+        openvdb::DoubleGrid::Ptr A = buildGridFromTriplets<SliceLayout, openvdb::DoubleGrid>(tripletsA);
+        openvdb::DoubleGrid::Ptr B = buildGridFromTriplets<SliceLayout, openvdb::DoubleGrid>(tripletsB);
+        double reference = traceOfProduct<SliceLayout, double>(A, B, true);
+
+        cout << endl
+             << "For " << n << " by " << n << ", reference trace " << reference << endl;
+
+        comparePrecision<openvdb::DoubleGrid>("DoubleGrid", tripletsA, tripletsB, reference);
+        comparePrecision<openvdb::FloatGrid>("FloatGrid", tripletsA, tripletsB, reference);
+#ifdef MATRIX_HAS_HALF_GRID
+        comparePrecision<openvdb::HalfGrid>("HalfGrid", tripletsA, tripletsB, reference);
+#endif
+    }
+
+    return 0;
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <tbb/task_arena.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Work done by a product kernel
+struct ProductWork
+{
+    uint64_t rows = 0;       // rows of the result finished
+    uint64_t products = 0;   // scalar multiply-adds
+    uint64_t skipped = 0;    // entries of A or B left out by a threshold or a tile filter
+    uint64_t insertions = 0; // values written into the result tree
+    uint64_t leaves = 0;     // leaf nodes allocated in the result tree
+};
+
+// Per-thread work counters for the product kernels.
+// Every worker thread owns a cache-line-sized slot and updates it with a relaxed load and store rather than an atomic
+// read-modify-write, so counting costs the hot loop no more than a few plain adds and never bounces a cache line between
+// threads. Any thread may read the totals while the product runs, e.g. a ProgressReporter. Threads outside the arena
+// the counters were made in share one extra slot, which is updated atomically.
+class ProductCounters
+{
+public:
+    ProductCounters() : mNumSlots(tbb::this_task_arena::max_concurrency()), mSlots(new Slot[mNumSlots]) {}
+
+    ProductCounters(const ProductCounters &) = delete;
+    ProductCounters &operator=(const ProductCounters &) = delete;
+
+    // Function to add work to the calling thread's slot
+    void add(const ProductWork &work)
+    {
+        int index = tbb::this_task_arena::current_thread_index();
+        if (index >= 0 && index < mNumSlots)
+        {
+            Slot &slot = mSlots[index];
+            bump(slot.rows, work.rows);
+            bump(slot.products, work.products);
+            bump(slot.skipped, work.skipped);
+            bump(slot.insertions, work.insertions);
+            bump(slot.leaves, work.leaves);
+        }
+        else
+        {
+            mShared.rows.fetch_add(work.rows, std::memory_order_relaxed);
+            mShared.products.fetch_add(work.products, std::memory_order_relaxed);
+            mShared.skipped.fetch_add(work.skipped, std::memory_order_relaxed);
+            mShared.insertions.fetch_add(work.insertions, std::memory_order_relaxed);
+            mShared.leaves.fetch_add(work.leaves, std::memory_order_relaxed);
+        }
+    }
+
+    // Function to sum the work of all threads so far
+    ProductWork total() const
+    {
+        ProductWork work;
+        for (int n = 0; n <= mNumSlots; ++n)
+        {
+            const Slot &slot = n < mNumSlots ? mSlots[n] : mShared;
+            work.rows += slot.rows.load(std::memory_order_relaxed);
+            work.products += slot.products.load(std::memory_order_relaxed);
+            work.skipped += slot.skipped.load(std::memory_order_relaxed);
+            work.insertions += slot.insertions.load(std::memory_order_relaxed);
+            work.leaves += slot.leaves.load(std::memory_order_relaxed);
+        }
+        return work;
+    }
+
+private:
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> rows{0}, products{0}, skipped{0}, insertions{0}, leaves{0};
+    };
+
+    // Single-writer increment: the owner is the only thread that stores to the counter
+    static void bump(std::atomic<uint64_t> &counter, uint64_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    int mNumSlots;
+    std::unique_ptr<Slot[]> mSlots;
+    Slot mShared;
+};
+
+// Background thread that samples a set of product counters at a fixed interval and prints the progress, the rate and
+// an estimate of the time left. The kernels never wait on it; it stops, printing a last line, when stop() is called or
+// the reporter goes out of scope.
+class ProgressReporter
+{
+public:
+    ProgressReporter(const ProductCounters &counters, uint64_t totalRows,
+                     std::chrono::milliseconds interval = std::chrono::milliseconds(1000), std::ostream &out = std::cerr)
+        : mCounters(counters), mTotalRows(totalRows), mInterval(interval), mOut(out),
+          mStart(std::chrono::steady_clock::now())
+    {
+        mThread = std::thread([this] { run(); });
+    }
+
+    ~ProgressReporter() { stop(); }
+
+    ProgressReporter(const ProgressReporter &) = delete;
+    ProgressReporter &operator=(const ProgressReporter &) = delete;
+
+    // Function to stop sampling and print the final totals
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mStopped)
+            {
+                return;
+            }
+            mStopped = true;
+        }
+        mWake.notify_one();
+        mThread.join();
+        print();
+    }
+
+private:
+    // Function to print one progress line
+    void print()
+    {
+        using namespace std::chrono;
+
+        ProductWork work = mCounters.total();
+        double seconds = duration<double>(steady_clock::now() - mStart).count();
+        double fraction = mTotalRows > 0 ? std::min(1.0, static_cast<double>(work.rows) / mTotalRows) : 1.0;
+
+        std::ios::fmtflags flags = mOut.flags();
+        std::streamsize precision = mOut.precision();
+        mOut << std::setprecision(3) << "Progress :: " << 100.0 * fraction << "% of rows, "
+             << static_cast<double>(work.products) << " products (" << (seconds > 0.0 ? work.products / seconds : 0.0)
+             << "/s), " << static_cast<double>(work.skipped) << " skipped, " << static_cast<double>(work.insertions)
+             << " insertions, " << work.leaves << " leaves";
+        if (fraction > 0.0 && fraction < 1.0)
+        {
+            mOut << ", ETA " << seconds * (1.0 - fraction) / fraction << "s";
+        }
+        mOut << std::endl;
+        mOut.flags(flags);
+        mOut.precision(precision);
+    }
+
+    // Function run by the sampling thread
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (!mWake.wait_for(lock, mInterval, [this] { return mStopped; }))
+        {
+            print();
+        }
+    }
+
+    const ProductCounters &mCounters;
+    uint64_t mTotalRows;
+    std::chrono::milliseconds mInterval;
+    std::ostream &mOut;
+    std::chrono::steady_clock::time_point mStart;
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    bool mStopped = false;
+    std::thread mThread;
+};
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "csr_matrix.h"
+#include "matrix_compare.h"
+#include "matrix_trace.h"
+#include "sparse_multiply.h"
+
+#include <openvdb/openvdb.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Update applied to the normalized density matrix D = P / occupation in every iteration
+enum class PurificationMethod
+{
+    McWeeny,        // D <- 3 DSD - 2 DSDSD; keeps trace(DS) once D is close to idempotent
+    TraceCorrecting // D <- DSD or 2D - DSD, whichever moves trace(DS) towards the number of occupied orbitals; the
+                    // eigenvalues of DS must lie in [0, 1], e.g. for a guess scaled from the Hamiltonian
+};
+
+// Function to look up a purification method by its name ("mcweeny" or "tc2")
+inline bool purificationMethodFromName(const std::string &name, PurificationMethod &method)
+{
+    if (name == "mcweeny")
+    {
+        method = PurificationMethod::McWeeny;
+    }
+    else if (name == "tc2")
+    {
+        method = PurificationMethod::TraceCorrecting;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+struct PurificationOptions
+{
+    PurificationMethod method = PurificationMethod::McWeeny;
+    double occupation = 2.0;  // electrons per orbital, i.e. P S P = occupation * P once converged
+    double eps = 1e-7;        // entries of every product and update smaller in magnitude are dropped
+    double tolerance = 1e-5;  // converged once ||DSD - D||_F falls below this
+    double stallBelow = 0.1;  // stop when the error stops falling, once max |DSD - D| is below this
+    int maxIterations = 50;
+    double occupiedOrbitals = -1.0; // trace(DS) that TraceCorrecting steers to; the initial trace rounded if negative
+};
+
+// What one iteration measured on the iterate D it started from
+struct PurificationStep
+{
+    int iteration = 0;
+    double electrons = 0.0;        // trace(PS) = occupation * trace(DS)
+    double idempotencyError = 0.0; // ||DSD - D||_F
+    double maxError = 0.0;         // max |DSD - D|
+    size_t nonZeros = 0;           // of D
+    double fill = 0.0;             // nonZeros / n^2
+    double seconds = 0.0;          // for the products, measurements and update of the iteration
+    bool squared = false;          // TraceCorrecting: D <- DSD was taken rather than 2D - DSD
+};
+
+template <typename ValueType>
+struct PurificationResultT
+{
+    CsrMatrixT<ValueType> P; // the last iterate times occupation
+    std::vector<PurificationStep> steps;
+    bool converged = false;
+};
+
+// Function to purify a density matrix P towards idempotency in the metric S, i.e. until P S P = occupation * P.
+// Every iteration forms DS = D*S and DSD = DS*D in compressed rows with multiplyCsrInto, measures trace(DS) and
+// ||DSD - D|| on them, and then updates D by the chosen method; McWeeny takes one more product, DS*DSD. Entries below
+// options.eps are dropped from every product and update, which keeps the iterates sparse as long as the density matrix
+// decays. Iteration stops once the idempotency error is below options.tolerance, or when it has not fallen over two
+// iterations (the floor set by eps and the storage precision), or after options.maxIterations. The early iterations
+// from a rough guess may raise the error, trace correction in particular, so stalling is only checked once every
+// entry of DSD - D is below options.stallBelow.
+// The products and updates write into matrices and scratch buffers owned by the call, so once the iterates have
+// reached their steady size an iteration allocates no memory. Rows are summed in a fixed order, so every run takes the
+// same steps.
+template <typename AccumType = double, typename ValueType>
+inline PurificationResultT<ValueType> purifyDensityMatrix(const CsrMatrixT<ValueType> &P, const CsrMatrixT<ValueType> &S,
+                                                          const PurificationOptions &options = PurificationOptions())
+{
+    using namespace std::chrono;
+
+    const int n = P.rows;
+    if (P.cols != n || S.rows != n || S.cols != n)
+    {
+        OPENVDB_THROW(openvdb::ValueError, "cannot purify a " << P.rows << "x" << P.cols << " density matrix in a "
+                                                              << S.rows << "x" << S.cols << " metric");
+    }
+
+    CsrMatrixT<ValueType> D, DS, DSD, DSDSD, next;
+    CsrProductBuffersT<ValueType, AccumType> buffers(n);
+    scaleCsrInto(1.0 / options.occupation, P, D);
+
+    PurificationResultT<ValueType> result;
+    result.steps.reserve(options.maxIterations);
+    double occupied = options.occupiedOrbitals;
+    for (int iteration = 0; iteration < options.maxIterations; ++iteration)
+    {
+        auto start = steady_clock::now();
+
+        multiplyCsrInto(D, S, DS, buffers, 0.0, options.eps);
+        multiplyCsrInto(DS, D, DSD, buffers, 0.0, options.eps);
+
+        PurificationStep step;
+        step.iteration = iteration;
+        double trace = traceOfCsr<double>(DS, true);
+        step.electrons = options.occupation * trace;
+        MatrixDifference error = compareCsr(DSD, D);
+        step.idempotencyError = error.frobenius();
+        step.maxError = error.maxAbs;
+        step.nonZeros = D.nonZeros();
+        step.fill = n > 0 ? static_cast<double>(D.nonZeros()) / (static_cast<double>(n) * n) : 0.0;
+
+        bool converged = step.idempotencyError < options.tolerance;
+        bool diverged = !std::isfinite(step.idempotencyError); // e.g. trace correction from a spectrum outside [0, 1]
+        bool stalled = result.steps.size() >= 2 && step.maxError < options.stallBelow &&
+                       step.idempotencyError >= result.steps[result.steps.size() - 2].idempotencyError;
+        if (!converged && !stalled && !diverged)
+        {
+            if (options.method == PurificationMethod::McWeeny)
+            {
+                multiplyCsrInto(DS, DSD, DSDSD, buffers, 0.0, options.eps);
+                addCsrInto(3.0, DSD, -2.0, DSDSD, next, options.eps);
+                std::swap(D, next);
+            }
+            else
+            {
+                if (occupied < 0.0)
+                {
+                    occupied = std::round(trace);
+                }
+                step.squared = trace > occupied;
+                if (step.squared)
+                {
+                    std::swap(D, DSD);
+                }
+                else
+                {
+                    addCsrInto(2.0, D, -1.0, DSD, next, options.eps);
+                    std::swap(D, next);
+                }
+            }
+        }
+
+        step.seconds = duration<double>(steady_clock::now() - start).count();
+        result.steps.push_back(step);
+        if (converged || stalled || diverged)
+        {
+            result.converged = converged;
+            break;
+        }
+    }
+
+    scaleCsrInto(options.occupation, D, result.P);
+    return result;
+}
+
+// Function to purify a density matrix grid in the metric of an overlap grid, as above. Both grids are read into
+// compressed rows once and every iteration runs on those: an iteration takes three products and two sums of matrices
+// whose pattern changes from one iteration to the next, which compressed rows reuse in place while a grid would be
+// rebuilt. The purified matrix is returned in compressed rows, ready for writeMatrixMarket.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline PurificationResultT<typename GridType::ValueType> purifyDensityMatrix(openvdb::SharedPtr<GridType> P,
+                                                                             openvdb::SharedPtr<GridType> S,
+                                                                             const PurificationOptions &options =
+                                                                                 PurificationOptions())
+{
+    int rowsP = 0, colsP = 0, rowsS = 0, colsS = 0;
+    matrixExtent<Layout>(*P, rowsP, colsP);
+    matrixExtent<Layout>(*S, rowsS, colsS);
+    int n = std::max({rowsP, colsP, rowsS, colsS});
+
+    return purifyDensityMatrix<AccumType>(gridToCsr<Layout>(*P, n, n), gridToCsr<Layout>(*S, n, n), options);
+}
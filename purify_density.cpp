@@ -0,0 +1,121 @@
+#include <openvdb/openvdb.h>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "csr_matrix.h"
+#include "matrix_market.h"
+#include "matrix_market_writer.h"
+#include "purification.h"
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+    // Initialize OpenVDB library
+    openvdb::initialize();
+
+    if (argc < 3)
+    {
+        cerr << "Usage: " << argv[0] << " P.mtx S.mtx [--method mcweeny|tc2] [--eps value] [--tolerance value]"
+             << " [--max-iterations n] [--occupation value] [--electrons value] [--out P_purified.mtx]" << endl;
+        return 1;
+    }
+
+    PurificationOptions options;
+    string output;
+    double electrons = -1.0;
+    for (int a = 3; a < argc; ++a)
+    {
+        string name = argv[a];
+        if (a + 1 >= argc)
+        {
+            cerr << "Error: Missing value for " << name << endl;
+            return 1;
+        }
+        string value = argv[++a];
+
+        if (name == "--method")
+        {
+            if (!purificationMethodFromName(value, options.method))
+            {
+                cerr << "Error: Unknown method " << value << endl;
+                return 1;
+            }
+        }
+        else if (name == "--eps")
+        {
+            options.eps = atof(value.c_str());
+        }
+        else if (name == "--tolerance")
+        {
+            options.tolerance = atof(value.c_str());
+        }
+        else if (name == "--max-iterations")
+        {
+            options.maxIterations = atoi(value.c_str());
+        }
+        else if (name == "--occupation")
+        {
+            options.occupation = atof(value.c_str());
+        }
+        else if (name == "--electrons")
+        {
+            electrons = atof(value.c_str());
+        }
+        else if (name == "--out")
+        {
+            output = value;
+        }
+        else
+        {
+            cerr << "Error: Unknown option " << name << endl;
+            return 1;
+        }
+    }
+
+    if (electrons >= 0.0)
+    {
+        options.occupiedOrbitals = electrons / options.occupation;
+    }
+
+    // Read matrices P and S from files
+    int rowsP = 0, colsP = 0;
+    int rowsS = 0, colsS = 0;
+    vector<tuple<int, int, double>> matrixP = readMatrixTriplets(argv[1], rowsP, colsP);
+    vector<tuple<int, int, double>> matrixS = readMatrixTriplets(argv[2], rowsS, colsS);
+
+    CsrMatrix P = tripletsToCsr(matrixP, rowsP, colsP);
+    CsrMatrix S = tripletsToCsr(matrixS, rowsS, colsS);
+
+    PurificationResultT<float> result = purifyDensityMatrix(P, S, options);
+
+    cout << "Iteration        trace(PS)  ||PSP/occ - P||_F   max error   non-zeros      fill     time" << endl;
+    double total = 0.0;
+    for (const PurificationStep &step : result.steps)
+    {
+        total += step.seconds;
+        cout << setw(9) << step.iteration << setw(17) << fixed << setprecision(8) << step.electrons << setw(19)
+             << scientific << setprecision(3) << step.idempotencyError << setw(12) << step.maxError << setw(12)
+             << step.nonZeros << setw(10) << fixed << setprecision(4) << step.fill << setw(8) << setprecision(0)
+             << step.seconds * 1e3 << "ms";
+        if (options.method == PurificationMethod::TraceCorrecting && &step != &result.steps.back())
+        {
+            cout << (step.squared ? "  D <- DSD" : "  D <- 2D - DSD");
+        }
+        cout << endl;
+    }
+    cout << (result.converged ? "Converged" : "Not converged") << " after " << result.steps.size() << " iterations in "
+         << fixed << setprecision(0) << total * 1e3 << "ms" << endl;
+
+    if (!output.empty())
+    {
+        writeMatrixMarket(output, result.P);
+        cout << "Purified density matrix written to " << output << endl;
+    }
+
+    return 0;
+}
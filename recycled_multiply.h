@@ -0,0 +1,288 @@
+#pragma once
+
+#include "csr_matrix.h"
+#include "matrix_layout.h"
+#include "matrix_transpose.h"
+#include "sparse_multiply.h"
+
+#include <openvdb/openvdb.h>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// Pool of leaf nodes taken from grids that are no longer needed, handed out again in place of new leaves.
+// The taker gives a leaf its origin and clears it, after which it is as good as a new one. The pool owns
+// the leaves it holds and deletes them when it is destroyed.
+template <typename LeafType>
+class LeafPoolT
+{
+public:
+    using ValueType = typename LeafType::ValueType;
+
+    LeafPoolT() = default;
+    LeafPoolT(const LeafPoolT &) = delete;
+    LeafPoolT &operator=(const LeafPoolT &) = delete;
+
+    ~LeafPoolT()
+    {
+        for (LeafType *leaf : mLeaves)
+        {
+            delete leaf;
+        }
+    }
+
+    // Function to move every leaf of a grid into the pool. The grid keeps its internal nodes, which are left holding
+    // inactive background tiles, so a product written into it later reuses its upper tree as well as the pooled leaves.
+    template <typename GridType>
+    void recycle(GridType &grid)
+    {
+        grid.tree().stealNodes(mLeaves, grid.tree().background(), false);
+    }
+
+    // Function to take back a single leaf the caller owns, e.g. one stolen from a tree
+    void release(LeafType *leaf) { mLeaves.push_back(leaf); }
+
+    // Function to move up to count pooled leaves to the end of leaves, as they are; the caller owns them and must give
+    // each an origin and clear its values, e.g. in parallel. Returns how many were moved.
+    size_t take(size_t count, std::vector<LeafType *> &leaves)
+    {
+        const size_t taken = std::min(count, mLeaves.size());
+        leaves.insert(leaves.end(), mLeaves.end() - taken, mLeaves.end());
+        mLeaves.resize(mLeaves.size() - taken);
+        return taken;
+    }
+
+    size_t size() const { return mLeaves.size(); }
+    bool empty() const { return mLeaves.empty(); }
+
+private:
+    std::vector<LeafType *> mLeaves;
+};
+
+// Everything multiplyMatricesInto allocates, kept between calls: the inputs in compressed rows, the leaf lists of the
+// conversions and of the result, one sparse accumulator per thread, the entries that found no leaf in the result with
+// the leaves made for them, and the pool new leaves are taken from and unused ones returned to. Once a sequence of
+// products has settled on its sparsity pattern, every product after that reuses this memory and allocates nothing.
+template <typename GridType, typename AccumType = double>
+struct ProductWorkspaceT
+{
+    using ValueType = typename GridType::ValueType;
+    using LeafType = typename GridType::TreeType::LeafNodeType;
+
+    CsrMatrixT<ValueType> csrA, csrB;
+    GridCsrScratchT<LeafType> scratch;
+    std::vector<LeafType *> resultLeaves;
+    tbb::enumerable_thread_specific<SparseAccumulatorT<AccumType>> accumulators;
+    tbb::enumerable_thread_specific<std::vector<std::pair<openvdb::Coord, ValueType>>> missing;
+    std::vector<std::pair<openvdb::Coord, ValueType>> inserts;
+    std::vector<size_t> insertStart;
+    std::vector<LeafType *> addedLeaves;
+    LeafPoolT<LeafType> pool;
+
+    ProductWorkspaceT() : accumulators([] { return SparseAccumulatorT<AccumType>(0); }) {}
+
+    ProductWorkspaceT(const ProductWorkspaceT &) = delete;
+    ProductWorkspaceT &operator=(const ProductWorkspaceT &) = delete;
+};
+
+// Function to multiply two submatrix views into an existing result grid C, which ends up holding A*B numbered from
+// (0, 0) with the same values as multiplyMatricesParallel. C keeps its tree: the values of its leaves are cleared and
+// the product is written into them, so a sequence of products with a stable sparsity pattern, e.g. the iterations of a
+// benchmark or a purification, reuses the leaves and internal nodes of the product before it. Rows are multiplied in
+// parallel in leaf-high blocks, each of which owns the leaves at its x origin. Entries that fall outside C's leaves,
+// e.g. all of them on the first product into an empty grid, are then sorted by leaf and written into leaves taken from
+// the workspace pool or allocated, all in parallel, and only linking them into the tree is serial. Leaves the new
+// product no longer uses are stolen from C into the pool, so C holds no leaf without an active value.
+// C must not be one of the inputs. Products from the same workspace never run concurrently.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline void multiplyMatricesInto(const MatrixViewT<GridType> &A, const MatrixViewT<GridType> &B, GridType &C,
+                                 ProductWorkspaceT<GridType, AccumType> &workspace, double threshold = 0.0)
+{
+    using ValueType = typename GridType::ValueType;
+    using LeafType = typename GridType::TreeType::LeafNodeType;
+
+    if (A.cols != B.rows)
+    {
+        OPENVDB_THROW(openvdb::ValueError, "cannot multiply a " << A.rows << "x" << A.cols << " view by a " << B.rows << "x"
+                                                                << B.cols << " view");
+    }
+    if (A.grid.get() == &C || B.grid.get() == &C)
+    {
+        OPENVDB_THROW(openvdb::ValueError, "cannot multiply into a grid that is also an input");
+    }
+
+    gridToCsrInto<Layout>(*A.grid, workspace.csrA, workspace.scratch, A.rows, A.cols, A.firstRow, A.firstCol);
+    gridToCsrInto<Layout>(*B.grid, workspace.csrB, workspace.scratch, B.rows, B.cols, B.firstRow, B.firstCol);
+    const CsrMatrixT<ValueType> &csrA = workspace.csrA;
+    const CsrMatrixT<ValueType> &csrB = workspace.csrB;
+    const int rows = A.rows, cols = B.cols;
+
+    // Tag C only when its tags change, since every tag written is a new metadata object
+    openvdb::StringMetadata::ConstPtr layout = C.template getMetadata<openvdb::StringMetadata>("matrix_layout");
+    if (!layout || layout->value() != Layout::name())
+    {
+        setMatrixLayout<Layout>(C);
+    }
+    if (isMatrixSymmetric(C))
+    {
+        setMatrixSymmetric(C, false);
+    }
+
+    // Clear the old product, keeping its leaves where they are
+    typename GridType::TreeType &tree = C.tree();
+    const ValueType background = tree.background();
+    std::vector<LeafType *> &leaves = workspace.resultLeaves;
+    leaves.clear();
+    tree.getNodes(leaves);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, leaves.size()), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t n = range.begin(); n != range.end(); ++n)
+        {
+            leaves[n]->fill(background, false);
+        }
+    });
+
+    for (SparseAccumulatorT<AccumType> &spa : workspace.accumulators)
+    {
+        spa.reset(cols);
+    }
+    for (std::vector<std::pair<openvdb::Coord, ValueType>> &entries : workspace.missing)
+    {
+        entries.clear();
+    }
+
+    // A block of TILE_ROWS rows writes only to the leaves at its own x origin, so blocks never share a leaf, and the
+    // tree is not changed while they run, so looking leaves up is safe from every thread
+    const int blockRows = Layout::TILE_ROWS;
+    const int numBlocks = (rows + blockRows - 1) / blockRows;
+    const openvdb::Int32 leafMask = ~static_cast<openvdb::Int32>(LeafType::DIM - 1);
+    tbb::parallel_for(tbb::blocked_range<int>(0, numBlocks), [&](const tbb::blocked_range<int> &range)
+    {
+        SparseAccumulatorT<AccumType> &spa = workspace.accumulators.local();
+        if (spa.values.size() < static_cast<size_t>(cols))
+        {
+            spa.reset(cols); // made by this call
+        }
+        std::vector<std::pair<openvdb::Coord, ValueType>> &missing = workspace.missing.local();
+
+        LeafType *leaf = nullptr;
+        openvdb::Coord origin(openvdb::Coord::max());
+        for (int i = range.begin() * blockRows; i < std::min(rows, range.end() * blockRows); ++i)
+        {
+            accumulateRow(csrA, csrB, i, threshold, spa);
+            for (int j : spa.touched)
+            {
+                const openvdb::Coord xyz = Layout::toCoord(i, j);
+                const ValueType value = static_cast<ValueType>(spa.values[j]);
+                if ((xyz & leafMask) != origin)
+                {
+                    origin = xyz & leafMask;
+                    leaf = tree.probeLeaf(xyz);
+                }
+                if (leaf)
+                {
+                    leaf->setValueOn(LeafType::coordToOffset(xyz), value);
+                }
+                else
+                {
+                    missing.emplace_back(xyz, value);
+                }
+            }
+        }
+    });
+
+    // Entries outside C's leaves, i.e. where the sparsity pattern has grown, are grouped by leaf; the new leaves are
+    // taken from the pool or allocated and filled in parallel, each by a single task, then linked into the tree
+    std::vector<std::pair<openvdb::Coord, ValueType>> &inserts = workspace.inserts;
+    inserts.clear();
+    for (const std::vector<std::pair<openvdb::Coord, ValueType>> &entries : workspace.missing)
+    {
+        inserts.insert(inserts.end(), entries.begin(), entries.end());
+    }
+    tbb::parallel_sort(inserts.begin(), inserts.end(), [leafMask](const std::pair<openvdb::Coord, ValueType> &a,
+                                                                  const std::pair<openvdb::Coord, ValueType> &b)
+    {
+        return (a.first & leafMask) != (b.first & leafMask) ? (a.first & leafMask) < (b.first & leafMask) : a.first < b.first;
+    });
+
+    std::vector<size_t> &insertStart = workspace.insertStart;
+    insertStart.clear();
+    for (size_t n = 0; n < inserts.size(); ++n)
+    {
+        if (n == 0 || (inserts[n].first & leafMask) != (inserts[n - 1].first & leafMask))
+        {
+            insertStart.push_back(n);
+        }
+    }
+    insertStart.push_back(inserts.size());
+    const size_t numAdded = insertStart.size() - 1;
+
+    std::vector<LeafType *> &added = workspace.addedLeaves;
+    added.clear();
+    const size_t pooled = workspace.pool.take(numAdded, added);
+    added.resize(numAdded, nullptr);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numAdded), [&](const tbb::blocked_range<size_t> &range)
+    {
+        for (size_t l = range.begin(); l != range.end(); ++l)
+        {
+            const openvdb::Coord origin = inserts[insertStart[l]].first & leafMask;
+            if (l < pooled)
+            {
+                added[l]->setOrigin(origin);
+                added[l]->fill(background, false);
+            }
+            else
+            {
+                added[l] = new LeafType(origin, background);
+            }
+            for (size_t n = insertStart[l]; n < insertStart[l + 1]; ++n)
+            {
+                added[l]->setValueOn(LeafType::coordToOffset(inserts[n].first), inserts[n].second);
+            }
+        }
+    });
+    for (LeafType *leaf : added)
+    {
+        tree.addLeaf(leaf);
+    }
+
+    // Leaves of the old product that this one left empty go back to the pool; C's internal nodes stay
+    for (LeafType *leaf : leaves)
+    {
+        if (leaf->isEmpty())
+        {
+            workspace.pool.release(tree.root().template stealNode<LeafType>(leaf->origin(), background, false));
+        }
+    }
+}
+
+// Function to multiply two sparse matrices into an existing result grid C, as above. A is rows x n and B is n x cols,
+// where n is taken from the active voxels of both grids, as in multiplyMatricesParallel.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline void multiplyMatricesInto(openvdb::SharedPtr<GridType> A, openvdb::SharedPtr<GridType> B, GridType &C, int rows,
+                                 int cols, ProductWorkspaceT<GridType, AccumType> &workspace, double threshold = 0.0)
+{
+    int rowsA = 0, colsA = 0, rowsB = 0, colsB = 0;
+    matrixExtent<Layout>(*A, rowsA, colsA);
+    matrixExtent<Layout>(*B, rowsB, colsB);
+    int inner = std::max(colsA, rowsB);
+
+    multiplyMatricesInto<Layout, AccumType>(subMatrix(A, 0, rows, 0, inner), subMatrix(B, 0, inner, 0, cols), C, workspace,
+                                            threshold);
+}
+
+// Function to multiply the transpose of A by B into an existing result grid C, C = A^T * B, with the transpose of A
+// taken from a cache; a sequence of products against the same A, e.g. the projections of many blocks B onto one basis,
+// transposes A once and reuses both the transpose and the leaves of C. C is rows x cols. Otherwise the same contract as
+// multiplyMatricesInto.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline void multiplyTransposedMatricesInto(openvdb::SharedPtr<GridType> A, openvdb::SharedPtr<GridType> B, GridType &C,
+                                           int rows, int cols, ProductWorkspaceT<GridType, AccumType> &workspace,
+                                           TransposeCacheT<GridType> &cache, double threshold = 0.0)
+{
+    multiplyMatricesInto<Layout, AccumType>(cache.template transpose<Layout>(A), B, C, rows, cols, workspace, threshold);
+}
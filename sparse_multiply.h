@@ -0,0 +1,467 @@
+#pragma once
+
+#include "csr_matrix.h"
+#include "matrix_transpose.h"
+#include "product_counters.h"
+
+#include <openvdb/openvdb.h>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Sparse accumulator for one output row: dense partial sums indexed by column plus the columns touched so far.
+// Sums are kept in AccumType whatever the storage type of the inputs.
+template <typename AccumType>
+struct SparseAccumulatorT
+{
+    std::vector<AccumType> values;
+    std::vector<int> marker; // last row that touched each column
+    std::vector<int> touched;
+    uint64_t products = 0; // multiply-adds done by every row accumulated so far
+    uint64_t skipped = 0;  // entries of A or B those rows left out
+
+    explicit SparseAccumulatorT(int cols) : values(cols, AccumType(0)), marker(cols, -1) {}
+
+    // Function to make room for cols columns and forget the rows accumulated so far, so that the accumulator can be
+    // reused for another product. Memory is only allocated when cols is larger than any product before.
+    void reset(int cols)
+    {
+        if (values.size() < static_cast<size_t>(cols))
+        {
+            values.resize(cols, AccumType(0));
+        }
+        marker.assign(std::max(marker.size(), static_cast<size_t>(cols)), -1);
+    }
+};
+
+using SparseAccumulator = SparseAccumulatorT<double>;
+
+// Function to accumulate row i of A*B into the sparse accumulator.
+// Entries of A or B that are zero or smaller in magnitude than threshold are skipped.
+// On return spa.touched lists the nonzero columns of the row in ascending order, and the work of the row has been
+// added to spa.products and spa.skipped. With lastCol set only the columns up to lastCol are accumulated, and the
+// scan of every row of B stops there.
+template <typename ValueA, typename ValueB, typename AccumType>
+inline void accumulateRow(const CsrMatrixT<ValueA> &A, const CsrMatrixT<ValueB> &B, int i, double threshold,
+                          SparseAccumulatorT<AccumType> &spa, int lastCol = std::numeric_limits<int>::max())
+{
+    spa.touched.clear();
+    uint64_t products = 0, skipped = 0;
+
+    for (size_t p = A.rowStart[i]; p < A.rowStart[i + 1]; ++p)
+    {
+        int k = A.colIndex[p];
+        AccumType valueA = static_cast<AccumType>(A.values[p]);
+        if (k >= B.rows)
+        {
+            continue;
+        }
+        if (valueA == AccumType(0) || std::abs(valueA) < threshold)
+        {
+            ++skipped;
+            continue;
+        }
+
+        // Scale row k of B by A[i,k] and scatter it into the accumulator
+        size_t end = B.rowStart[k + 1];
+        if (lastCol < B.cols)
+        {
+            end = std::upper_bound(B.colIndex.begin() + B.rowStart[k], B.colIndex.begin() + end, lastCol) - B.colIndex.begin();
+        }
+        products += end - B.rowStart[k];
+        for (size_t q = B.rowStart[k]; q < end; ++q)
+        {
+            AccumType valueB = static_cast<AccumType>(B.values[q]);
+            if (valueB == AccumType(0) || std::abs(valueB) < threshold)
+            {
+                --products;
+                ++skipped;
+                continue;
+            }
+
+            int j = B.colIndex[q];
+            if (spa.marker[j] != i)
+            {
+                spa.marker[j] = i;
+                spa.values[j] = AccumType(0);
+                spa.touched.push_back(j);
+            }
+            spa.values[j] += valueA * valueB;
+        }
+    }
+
+    std::sort(spa.touched.begin(), spa.touched.end());
+    spa.products += products;
+    spa.skipped += skipped;
+}
+
+// Scratch space of multiplyCsrInto: the rows of every block of the product before they are packed, and one sparse
+// accumulator per thread. Passing the same buffers to a sequence of products, e.g. the iterations of a purification,
+// lets every product after the first reuse the memory of the ones before it.
+template <typename ValueType, typename AccumType = double>
+struct CsrProductBuffersT
+{
+    std::vector<std::vector<int>> blockCols;
+    std::vector<std::vector<ValueType>> blockValues;
+    tbb::enumerable_thread_specific<SparseAccumulatorT<AccumType>> accumulators;
+
+    explicit CsrProductBuffersT(int cols) : accumulators([cols] { return SparseAccumulatorT<AccumType>(cols); }) {}
+};
+
+// Function to multiply two compressed-row matrices into C, with the same row-wise product as multiplyMatrices.
+// Blocks of rows are multiplied in parallel into their own buffers and then packed into place. C and the buffers keep
+// their capacity from earlier calls, so once they have held a product this size no further memory is allocated.
+// Accumulators narrower than B are widened, so the buffers may be made for fewer columns than a later B has. Entries of
+// the product smaller in magnitude than dropTolerance are left out.
+template <typename ValueType, typename AccumType>
+inline void multiplyCsrInto(const CsrMatrixT<ValueType> &A, const CsrMatrixT<ValueType> &B, CsrMatrixT<ValueType> &C,
+                            CsrProductBuffersT<ValueType, AccumType> &buffers, double threshold = 0.0,
+                            double dropTolerance = 0.0)
+{
+    const int blockRows = 256;
+    const int numBlocks = (A.rows + blockRows - 1) / blockRows;
+
+    C.rows = A.rows;
+    C.cols = B.cols;
+    C.rowStart.assign(A.rows + 1, 0);
+
+    buffers.blockCols.resize(std::max<size_t>(buffers.blockCols.size(), numBlocks));
+    buffers.blockValues.resize(std::max<size_t>(buffers.blockValues.size(), numBlocks));
+
+    // A row number left in a marker by an earlier product would pass for a column already touched by this one
+    for (SparseAccumulatorT<AccumType> &spa : buffers.accumulators)
+    {
+        spa.reset(B.cols);
+    }
+
+    tbb::parallel_for(tbb::blocked_range<int>(0, numBlocks), [&](const tbb::blocked_range<int> &range)
+    {
+        SparseAccumulatorT<AccumType> &spa = buffers.accumulators.local();
+        if (spa.values.size() < static_cast<size_t>(B.cols))
+        {
+            spa.reset(B.cols); // made by this call for fewer columns than B has
+        }
+        for (int b = range.begin(); b != range.end(); ++b)
+        {
+            std::vector<int> &cols = buffers.blockCols[b];
+            std::vector<ValueType> &values = buffers.blockValues[b];
+            cols.clear();
+            values.clear();
+            for (int i = b * blockRows; i < std::min(A.rows, (b + 1) * blockRows); ++i)
+            {
+                accumulateRow(A, B, i, threshold, spa);
+                size_t before = cols.size();
+                for (int j : spa.touched)
+                {
+                    if (std::abs(spa.values[j]) < dropTolerance)
+                    {
+                        continue;
+                    }
+                    cols.push_back(j);
+                    values.push_back(static_cast<ValueType>(spa.values[j]));
+                }
+                C.rowStart[i + 1] = cols.size() - before;
+            }
+        }
+    });
+
+    for (int i = 0; i < A.rows; ++i)
+    {
+        C.rowStart[i + 1] += C.rowStart[i];
+    }
+
+    C.colIndex.resize(C.rowStart[A.rows]);
+    C.values.resize(C.rowStart[A.rows]);
+    tbb::parallel_for(0, numBlocks, [&](int b)
+    {
+        size_t offset = C.rowStart[b * blockRows];
+        std::copy(buffers.blockCols[b].begin(), buffers.blockCols[b].end(), C.colIndex.begin() + offset);
+        std::copy(buffers.blockValues[b].begin(), buffers.blockValues[b].end(), C.values.begin() + offset);
+    });
+}
+
+// Function to multiply two compressed-row matrices into a new one, as above
+template <typename AccumType = double, typename ValueType>
+inline CsrMatrixT<ValueType> multiplyCsr(const CsrMatrixT<ValueType> &A, const CsrMatrixT<ValueType> &B, double threshold = 0.0)
+{
+    CsrMatrixT<ValueType> C;
+    CsrProductBuffersT<ValueType, AccumType> buffers(B.cols);
+    multiplyCsrInto(A, B, C, buffers, threshold);
+    return C;
+}
+
+// Function to multiply two sparse matrices and return the result as an OpenVDB grid.
+// A is rows x n and B is n x cols, where n is taken from the active voxels of both grids.
+// Each row of the result is built with a row-wise (Gustavson) product, so the cost scales with the
+// number of nonzero products instead of rows * cols * cols. Both inputs and the result use the given layout and
+// grid type; products are summed in AccumType and rounded to the grid's value type once per entry.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline typename GridType::Ptr multiplyMatrices(openvdb::SharedPtr<GridType> A, openvdb::SharedPtr<GridType> B, int rows, int cols,
+                                               double threshold = 0.0)
+{
+    using ValueType = typename GridType::ValueType;
+
+    int rowsA = 0, colsA = 0, rowsB = 0, colsB = 0;
+    matrixExtent<Layout>(*A, rowsA, colsA);
+    matrixExtent<Layout>(*B, rowsB, colsB);
+    int inner = std::max(colsA, rowsB);
+
+    CsrMatrixT<ValueType> csrA = gridToCsr<Layout>(*A, rows, inner);
+    CsrMatrixT<ValueType> csrB = gridToCsr<Layout>(*B, inner, cols);
+
+    typename GridType::Ptr result = GridType::create(); // Create the result grid
+    setMatrixLayout<Layout>(*result);
+    typename GridType::Accessor accessorC = result->getAccessor();
+
+    SparseAccumulatorT<AccumType> spa(cols);
+    for (int i = 0; i < rows; ++i)
+    {
+        accumulateRow(csrA, csrB, i, threshold, spa);
+
+        // Write the finished row in column order so consecutive entries land in the same leaf
+        for (int j : spa.touched)
+        {
+            accessorC.setValue(Layout::toCoord(i, j), static_cast<ValueType>(spa.values[j]));
+        }
+    }
+
+    return result; // Return the result grid
+}
+
+// Function to merge partial result grids pairwise in parallel; the union of all of them ends up in grids[0].
+// The partial grids hold disjoint entries, so the merge only has to move leaves and fill in value masks.
+template <typename GridPtrType>
+inline void mergePartialGrids(std::vector<GridPtrType> &grids)
+{
+    for (size_t stride = 1; stride < grids.size(); stride *= 2)
+    {
+        tbb::parallel_for(size_t(0), grids.size(), 2 * stride, [&](size_t n)
+        {
+            if (n + stride < grids.size())
+            {
+                grids[n]->tree().merge(grids[n + stride]->tree(), openvdb::MERGE_ACTIVE_STATES);
+            }
+        });
+    }
+}
+
+// Function to assemble a product grid row by row on all TBB worker threads.
+// accumulate(i, spa) must leave row i of the product in spa; entries smaller in magnitude than dropTolerance are not
+// written. Rows are split across the workers in whole leaf-high blocks; each worker writes its rows into its own
+// result grid and the partial grids are merged in parallel at the end.
+// With deterministic set the row chunks and the merge order are fixed, so the result tree is assembled the same way
+// on every run. With firstRow set the rows [firstRow, firstRow + rows) are assembled instead, e.g. one row panel of a
+// larger product; firstRow should then be a multiple of Layout::TILE_ROWS so that panels never share a leaf.
+// With counters set the work of every finished block of rows is added to them.
+template <typename Layout, typename AccumType, typename GridType, typename RowOpType>
+inline typename GridType::Ptr assembleProductRows(int rows, int cols, double dropTolerance, bool deterministic,
+                                                  const RowOpType &accumulate, int firstRow = 0,
+                                                  ProductCounters *counters = nullptr)
+{
+    using ValueType = typename GridType::ValueType;
+
+    const int blockRows = Layout::TILE_ROWS;
+    const int deterministicChunk = 256; // row blocks per task in deterministic mode
+
+    const int numBlocks = (rows + blockRows - 1) / blockRows;
+
+    // Accumulators are only scratch space, so they are shared per thread in both modes
+    tbb::enumerable_thread_specific<SparseAccumulatorT<AccumType>> accumulators([cols]
+    {
+        return SparseAccumulatorT<AccumType>(cols);
+    });
+
+    // Function to multiply the row blocks [first, last) into a partial result grid
+    auto multiplyBlocks = [&](int first, int last, GridType &partial)
+    {
+        SparseAccumulatorT<AccumType> &spa = accumulators.local();
+        typename GridType::Accessor accessorC = partial.getAccessor();
+        const uint64_t leaves = counters ? partial.tree().leafCount() : 0;
+        for (int b = first; b < last; ++b)
+        {
+            ProductWork work;
+            work.products = spa.products;
+            work.skipped = spa.skipped;
+            for (int i = firstRow + b * blockRows; i < firstRow + std::min(rows, (b + 1) * blockRows); ++i)
+            {
+                accumulate(i, spa);
+                for (int j : spa.touched)
+                {
+                    if (std::abs(spa.values[j]) < dropTolerance)
+                    {
+                        continue;
+                    }
+                    accessorC.setValue(Layout::toCoord(i, j), static_cast<ValueType>(spa.values[j]));
+                    ++work.insertions;
+                }
+                ++work.rows;
+            }
+            if (counters)
+            {
+                work.products = spa.products - work.products;
+                work.skipped = spa.skipped - work.skipped;
+                counters->add(work);
+            }
+        }
+        if (counters)
+        {
+            ProductWork work;
+            work.leaves = partial.tree().leafCount() - leaves;
+            counters->add(work);
+        }
+    };
+
+    std::vector<typename GridType::Ptr> partials;
+    if (deterministic)
+    {
+        // One partial grid per fixed chunk of rows, independent of how many threads run them
+        const int numChunks = (numBlocks + deterministicChunk - 1) / deterministicChunk;
+        for (int c = 0; c < numChunks; ++c)
+        {
+            partials.push_back(GridType::create());
+        }
+        tbb::parallel_for(tbb::blocked_range<int>(0, numChunks, 1), [&](const tbb::blocked_range<int> &range)
+        {
+            for (int c = range.begin(); c != range.end(); ++c)
+            {
+                multiplyBlocks(c * deterministicChunk, std::min(numBlocks, (c + 1) * deterministicChunk), *partials[c]);
+            }
+        }, tbb::simple_partitioner());
+    }
+    else
+    {
+        // One partial grid per worker thread, load-balanced by work stealing
+        tbb::enumerable_thread_specific<typename GridType::Ptr> workerGrids([]
+        {
+            return GridType::create();
+        });
+        tbb::parallel_for(tbb::blocked_range<int>(0, numBlocks), [&](const tbb::blocked_range<int> &range)
+        {
+            multiplyBlocks(range.begin(), range.end(), *workerGrids.local());
+        });
+        for (typename GridType::Ptr &grid : workerGrids)
+        {
+            partials.push_back(grid);
+        }
+    }
+
+    if (partials.empty())
+    {
+        partials.push_back(GridType::create());
+    }
+
+    mergePartialGrids(partials);
+    setMatrixLayout<Layout>(*partials[0]);
+    return partials[0]; // Return the result grid
+}
+
+// Function to multiply two submatrix views on all TBB worker threads, e.g. one block of a loaded production matrix.
+// The result is A.rows x B.cols, numbered from (0, 0); only the leaves overlapping the two windows are read.
+// Otherwise the same contract as multiplyMatricesParallel below, which takes the whole grids as views.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline typename GridType::Ptr multiplyMatricesParallel(const MatrixViewT<GridType> &A, const MatrixViewT<GridType> &B,
+                                                       double threshold = 0.0, bool deterministic = false,
+                                                       ProductCounters *counters = nullptr)
+{
+    using ValueType = typename GridType::ValueType;
+
+    if (A.cols != B.rows)
+    {
+        OPENVDB_THROW(openvdb::ValueError, "cannot multiply a " << A.rows << "x" << A.cols << " view by a " << B.rows << "x"
+                                                                << B.cols << " view");
+    }
+
+    CsrMatrixT<ValueType> csrA = viewToCsr<Layout>(A);
+    CsrMatrixT<ValueType> csrB = viewToCsr<Layout>(B);
+
+    return assembleProductRows<Layout, AccumType, GridType>(A.rows, B.cols, 0.0, deterministic,
+                                                           [&](int i, SparseAccumulatorT<AccumType> &spa)
+    {
+        accumulateRow(csrA, csrB, i, threshold, spa);
+    }, 0, counters);
+}
+
+// Function to multiply two sparse matrices on all TBB worker threads.
+// Same contract as multiplyMatrices; the rows are assembled by assembleProductRows.
+// Every entry of C is summed by a single thread in A's column order, so values never depend on the thread count.
+// With deterministic set the result tree is also assembled the same way on every run, so any trace computed from it
+// is bitwise reproducible. With counters set the work done is added to them as the rows finish, e.g. for a
+// ProgressReporter.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline typename GridType::Ptr multiplyMatricesParallel(openvdb::SharedPtr<GridType> A, openvdb::SharedPtr<GridType> B, int rows,
+                                                       int cols, double threshold = 0.0, bool deterministic = false,
+                                                       ProductCounters *counters = nullptr)
+{
+    int rowsA = 0, colsA = 0, rowsB = 0, colsB = 0;
+    matrixExtent<Layout>(*A, rowsA, colsA);
+    matrixExtent<Layout>(*B, rowsB, colsB);
+    int inner = std::max(colsA, rowsB);
+
+    return multiplyMatricesParallel<Layout, AccumType>(subMatrix(A, 0, rows, 0, inner), subMatrix(B, 0, inner, 0, cols),
+                                                       threshold, deterministic, counters);
+}
+
+// Function to multiply the transpose of A by B on all TBB worker threads, C = A^T * B, with the transpose of A taken
+// from a cache; e.g. the projections of many blocks B onto the same basis A transpose A once. C is rows x cols.
+// Otherwise the same contract as multiplyMatricesParallel.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline typename GridType::Ptr multiplyTransposedMatrices(openvdb::SharedPtr<GridType> A, openvdb::SharedPtr<GridType> B,
+                                                         int rows, int cols, TransposeCacheT<GridType> &cache,
+                                                         double threshold = 0.0, bool deterministic = false,
+                                                         ProductCounters *counters = nullptr)
+{
+    return multiplyMatricesParallel<Layout, AccumType>(cache.template transpose<Layout>(A), B, rows, cols, threshold,
+                                                       deterministic, counters);
+}
+
+// Function to multiply two submatrix views whose product is known to be symmetric, e.g. A*A, A*B*A or a density
+// matrix times a function of itself, and return the product as a symmetric grid.
+// Only the lower triangle of C is accumulated: the scan of every row of B stops at the diagonal, which halves the
+// multiply-adds and the entries written, and the result holds one triangle as setMatrixSymmetric describes. Whether
+// C is really symmetric is up to the caller; nothing is checked. Otherwise the same contract as
+// multiplyMatricesParallel.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline typename GridType::Ptr multiplyMatricesSymmetric(const MatrixViewT<GridType> &A, const MatrixViewT<GridType> &B,
+                                                        double threshold = 0.0, bool deterministic = false,
+                                                        ProductCounters *counters = nullptr)
+{
+    using ValueType = typename GridType::ValueType;
+
+    if (A.cols != B.rows || A.rows != B.cols)
+    {
+        OPENVDB_THROW(openvdb::ValueError, "product of a " << A.rows << "x" << A.cols << " view and a " << B.rows << "x"
+                                                           << B.cols << " view is not square");
+    }
+
+    CsrMatrixT<ValueType> csrA = viewToCsr<Layout>(A);
+    CsrMatrixT<ValueType> csrB = viewToCsr<Layout>(B);
+
+    typename GridType::Ptr result = assembleProductRows<Layout, AccumType, GridType>(A.rows, B.cols, 0.0, deterministic,
+                                                                                    [&](int i, SparseAccumulatorT<AccumType> &spa)
+    {
+        accumulateRow(csrA, csrB, i, threshold, spa, i);
+    }, 0, counters);
+    setMatrixSymmetric(*result);
+    return result;
+}
+
+// Function to multiply two matrix grids whose product is known to be symmetric into an n x n symmetric grid, as above
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType>
+inline typename GridType::Ptr multiplyMatricesSymmetric(openvdb::SharedPtr<GridType> A, openvdb::SharedPtr<GridType> B, int n,
+                                                        double threshold = 0.0, bool deterministic = false,
+                                                        ProductCounters *counters = nullptr)
+{
+    int rowsA = 0, colsA = 0, rowsB = 0, colsB = 0;
+    matrixExtent<Layout>(*A, rowsA, colsA);
+    matrixExtent<Layout>(*B, rowsB, colsB);
+    int inner = std::max(colsA, rowsB);
+
+    return multiplyMatricesSymmetric<Layout, AccumType>(subMatrix(A, 0, n, 0, inner), subMatrix(B, 0, inner, 0, n), threshold,
+                                                        deterministic, counters);
+}
@@ -0,0 +1,153 @@
+#include <openvdb/openvdb.h>
+#include <tbb/global_control.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "benchmark_harness.h"
+#include "csr_matrix.h"
+#include "grid_builder.h"
+#include "matrix_layout.h"
+#include "matrix_vector.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Parameter grid of one benchmark run; every combination of dims x nnzPerRow x patterns is measured on every layout,
+// thread count and number of vectors
+struct BenchmarkConfig : BenchmarkOptions
+{
+    vector<int> vectors = {1, 4, 8, 16};
+    bool symmetric = false; // store only the lower triangle of a symmetric matrix
+
+    BenchmarkConfig()
+    {
+        dims = {20000};
+        warmup = 2;
+        reps = 10;
+    }
+};
+
+// Function to read the benchmark parameters from "--name value" pairs
+BenchmarkConfig parseArguments(int argc, char *argv[])
+{
+    BenchmarkConfig config;
+    parseBenchmarkArguments(argc, argv, config, [&](const string &name, const string &value)
+    {
+        if (name == "--vectors")
+        {
+            config.vectors = splitIntList(value);
+            return true;
+        }
+        if (name == "--symmetric")
+        {
+            config.symmetric = atoi(value.c_str()) != 0;
+            return true;
+        }
+        return false;
+    });
+    return config;
+}
+
+// Function to fill k interleaved vectors of n entries with fixed values in [0.5, 1]
+vector<double> makeVectors(int n, int k)
+{
+    vector<double> X(static_cast<size_t>(n) * k);
+    for (size_t p = 0; p < X.size(); ++p)
+    {
+        X[p] = 0.5 + 0.5 * static_cast<double>(p % 97) / 96.0;
+    }
+    return X;
+}
+
+// Function to time Y = A*X on the grid of one layout against the same product on the compressed-row copy of the matrix,
+// for every thread count and number of vectors, and check that the two agree
+template <typename Layout>
+void benchmarkLayout(const BenchmarkConfig &config, const vector<tuple<int, int, double>> &triplets, int n,
+                     const CsrMatrix &csr)
+{
+    openvdb::FloatGrid::Ptr A = buildGridFromTriplets<Layout>(triplets);
+    if (config.symmetric)
+    {
+        setMatrixSymmetric(*A);
+    }
+
+    auto start = steady_clock::now();
+    MatrixVectorPlanT<Layout, openvdb::FloatGrid> plan = planMatrixVector<Layout>(A);
+    auto stop = steady_clock::now();
+
+    cout << "  " << Layout::name() << " :: " << A->tree().leafCount() << " leaves, " << A->memUsage() << " bytes against "
+         << csr.memUsage() << " for compressed rows, plan built in " << duration_cast<milliseconds>(stop - start).count()
+         << "ms" << endl;
+
+    for (int threads : config.threads)
+    {
+        tbb::global_control control(tbb::global_control::max_allowed_parallelism, threads);
+        for (int k : config.vectors)
+        {
+            vector<double> X = makeVectors(n, k), gridY, csrY;
+            double gridMs = median(timePhase(config.warmup, config.reps, [&]
+            {
+                multiplyMatrixVectors(plan, X, gridY, k);
+            })) * 1e-6;
+            double csrMs = median(timePhase(config.warmup, config.reps, [&]
+            {
+                multiplyCsrVectors(csr, X, csrY, k);
+            })) * 1e-6;
+
+            double maxDiff = 0.0;
+            for (size_t p = 0; p < csrY.size(); ++p)
+            {
+                maxDiff = max(maxDiff, abs(gridY[p] - csrY[p]));
+            }
+
+            // Nanoseconds per multiply-add, i.e. per nonzero of the expanded matrix and vector
+            double products = static_cast<double>(csr.nonZeros()) * k;
+            cout << "    " << threads << " threads, " << k << " vectors :: grid " << gridMs << "ms ("
+                 << gridMs * 1e6 / products << "ns per product), CSR " << csrMs << "ms (" << csrMs * 1e6 / products
+                 << "ns per product), grid/CSR " << gridMs / csrMs << ", max difference " << maxDiff << endl;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // Initialize OpenVDB library
+    openvdb::initialize();
+
+    BenchmarkConfig config = parseArguments(argc, argv);
+
+    for (const string &pattern : config.patterns)
+    {
+        for (int n : config.dims)
+        {
+            for (int nnzPerRow : config.nnzPerRow)
+            {
+                // The compressed rows always hold the whole matrix; a symmetric grid keeps only the lower triangle
+                vector<tuple<int, int, double>> triplets = makeBenchmarkMatrix(n, nnzPerRow, pattern, config.seed, config.symmetric);
+                CsrMatrix csr = tripletsToCsr(triplets, n, n);
+                if (config.symmetric)
+                {
+                    triplets.erase(remove_if(triplets.begin(), triplets.end(), [](const tuple<int, int, double> &entry)
+                    {
+                        return get<0>(entry) < get<1>(entry);
+                    }), triplets.end());
+                }
+
+                cout << endl
+                     << pattern << " " << n << " by " << n << ", " << csr.nonZeros() << " non-zeros"
+                     << (config.symmetric ? ", symmetric" : "") << endl;
+                benchmarkLayout<SliceLayout>(config, triplets, n, csr);
+                benchmarkLayout<ColumnFoldLayout>(config, triplets, n, csr);
+                benchmarkLayout<TileFoldLayout>(config, triplets, n, csr);
+            }
+        }
+    }
+
+    return 0;
+}
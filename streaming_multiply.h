@@ -0,0 +1,336 @@
+#pragma once
+
+#include "csr_matrix.h"
+#include "matrix_layout.h"
+#include "matrix_market_writer.h"
+#include "memory_report.h"
+#include "sparse_multiply.h"
+
+#include <openvdb/openvdb.h>
+#include <openvdb/io/File.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Settings of an out-of-core product
+struct StreamingOptions
+{
+    size_t memoryBudget = size_t(1) << 30; // bytes for B, one panel of A and one panel of C together
+    bool pagedB = false;                   // read only the rows of B a panel needs instead of keeping all of B resident
+    double threshold = 0.0;
+    bool deterministic = false;
+    std::string gridName = "matrix";       // grid to read from both input files
+    ProductCounters *counters = nullptr;   // work counters for a ProgressReporter, optional
+};
+
+// What an out-of-core product did and how much memory it used
+struct StreamingReport
+{
+    int rows = 0;
+    int cols = 0;
+    int panels = 0;
+    int minPanelRows = 0;
+    int maxPanelRows = 0;
+    size_t nonZeros = 0;
+    size_t budget = 0;
+    size_t residentBytes = 0;    // B when resident, plus the per-thread accumulators
+    size_t peakWorkingBytes = 0; // largest measured resident + panel bytes
+    size_t baselineRss = 0;      // resident set size of the process when the product started
+    size_t peakRss = 0;          // peak resident set size of the process during the product
+    bool peakRssReset = false;   // whether the peak could be reset at the start; if not it may predate the product
+    std::vector<std::string> outputs;
+
+    size_t peakRssGrowth() const { return peakRss > baselineRss ? peakRss - baselineRss : 0; }
+    bool withinBudget() const { return peakWorkingBytes <= budget && peakRssGrowth() <= budget; }
+};
+
+// Function to print a streaming report
+inline void printStreamingReport(std::ostream &out, const StreamingReport &report)
+{
+    const double mb = 1.0 / (1 << 20);
+    out << "Product :: " << report.rows << " x " << report.cols << ", " << report.nonZeros << " non-zeros" << std::endl;
+    out << "Panels :: " << report.panels << " (" << report.minPanelRows << " to " << report.maxPanelRows << " rows)"
+        << std::endl;
+    out << std::fixed << std::setprecision(1);
+    out << "Memory budget :: " << report.budget * mb << " MB" << std::endl;
+    out << "Resident (B and accumulators) :: " << report.residentBytes * mb << " MB" << std::endl;
+    out << "Peak working set (measured) :: " << report.peakWorkingBytes * mb << " MB" << std::endl;
+    out << "Peak RSS growth :: " << report.peakRssGrowth() * mb << " MB (baseline " << report.baselineRss * mb
+        << " MB, peak " << report.peakRss * mb << " MB" << (report.peakRssReset ? "" : ", peak not reset") << ")"
+        << std::endl;
+    out << "Budget respected :: " << (report.withinBudget() ? "yes" : "no") << std::endl;
+    out.unsetf(std::ios::fixed);
+}
+
+// Function to return the world-space box holding rows [firstRow, lastRow) of a matrix grid.
+// Matrix grids keep the identity transform, so world and index coordinates coincide; every layout keeps z below 8.
+template <typename Layout>
+inline openvdb::BBoxd rowPanelBox(int firstRow, int lastRow, int cols)
+{
+    openvdb::Coord first = Layout::toCoord(firstRow, 0);
+    openvdb::Coord last = Layout::toCoord(lastRow - 1, std::max(0, cols - 1));
+    return openvdb::BBoxd(openvdb::Vec3d(first.x(), 0.0, 0.0), openvdb::Vec3d(last.x(), last.y(), 7.0));
+}
+
+// Function to read rows [firstRow, lastRow) of the matrix in a .vdb file into compressed rows numbered from firstRow.
+// Only the leaves that overlap the panel are read (for a symmetric grid, also those of the mirrored column strip); the
+// clipped grid is released before returning.
+// bytes is set to what the clipped grid and the compressed rows hold together, the peak of the conversion.
+template <typename Layout, typename GridType>
+inline CsrMatrixT<typename GridType::ValueType> readRowPanel(openvdb::io::File &file, const std::string &gridName,
+                                                            int firstRow, int lastRow, int cols, size_t &bytes)
+{
+    openvdb::BBoxd bbox = rowPanelBox<Layout>(firstRow, lastRow, cols);
+    typename GridType::Ptr panel = openvdb::gridPtrCast<GridType>(file.readGrid(gridName, bbox));
+    if (!panel)
+    {
+        OPENVDB_THROW(openvdb::TypeError, "grid " << gridName << " of " << file.filename() << " has the wrong value type");
+    }
+
+    // A symmetric grid stores the panel's entries above the diagonal in the columns [firstRow, lastRow) of the later
+    // rows, so that strip is read as well
+    if (isMatrixSymmetric(*panel) && lastRow < cols)
+    {
+        openvdb::CoordBBox strip = matrixWindowBox<Layout>(lastRow, firstRow, cols - lastRow, lastRow - firstRow);
+        typename GridType::Ptr mirrored = openvdb::gridPtrCast<GridType>(
+            file.readGrid(gridName, openvdb::BBoxd(strip.min().asVec3d(), strip.max().asVec3d())));
+        panel->tree().merge(mirrored->tree(), openvdb::MERGE_ACTIVE_STATES);
+    }
+
+    CsrMatrixT<typename GridType::ValueType> csr = gridToCsr<Layout>(*panel, lastRow - firstRow, cols, firstRow);
+    bytes = panel->memUsage() + csr.memUsage();
+    return csr;
+}
+
+// Function to read the whole matrix in a .vdb file into compressed rows, one row panel at a time, so that only the
+// clipped grid of one panel is in memory next to the rows gathered so far. Panels are sized, like those of
+// multiplyMatricesStreaming, to keep each clipped grid near maxPanelBytes; peakBytes is set to the most memory held
+// at once.
+template <typename Layout, typename GridType>
+inline CsrMatrixT<typename GridType::ValueType> readMatrixInPanels(openvdb::io::File &file, const std::string &gridName,
+                                                                  int rows, int cols, size_t maxPanelBytes,
+                                                                  size_t &peakBytes)
+{
+    CsrMatrixT<typename GridType::ValueType> csr;
+    csr.rows = rows;
+    csr.cols = cols;
+    csr.rowStart.assign(1, 0);
+    peakBytes = 0;
+
+    const int blockRows = Layout::TILE_ROWS;
+    double bytesPerRow = 0.0;
+    for (int firstRow = 0; firstRow < rows;)
+    {
+        int panelRows = blockRows;
+        if (bytesPerRow > 0.0)
+        {
+            panelRows = static_cast<int>(std::min<double>(rows, maxPanelBytes / bytesPerRow));
+        }
+        panelRows = std::min(rows - firstRow, std::max(blockRows, panelRows / blockRows * blockRows));
+
+        size_t bytes = 0;
+        CsrMatrixT<typename GridType::ValueType> panel =
+            readRowPanel<Layout, GridType>(file, gridName, firstRow, firstRow + panelRows, cols, bytes);
+        peakBytes = std::max(peakBytes, csr.memUsage() + bytes);
+
+        size_t offset = csr.rowStart.back();
+        for (int i = 0; i < panelRows; ++i)
+        {
+            csr.rowStart.push_back(offset + panel.rowStart[i + 1]);
+        }
+        csr.colIndex.insert(csr.colIndex.end(), panel.colIndex.begin(), panel.colIndex.end());
+        csr.values.insert(csr.values.end(), panel.values.begin(), panel.values.end());
+
+        bytesPerRow = std::max(bytesPerRow, static_cast<double>(bytes) / panelRows);
+        firstRow += panelRows;
+    }
+
+    csr.rowStart.shrink_to_fit();
+    csr.colIndex.shrink_to_fit();
+    csr.values.shrink_to_fit();
+    return csr;
+}
+
+// Function to return the path of row panel p of a .vdb output, e.g. C.vdb -> C.panel0003.vdb
+inline std::string panelPath(const std::string &output, int p)
+{
+    bool hasSuffix = output.size() > 4 && output.compare(output.size() - 4, 4, ".vdb") == 0;
+    std::string stem = hasSuffix ? output.substr(0, output.size() - 4) : output;
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), ".panel%04d.vdb", p);
+    return stem + suffix;
+}
+
+// Function to multiply two matrices stored in .vdb files, one row panel of A at a time, without holding A or C in memory.
+// Both files must hold a grid carrying "rows" and "cols" metadata, as the caches of readMatrixGridCached do.
+// B is converted to compressed rows once, a panel at a time, and kept resident or, with options.pagedB, only the rows
+// of B a panel needs are read for that panel. Each panel of A is read clipped to its rows, multiplied into a panel of
+// C, flushed and released: a .mtx output is one MatrixMarket file written panel by panel, any other output is one .vdb
+// file per panel (see panelPath) carrying "first_row" and "panel_rows" metadata.
+// Panels are whole leaf-high blocks of rows. The first one is a single block; after each panel its bytes per row are
+// measured and the next panel is sized from the largest cost seen so far, with a quarter of headroom, to fit
+// what the budget leaves over after B and the per-thread accumulators.
+template <typename Layout = SliceLayout, typename AccumType = double, typename GridType = openvdb::FloatGrid>
+inline StreamingReport multiplyMatricesStreaming(const std::string &fileA, const std::string &fileB,
+                                                 const std::string &output, const StreamingOptions &options)
+{
+    using ValueType = typename GridType::ValueType;
+
+    StreamingReport report;
+    report.budget = options.memoryBudget;
+    report.peakRssReset = resetPeakRss();
+    report.baselineRss = currentRssBytes();
+
+    openvdb::io::File inputA(fileA), inputB(fileB);
+    inputA.open(true); // delayed loading
+    inputB.open(true);
+
+    openvdb::GridBase::Ptr metaA = inputA.readGridMetadata(options.gridName);
+    openvdb::GridBase::Ptr metaB = inputB.readGridMetadata(options.gridName);
+    const int rows = metaA->metaValue<openvdb::Int32>("rows");
+    const int inner = std::max(metaA->metaValue<openvdb::Int32>("cols"), metaB->metaValue<openvdb::Int32>("rows"));
+    const int cols = metaB->metaValue<openvdb::Int32>("cols");
+    metaA.reset();
+    metaB.reset();
+    report.rows = rows;
+    report.cols = cols;
+
+    // B, unless paged, and one sparse accumulator per thread stay in memory for the whole product
+    CsrMatrixT<ValueType> residentB;
+    if (!options.pagedB)
+    {
+        size_t bytes = 0;
+        residentB = readMatrixInPanels<Layout, GridType>(inputB, options.gridName, inner, cols, options.memoryBudget / 4,
+                                                         bytes);
+        report.peakWorkingBytes = bytes;
+        inputB.close();
+    }
+    size_t accumulatorBytes = static_cast<size_t>(cols) * (sizeof(AccumType) + sizeof(int));
+    report.residentBytes = residentB.memUsage() + tbb::this_task_arena::max_concurrency() * accumulatorBytes;
+    if (report.residentBytes >= options.memoryBudget)
+    {
+        OPENVDB_THROW(openvdb::ValueError, "memory budget of " << options.memoryBudget << " bytes does not cover the "
+                                                               << report.residentBytes << " resident bytes");
+    }
+    const size_t panelBudget = options.memoryBudget - report.residentBytes;
+
+    // MatrixMarket output gets a fixed-width nonzero count that is filled in once the last panel is written
+    const bool writeMtx = output.size() > 4 && output.compare(output.size() - 4, 4, ".mtx") == 0;
+    const int countWidth = 20;
+    std::ofstream mtx;
+    std::streampos countPos;
+    if (writeMtx)
+    {
+        mtx.open(output);
+        if (!mtx.is_open())
+        {
+            std::cerr << "Error: Unable to open file " << output << std::endl;
+            exit(1);
+        }
+        mtx << "%%MatrixMarket matrix coordinate real general" << std::endl;
+        mtx << rows << " " << cols << " ";
+        countPos = mtx.tellp();
+        mtx << std::setw(countWidth) << 0 << std::endl;
+        report.outputs.push_back(output);
+    }
+
+    const int blockRows = Layout::TILE_ROWS;
+    double bytesPerRow = 0.0;
+    for (int firstRow = 0; firstRow < rows;)
+    {
+        int panelRows = blockRows;
+        if (bytesPerRow > 0.0)
+        {
+            panelRows = static_cast<int>(std::min<double>(rows, panelBudget / (1.25 * bytesPerRow)));
+        }
+        panelRows = std::min(rows - firstRow, std::max(blockRows, panelRows / blockRows * blockRows));
+        const int lastRow = firstRow + panelRows;
+
+        // Read the panel of A, and with paged B the rows of B its columns reach
+        size_t panelBytes = 0;
+        CsrMatrixT<ValueType> panelA = readRowPanel<Layout, GridType>(inputA, options.gridName, firstRow, lastRow, inner,
+                                                                      panelBytes);
+
+        CsrMatrixT<ValueType> pagedB;
+        const CsrMatrixT<ValueType> *B = &residentB;
+        if (options.pagedB && panelA.nonZeros() > 0)
+        {
+            auto [minCol, maxCol] = std::minmax_element(panelA.colIndex.begin(), panelA.colIndex.end());
+            const int firstInner = *minCol, lastInner = *maxCol + 1;
+
+            size_t bytesB = 0;
+            pagedB = readRowPanel<Layout, GridType>(inputB, options.gridName, firstInner, lastInner, cols, bytesB);
+            panelBytes += bytesB;
+
+            // Number the columns of the panel like the rows of the part of B that was read
+            tbb::parallel_for(size_t(0), panelA.nonZeros(), [&](size_t p)
+            {
+                panelA.colIndex[p] -= firstInner;
+            });
+            panelA.cols = lastInner - firstInner;
+            B = &pagedB;
+        }
+
+        auto accumulate = [&](int i, SparseAccumulatorT<AccumType> &spa)
+        {
+            accumulateRow(panelA, *B, i - firstRow, options.threshold, spa);
+        };
+        typename GridType::Ptr panelC = assembleProductRows<Layout, AccumType, GridType>(panelRows, cols, 0.0,
+                                                                                        options.deterministic, accumulate,
+                                                                                        firstRow, options.counters);
+        panelBytes += panelC->memUsage();
+        report.nonZeros += panelC->activeVoxelCount();
+
+        // Flush the panel and release it
+        if (writeMtx)
+        {
+            CsrMatrixT<ValueType> rowsC = gridToCsr<Layout>(*panelC, panelRows, cols, firstRow);
+            panelBytes += rowsC.memUsage();
+            writeMatrixMarketRows(mtx, rowsC, firstRow);
+        }
+        else
+        {
+            panelC->setName(options.gridName);
+            panelC->insertMeta("rows", openvdb::Int32Metadata(rows));
+            panelC->insertMeta("cols", openvdb::Int32Metadata(cols));
+            panelC->insertMeta("first_row", openvdb::Int32Metadata(firstRow));
+            panelC->insertMeta("panel_rows", openvdb::Int32Metadata(panelRows));
+
+            openvdb::GridPtrVec grids;
+            grids.push_back(panelC);
+            std::string path = panelPath(output, report.panels);
+            openvdb::io::File file(path);
+            file.write(grids);
+            file.close();
+            report.outputs.push_back(path);
+        }
+
+        bytesPerRow = std::max(bytesPerRow, static_cast<double>(panelBytes) / panelRows);
+        report.peakWorkingBytes = std::max(report.peakWorkingBytes, report.residentBytes + panelBytes);
+        report.minPanelRows = report.panels == 0 ? panelRows : std::min(report.minPanelRows, panelRows);
+        report.maxPanelRows = std::max(report.maxPanelRows, panelRows);
+        ++report.panels;
+        firstRow = lastRow;
+    }
+
+    if (writeMtx)
+    {
+        mtx.seekp(countPos);
+        mtx << std::setw(countWidth) << report.nonZeros;
+        mtx.close();
+    }
+    inputA.close();
+    if (options.pagedB)
+    {
+        inputB.close();
+    }
+
+    report.peakRss = peakRssBytes();
+    return report;
+}